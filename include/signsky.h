@@ -74,18 +74,39 @@ extern int daemon(int, int);
 #define signsky_atomic_read(x)		\
     __atomic_load_n(x, __ATOMIC_SEQ_CST)
 
+#define signsky_atomic_read_relaxed(x)	\
+    __atomic_load_n(x, __ATOMIC_RELAXED)
+
+#define signsky_atomic_read_acquire(x)	\
+    __atomic_load_n(x, __ATOMIC_ACQUIRE)
+
 #define signsky_atomic_write(x, v)	\
     __atomic_store_n(x, v, __ATOMIC_SEQ_CST)
 
+#define signsky_atomic_write_relaxed(x, v)	\
+    __atomic_store_n(x, v, __ATOMIC_RELAXED)
+
+#define signsky_atomic_write_release(x, v)	\
+    __atomic_store_n(x, v, __ATOMIC_RELEASE)
+
 #define signsky_atomic_cas(x, e, d)	\
     __atomic_compare_exchange(x, e, d, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 
+#define signsky_atomic_cas_relaxed(x, e, d)	\
+    __atomic_compare_exchange(x, e, d, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
 #define signsky_atomic_cas_simple(x, e, d)	\
     __sync_bool_compare_and_swap(x, e, d)
 
 #define signsky_atomic_add(x, e)	\
     __atomic_fetch_add(x, e, __ATOMIC_SEQ_CST)
 
+#define signsky_atomic_sub(x, e)	\
+    __atomic_fetch_sub(x, e, __ATOMIC_SEQ_CST)
+
+#define signsky_atomic_fence()		\
+    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
 /*
  * Use architecture specific instructions to hint to the CPU that
  * we are in a spinloop hopefully avoiding a memory order violation
@@ -105,6 +126,17 @@ extern int daemon(int, int);
 #error "unsupported architecture"
 #endif
 
+/*
+ * The cache line size we pad shared data structures to, so that
+ * data written by different processes do not share a cache line.
+ * Apple its M-series cores use 128 byte cache lines.
+ */
+#if defined(__APPLE__) && (defined(__arm64__) || defined(__aarch64__))
+#define SIGNSKY_CACHE_LINE		128
+#else
+#define SIGNSKY_CACHE_LINE		64
+#endif
+
 /* Length of our symmetrical keys, in bytes. */
 #define SIGNSKY_KEY_LENGTH		32
 
@@ -117,6 +149,9 @@ extern int daemon(int, int);
 #define SIGNSKY_PROC_STATUS		6
 #define SIGNSKY_PROC_MAX		7
 
+/* The maximum number of workers for process types that allow it. */
+#define SIGNSKY_WORKERS_MAX		16
+
 /* Key states. */
 #define SIGNSKY_KEY_EMPTY		0
 #define SIGNSKY_KEY_GENERATING		1
@@ -134,23 +169,122 @@ struct signsky_key {
 
 /*
  * An SA context with an SPI, salt, sequence number and underlying cipher.
+ *
+ * The key the cipher was set up with is kept so the SA can be handed
+ * to a new worker on a warm restart, signsky_sa_clear() wipes both.
  */
 struct signsky_sa {
 	u_int32_t		spi;
 	u_int32_t		salt;
 	u_int64_t		seqnr;
 	void			*cipher;
+	u_int8_t		key[SIGNSKY_KEY_LENGTH];
+};
+
+/*
+ * On a warm restart (see signsky_proc_restart()) an encrypt or decrypt
+ * worker hands its SAs to its successor via its handoff slot. Encrypt
+ * only uses sa[peer][0], decrypt uses both for its two RX SAs.
+ *
+ * Overwatch moves the slot from EMPTY to WAIT before it starts the new
+ * worker, the old worker moves it to READY once it placed its SAs in
+ * there and keeps on working. The new worker takes the SAs, sets up
+ * its ciphers and moves the slot to TAKEOVER. The old worker finishes
+ * its burst, moves the slot to RELEASED and exits without touching
+ * the rings again. Only then does the new worker move it to EMPTY and
+ * start on the rings.
+ *
+ * Once the old worker is reaped overwatch sets gone, the new worker no
+ * longer waits for RELEASED then. If it does not exit in time it is
+ * killed first. If the slot was still WAIT it is moved to COLD, the
+ * new worker moves it to EMPTY and starts without SAs.
+ */
+#define SIGNSKY_HANDOFF_EMPTY		0
+#define SIGNSKY_HANDOFF_WAIT		1
+#define SIGNSKY_HANDOFF_READY		2
+#define SIGNSKY_HANDOFF_COLD		3
+#define SIGNSKY_HANDOFF_TAKEOVER	4
+#define SIGNSKY_HANDOFF_RELEASED	5
+
+struct signsky_handoff {
+	volatile int		state;
+	volatile int		gone;
+	struct signsky_sa	sa[SIGNSKY_PEERS_MAX][2];
+};
+
+/* The maximum number of IPv4 prefixes routed to a single peer. */
+#define SIGNSKY_PEER_ROUTES_MAX		16
+
+/*
+ * An IPv4 prefix that is routed to a peer, in network byte order.
+ */
+struct signsky_route {
+	u_int32_t		net;
+	u_int32_t		mask;
+};
+
+/*
+ * A peer, the other end of one of our tunnels.
+ *
+ * The peer its configured address is where we start sending to, ip
+ * and port follow the peer if its address changes. Packets for the
+ * inner destinations in routes are sent to this peer.
+ */
+struct signsky_peer {
+	struct sockaddr_in	addr;
+	volatile u_int32_t	ip;
+	volatile u_int16_t	port;
+
+	u_int16_t		nroutes;
+	struct signsky_route	routes[SIGNSKY_PEER_ROUTES_MAX];
+
+	/*
+	 * The SPIs in use, the traffic counters for the peer are kept
+	 * by the processes themselves (see signsky_stat_peer()).
+	 */
+	volatile u_int32_t	tx_spi;
+	volatile u_int32_t	rx_spi;
+	volatile u_int32_t	rx_pending;
+
+	/*
+	 * The ethernet address packets from the peer arrived from on the
+	 * AF_XDP socket (see signsky_packet), which is where the crypto
+	 * process sends to when it transmits via XDP. 0 if unknown.
+	 */
+	volatile u_int64_t	ether;
+
+	/*
+	 * The path MTU towards the peer as the kernel learned it from
+	 * ICMP errors, maintained by the crypto process. 0 if unknown.
+	 */
+	volatile u_int32_t	pmtu;
+};
+
+/*
+ * The CPUs the workers of a process type are pinned to, worker n
+ * runs on cpu[n % ncpu]. If priority is not 0 the workers run under
+ * SCHED_FIFO with that priority.
+ */
+struct signsky_proc_sched {
+	u_int16_t		ncpu;
+	u_int16_t		cpu[SIGNSKY_WORKERS_MAX];
+	int			priority;
 };
 
 /*
  * A process under the control of the parent process.
+ *
+ * The retired field is the signsky_time_ns() at which the process was
+ * told to hand over to its successor on a warm restart, 0 otherwise.
  */
 struct signsky_proc {
 	pid_t			pid;
 	uid_t			uid;
 	gid_t			gid;
+	u_int16_t		id;
 	u_int16_t		type;
 	void			*arg;
+	u_int64_t		retired;
 	const char		*name;
 	void			(*entry)(struct signsky_proc *);
 
@@ -158,46 +292,176 @@ struct signsky_proc {
 };
 
 /*
- * The anti-replay window.
+ * The anti-replay window is kept as a ring of 64-bit words as in
+ * RFC 6479. The bit for a packet number lives in word (pn / 64) %
+ * SIGNSKY_ARWIN_WORDS so moving the window forward only clears the
+ * words it moves over, nothing is ever shifted.
+ *
+ * The window size itself is configurable up to SIGNSKY_ARWIN_MAX,
+ * there must always be at least one word more than the window covers.
+ */
+#define SIGNSKY_ARWIN_DEFAULT	64
+#define SIGNSKY_ARWIN_MAX	4096
+#define SIGNSKY_ARWIN_WORDS	128
+#define SIGNSKY_ARWIN_MASK	(SIGNSKY_ARWIN_WORDS - 1)
+
+/*
+ * The anti-replay window, shared between all decrypt workers.
+ * Updates to it are serialized using the lock, which holds the pid of
+ * the decrypt worker that has it so overwatch can release it if it
+ * has to kill that worker.
  */
 struct signsky_arwin {
+	volatile int		lock;
 	volatile u_int64_t	last;
-	u_int64_t		bitmap;
+	volatile u_int64_t	bitmap[SIGNSKY_ARWIN_WORDS];
 };
 
-#define SIGNSKY_ARWIN_SIZE	64
+/*
+ * The TX sequence number, shared between all encrypt workers.
+ *
+ * It is not reset when a new TX SA is installed as the workers each
+ * swap to the new key at a slightly different moment, resetting it
+ * would risk reusing a nonce under the same key.
+ */
+struct signsky_seqnr {
+	volatile u_int64_t	next;
+};
+
+/*
+ * The SPI table maps the SPI of each RX SA that may still be in use
+ * onto the peer it belongs to, it is open-addressed with linear probing.
+ *
+ * Each entry is a single 64-bit word holding the SPI in the upper and
+ * the peer in the lower 32 bits so readers never see a torn entry and
+ * never have to take a lock. Keying is the only writer.
+ *
+ * Removed entries become tombstones. Once there are too many of them
+ * keying rebuilds the table into the other copy and flips active, the
+ * old copy is not written to again for at least SIGNSKY_SPI_TABLE_GRACE
+ * seconds so readers still looking at it are long done with it.
+ */
+#define SIGNSKY_SPI_TABLE_BITS		10
+#define SIGNSKY_SPI_TABLE_SIZE		(1 << SIGNSKY_SPI_TABLE_BITS)
+#define SIGNSKY_SPI_TABLE_MASK		(SIGNSKY_SPI_TABLE_SIZE - 1)
+#define SIGNSKY_SPI_TABLE_GRACE		2
+
+struct signsky_spi_table {
+	volatile u_int32_t	active;
+	u_int32_t		dead;
+	u_int64_t		flipped;
+	volatile u_int64_t	slots[2][SIGNSKY_SPI_TABLE_SIZE]
+	    __attribute__((aligned(SIGNSKY_CACHE_LINE)));
+};
 
 /*
  * Used to pass all the queues to the clear and crypto sides.
  * Each process is responsible for removing the queues they
  * do not need themselves.
+ *
+ * The tx and rx keys are arrays, holding one key per encrypt
+ * or decrypt worker respectively for each peer, see SIGNSKY_KEY_SLOT().
+ * The anti-replay windows and TX sequence numbers are arrays holding
+ * one entry per peer, the SPI table is shared by all peers.
+ *
+ * The handoff slots are two arrays, one holding a slot per encrypt
+ * worker and one holding a slot per decrypt worker, see
+ * SIGNSKY_HANDOFF_SLOT(). They are separate so that encrypt workers
+ * never see RX SAs and decrypt workers never see TX SAs.
  */
+#define SIGNSKY_KEY_SLOT(keys, type, peer, id)		\
+	(&(keys)[((peer) * signsky->workers[type]) + (id)])
+
+#define SIGNSKY_HANDOFF_SLOT(io, type, id)				\
+	((type) == SIGNSKY_PROC_DECRYPT ?				\
+	    &(io)->handoff_rx[(id)] : &(io)->handoff_tx[(id)])
+
 struct signsky_proc_io {
-	struct signsky_key	*tx;
-	struct signsky_key	*rx;
-	struct signsky_arwin	*arwin;
-
-	struct signsky_ring	*clear;
-	struct signsky_ring	*crypto;
-	struct signsky_ring	*encrypt;
-	struct signsky_ring	*decrypt;
+	struct signsky_key		*tx;
+	struct signsky_key		*rx;
+	struct signsky_arwin		*arwin;
+	struct signsky_seqnr		*seqnr;
+	struct signsky_spi_table	*spi;
+	struct signsky_handoff		*handoff_tx;
+	struct signsky_handoff		*handoff_rx;
+
+	struct signsky_ring		*clear;
+	struct signsky_ring		*crypto;
+	struct signsky_ring		*encrypt;
+	struct signsky_ring		*decrypt;
 };
 
+/*
+ * The counters of a single process on their own cache line(s), only
+ * the process itself writes to them so it does not need atomic
+ * operations, just relaxed stores so the status process never reads
+ * a torn value.
+ *
+ * Each process points signsky_stats at its own counters and
+ * signsky_peer_stats at its own per peer traffic counters. The
+ * clear processes count what they wrote onto the tunnel for a peer
+ * (rx), the crypto process what it sent to the peer (tx). The status
+ * process adds them up when asked.
+ */
+struct signsky_peer_stats {
+	u_int64_t	pkt;
+	u_int64_t	last;
+	u_int64_t	bytes;
+};
+
+struct signsky_stats {
+	struct signsky_proc_stats	proc;
+	struct signsky_peer_stats	peers[SIGNSKY_PEERS_MAX];
+} __attribute__((aligned(SIGNSKY_CACHE_LINE)));
+
+#define signsky_stat_add(f, n)						\
+	signsky_atomic_write_relaxed(&signsky_stats->f,			\
+	    signsky_stats->f + (n))
+
+#define signsky_stat_peer(p, n, len)					\
+	do {								\
+		struct signsky_peer_stats	*_ps;			\
+									\
+		_ps = &signsky_peer_stats[(p)];				\
+		signsky_atomic_write_relaxed(&_ps->pkt,			\
+		    _ps->pkt + (n));					\
+		signsky_atomic_write_relaxed(&_ps->bytes,		\
+		    _ps->bytes + (len));				\
+		signsky_atomic_write_relaxed(&_ps->last,		\
+		    signsky->uptime);					\
+	} while (0)
+
 /*
  * A shared memory ring queue with space for up to 4096 elements.
  * The actual size is given via signsky_ring_init() and must be <= 4096.
+ *
+ * The producer and consumer spans each live on their own cache line
+ * so that producers and consumers do not false share.
+ *
+ * A ring is either multi-producer, multi-consumer (SIGNSKY_RING_MPMC)
+ * or single-producer, single-consumer (SIGNSKY_RING_SPSC).
+ *
+ * Rings created via signsky_ring_alloc() have a doorbell that idle
+ * consumers park on, producers only ring it if waiting is non-zero.
  */
+#define SIGNSKY_RING_MPMC		1
+#define SIGNSKY_RING_SPSC		2
+
 struct signsky_ring_span {
 	volatile u_int32_t	head;
 	volatile u_int32_t	tail;
-};
+} __attribute__((aligned(SIGNSKY_CACHE_LINE)));
 
 struct signsky_ring {
 	size_t				elm;
 	u_int32_t			mask;
+	u_int32_t			type;
+	int				doorbell[2];
+	volatile u_int32_t		waiting;
 	struct signsky_ring_span	producer;
 	struct signsky_ring_span	consumer;
-	volatile uintptr_t		data[4096];
+	volatile uintptr_t		data[4096]
+	    __attribute__((aligned(SIGNSKY_CACHE_LINE)));
 };
 
 /*
@@ -209,6 +473,26 @@ struct signsky_pool {
 	struct signsky_ring	queue;
 };
 
+/*
+ * The most free entries a process keeps in its local pool cache. The
+ * real limit is scaled down from the pool size and the number of
+ * processes so that all caches together hold at most 1 in
+ * SIGNSKY_POOL_CACHE_SHARE entries of a pool, see signsky_pool_cache_init().
+ */
+#define SIGNSKY_POOL_CACHE_MAX		32
+#define SIGNSKY_POOL_CACHE_SHARE	4
+
+/*
+ * A process local cache of free entries sitting in front of a pool,
+ * entries move between it and the pool in bulks of half its limit.
+ * With a limit of 0 the cache is not used.
+ */
+struct signsky_pool_cache {
+	size_t			max;
+	size_t			count;
+	void			*entries[SIGNSKY_POOL_CACHE_MAX];
+};
+
 /*
  * An encrypted packet its head, includes the ESP header *and* the
  * 64-bit packet number used as part of the nonce later.
@@ -246,17 +530,60 @@ struct signsky_ipsec_tail {
  */
 #define SIGNSKY_PACKET_MAX_LEN		(SIGNSKY_PACKET_DATA_LEN + 64)
 
+/*
+ * Packets come from one of several pools (classes), each with a
+ * different buffer size. Reads from the interfaces pick the class
+ * from the length the io process expects to read, see
+ * signsky_packet_get(), anything else picks it from the length it
+ * is going to write with signsky_packet_get_len().
+ */
+#define SIGNSKY_PACKET_CLASS_SMALL	0
+#define SIGNSKY_PACKET_CLASS_LARGE	1
+#define SIGNSKY_PACKET_CLASS_MAX	2
+
+/* The packet data length of the small class, a regular ethernet MTU. */
+#define SIGNSKY_PACKET_SMALL_DATA_LEN	1500
+
+/* The default number of packets in each pool. */
+#define SIGNSKY_PACKET_POOL_DEFAULT	1024
+
 /* The minimum size we can read from an interface. */
 #define SIGNSKY_PACKET_MIN_LEN		12
 
+/* The default number of microseconds we spin before parking. */
+#define SIGNSKY_SPIN_DEFAULT		100
+
+/* The number of packets in a single run we try to read or move. */
+#define SIGNSKY_PACKETS_PER_EVENT	64
+
 /*
  * A network packet.
+ *
+ * The length must always cover everything that was written into buf,
+ * also for packets that are released because they are invalid, as
+ * only those bytes are cleared when the packet is handed out again.
+ *
+ * The ts is the signsky_time_ns() the packet was read from either
+ * interface at, used for the latency histograms.
+ *
+ * The ether is the source ethernet address of packets that were read
+ * from the AF_XDP socket, 0 otherwise.
+ *
+ * With io-uring the kernel places the header of a multishot recvmsg()
+ * into uring, the source address into addr and the packet itself into
+ * buf in one go (see src/uring.c), so these must stay in this order.
  */
 struct signsky_packet {
-	struct sockaddr_in	addr;
 	size_t			length;
 	u_int32_t		target;
-	u_int8_t		buf[SIGNSKY_PACKET_MAX_LEN];
+	u_int32_t		peer;
+	u_int32_t		class;
+	size_t			size;
+	u_int64_t		ts;
+	u_int64_t		ether;
+	u_int8_t		uring[16];
+	struct sockaddr_in	addr;
+	u_int8_t		buf[];
 };
 
 /*
@@ -269,6 +596,38 @@ struct signsky_sun {
 	char		path[256];		/* XXX */
 };
 
+/* The cipher suites that can be selected with the cipher option. */
+#define SIGNSKY_CIPHER_AES_256_GCM		1
+#define SIGNSKY_CIPHER_CHACHA20_POLY1305	2
+
+/* Optional features, Linux only. */
+#define SIGNSKY_FLAG_UDP_GSO		(1 << 0)
+#define SIGNSKY_FLAG_UDP_GRO		(1 << 1)
+#define SIGNSKY_FLAG_TUN_OFFLOAD	(1 << 2)
+#define SIGNSKY_FLAG_HUGEPAGES		(1 << 3)
+#define SIGNSKY_FLAG_MEM_LOCK		(1 << 4)
+#define SIGNSKY_FLAG_MEM_PREFAULT	(1 << 5)
+#define SIGNSKY_FLAG_XDP		(1 << 6)
+#define SIGNSKY_FLAG_IO_URING		(1 << 7)
+
+/*
+ * Shared memory allocations of at least this size are backed by
+ * huge pages when memory-hugepages is enabled.
+ */
+#define SIGNSKY_HUGEPAGE_MIN		(1024 * 1024)
+
+/*
+ * A single operation in a batch passed to signsky_cipher_encrypt_batch()
+ * or signsky_cipher_decrypt_batch(). For decryption the result of the
+ * verification for each packet is stored in ret (0 or -1).
+ */
+struct signsky_cipher_op {
+	struct signsky_packet	*pkt;
+	u_int8_t		nonce[12];
+	u_int8_t		aad[12];
+	int			ret;
+};
+
 /*
  * The shared state between processes.
  */
@@ -276,33 +635,70 @@ struct signsky_state {
 	/* Time maintained by overwatch. */
 	volatile u_int64_t	uptime;
 
-	/* Local and remote addresses. */
-	struct sockaddr_in	peer;
+	/*
+	 * Bumped by keying after it made new keys pending, the encrypt
+	 * and decrypt workers only look at their key slots if it changed.
+	 */
+	volatile u_int32_t	keygen;
+
+	/* Local address. */
 	struct sockaddr_in	local;
 
-	/* The actual peer ip and port. */
-	volatile u_int32_t	peer_ip;
-	volatile u_int16_t	peer_port;
+	/* The smallest path MTU of all peers, 0 if none is known. */
+	volatile u_int32_t	pmtu;
+
+	/* The peers, indexed by their id. */
+	u_int16_t		npeers;
+	struct signsky_peer	peers[SIGNSKY_PEERS_MAX];
 
 	/* The users the different processes runas. */
 	char			*runas[SIGNSKY_PROC_MAX];
 
+	/* The number of workers started per process type. */
+	u_int16_t		workers[SIGNSKY_PROC_MAX];
+
+	/* CPU pinning and scheduling policy per process type. */
+	struct signsky_proc_sched	sched[SIGNSKY_PROC_MAX];
+
+	/* The size of the anti-replay window in packets. */
+	u_int32_t		arwin_size;
+
+	/* Microseconds an idle process spins before it parks. */
+	u_int32_t		spin;
+
+	/* Optional features that were enabled (SIGNSKY_FLAG_*). */
+	u_int32_t		flags;
+
+	/* The cipher suite in use (SIGNSKY_CIPHER_*). */
+	u_int32_t		cipher;
+
+	/* Packets per pool class and the NUMA node to bind them to. */
+	u_int32_t		pool[SIGNSKY_PACKET_CLASS_MAX];
+	int			pool_numa;
+
 	/* The keying socket. */
 	struct signsky_sun	keying;
 
 	/* The status socket. */
 	struct signsky_sun	status;
 
+	/* The interface and queue the crypto-xdp option selected. */
+	char			xdp_ifname[16];
+	u_int32_t		xdp_queue;
+
 	/* The signsky instance name. */
 	char			instance[16];	/* XXX */
 
-	/* Tx and Rx statistics. */
-	struct signsky_ifstat	tx;
-	struct signsky_ifstat	rx;
-	u_int32_t		rx_pending;
+	/* The counters for each process, see signsky_stat_add(). */
+	struct signsky_stats	stats[SIGNSKY_PROC_MAX][SIGNSKY_WORKERS_MAX];
+
+	/* Ring and pool occupancy, only written by overwatch. */
+	struct signsky_ring_stats	rings[SIGNSKY_RING_MAX];
 };
 
 extern struct signsky_state	*signsky;
+extern struct signsky_proc_stats	*signsky_stats;
+extern struct signsky_peer_stats	*signsky_peer_stats;
 
 /* src/config.c */
 void	signsky_config_init(void);
@@ -311,26 +707,42 @@ void	signsky_config_load(const char *);
 /* src/signsky.c */
 void	signsky_signal_trap(int);
 int	signsky_last_signal(void);
+int	signsky_signal_pending(void);
 void	signsky_signal_ignore(int);
 void	fatal(const char *, ...) __attribute__((format (printf, 1, 2)))
 	    __attribute__((noreturn));
 
 /* src/proc. */
-void	signsky_proc_reap(void);
+int	signsky_proc_reap(void);
 void	signsky_proc_start(void);
+void	signsky_proc_restart(void);
+void	signsky_proc_retire_check(void);
+int	signsky_handoff_ready(struct signsky_handoff *);
+int	signsky_handoff_wait(struct signsky_handoff *);
+int	signsky_handoff_takeover(struct signsky_handoff *);
+int	signsky_handoff_asked(struct signsky_handoff *);
+void	signsky_handoff_release(struct signsky_handoff *);
 void	signsky_proc_killall(int);
 void	signsky_proc_init(char **);
 void	signsky_proc_shutdown(void);
 void	signsky_proc_title(const char *);
+void	signsky_proc_sample(void);
 void	signsky_proc_privsep(struct signsky_proc *);
-void	signsky_proc_create(u_int16_t,
+void	signsky_proc_create(u_int16_t, u_int16_t,
 	    void (*entry)(struct signsky_proc *), void *);
 
+const char		*signsky_proc_name(u_int16_t);
 struct signsky_proc	*signsky_process(void);
 
 /* src/packet.c */
 void	signsky_packet_init(void);
+void	signsky_packet_sample(void);
+void	signsky_packet_cache_flush(void);
+void	signsky_packet_readlen(size_t);
+void	signsky_packet_truncated(void);
+size_t	signsky_packet_room(struct signsky_packet *);
 void	signsky_packet_release(struct signsky_packet *);
+int	signsky_packet_peer(struct signsky_packet *);
 int	signsky_packet_crypto_checklen(struct signsky_packet *);
 
 void	*signsky_packet_info(struct signsky_packet *);
@@ -339,33 +751,81 @@ void	*signsky_packet_tail(struct signsky_packet *);
 void	*signsky_packet_head(struct signsky_packet *);
 
 struct signsky_packet	*signsky_packet_get(void);
+struct signsky_packet	*signsky_packet_get_len(size_t);
+struct signsky_packet	*signsky_packet_scratch(void);
 
 /* src/pool.c */
 void	*signsky_pool_get(struct signsky_pool *);
 void	signsky_pool_put(struct signsky_pool *, void *);
+void	*signsky_pool_cache_get(struct signsky_pool *,
+	    struct signsky_pool_cache *);
+void	signsky_pool_cache_init(struct signsky_pool *,
+	    struct signsky_pool_cache *, size_t);
+void	signsky_pool_cache_flush(struct signsky_pool *,
+	    struct signsky_pool_cache *);
+void	signsky_pool_cache_put(struct signsky_pool *,
+	    struct signsky_pool_cache *, void *);
 
 struct signsky_pool	*signsky_pool_init(size_t, size_t);
 
+/* src/spi.c */
+void	signsky_spi_remove(struct signsky_spi_table *, u_int32_t);
+void	signsky_spi_insert(struct signsky_spi_table *, u_int32_t, u_int32_t);
+int	signsky_spi_lookup(struct signsky_spi_table *, u_int32_t, u_int32_t *);
+
 /* src/ring.c */
 size_t	signsky_ring_pending(struct signsky_ring *);
 void	*signsky_ring_dequeue(struct signsky_ring *);
 size_t	signsky_ring_available(struct signsky_ring *);
-void	signsky_ring_init(struct signsky_ring *, size_t);
+void	signsky_ring_init(struct signsky_ring *, size_t, u_int32_t);
+void	signsky_ring_sample(struct signsky_ring_stats *, size_t, size_t);
 int	signsky_ring_queue(struct signsky_ring *, void *);
+size_t	signsky_ring_queue_burst(struct signsky_ring *, void **, size_t);
+size_t	signsky_ring_dequeue_burst(struct signsky_ring *, void **, size_t);
+void	signsky_ring_idle(struct signsky_ring *, int, u_int64_t *);
 
-struct signsky_ring	*signsky_ring_alloc(size_t);
+struct signsky_ring	*signsky_ring_alloc(size_t, u_int32_t);
 
 /* src/utils.c */
 void	signsky_shm_detach(void *);
 void	signsky_mem_zero(void *, size_t);
+u_int64_t	signsky_time_ns(void);
+void	signsky_stat_latency(u_int64_t *, u_int64_t, u_int64_t);
+int	signsky_cpu_has_aes(void);
+const char	*signsky_cipher_suite_name(u_int32_t);
 void	*signsky_alloc_shared(size_t, int *);
 int	signsky_unix_socket(struct signsky_sun *);
 int	signsky_key_install(struct signsky_key *, struct signsky_sa *);
+void	signsky_sa_clear(struct signsky_sa *);
+void	signsky_sa_export(struct signsky_sa *, struct signsky_sa *);
+void	signsky_sa_import(struct signsky_sa *, struct signsky_sa *);
 
 /* platform bits. */
 int	signsky_platform_tundev_create(void);
 ssize_t	signsky_platform_tundev_read(int, struct signsky_packet *);
+u_int32_t	signsky_platform_tundev_mtu(void);
 ssize_t	signsky_platform_tundev_write(int, struct signsky_packet *);
+ssize_t	signsky_platform_tundev_read_offload(int, void **, size_t);
+void	signsky_platform_doorbell_ring(int);
+void	signsky_platform_doorbell_drain(int);
+void	signsky_platform_doorbell_create(int *);
+void	signsky_platform_numa_bind(void *, size_t, int);
+void	signsky_platform_cpu_pin(u_int16_t);
+
+#if defined(__linux__)
+/* src/uring.c */
+void	signsky_uring_submit(void);
+int	signsky_uring_init(int, u_int16_t);
+size_t	signsky_uring_recv(void **, size_t);
+void	signsky_uring_send(struct signsky_packet *);
+
+/* src/xdp.c */
+void	signsky_xdp_flush(void);
+size_t	signsky_xdp_recv(void **, size_t);
+int	signsky_xdp_init(const struct sockaddr_in *);
+int	signsky_xdp_send(struct signsky_packet *,
+	    const struct sockaddr_in *, u_int64_t);
+#endif
 
 /* Worker entry points. */
 void	signsky_clear_entry(struct signsky_proc *) __attribute__((noreturn));
@@ -376,6 +836,7 @@ void	signsky_decrypt_entry(struct signsky_proc *) __attribute__((noreturn));
 void	signsky_encrypt_entry(struct signsky_proc *) __attribute__((noreturn));
 
 /* The cipher goo. */
+int	signsky_cipher_supports(u_int32_t);
 size_t	signsky_cipher_overhead(void);
 void	signsky_cipher_cleanup(void *);
 void	*signsky_cipher_setup(struct signsky_key *);
@@ -383,5 +844,9 @@ void	signsky_cipher_encrypt(void *, const void *, size_t, const void *,
 	    size_t, struct signsky_packet *);
 int	signsky_cipher_decrypt(void *, const void *, size_t, const void *,
 	    size_t, struct signsky_packet *);
+void	signsky_cipher_encrypt_batch(void *, struct signsky_cipher_op *,
+	    size_t);
+void	signsky_cipher_decrypt_batch(void *, struct signsky_cipher_op *,
+	    size_t);
 
 #endif
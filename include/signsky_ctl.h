@@ -27,8 +27,71 @@ struct signsky_ifstat {
 	volatile u_int64_t	bytes;
 };
 
+/* The number of buckets in a latency histogram. */
+#define SIGNSKY_LATENCY_BUCKETS		32
+
+/*
+ * Counters kept by each process, the pipeline drops and the latency
+ * histograms. Bucket n of a histogram counts packets that took less
+ * than 2^n nanoseconds (and at least 2^(n-1)), the last bucket counts
+ * everything slower than that too.
+ *
+ * tx_latency is the time from reading a packet on the clear interface
+ * until it is handed to the crypto interface, rx_latency the other way.
+ *
+ * cached and parked are not reported, overwatch reads them when it has
+ * to kill a worker: cached is the number of packets in the process
+ * local pool caches, parked is set while the worker is parked on its
+ * ring (and thus counted in its waiting).
+ */
+struct signsky_proc_stats {
+	u_int64_t	cached;
+	u_int32_t	parked;
+	u_int64_t	ring_full;
+	u_int64_t	pool_empty;
+	u_int64_t	tag_fail;
+	u_int64_t	replay;
+	u_int64_t	invalid;
+	u_int64_t	emsgsize;
+	u_int64_t	tx_latency[SIGNSKY_LATENCY_BUCKETS];
+	u_int64_t	rx_latency[SIGNSKY_LATENCY_BUCKETS];
+};
+
+/*
+ * The rings and pools that overwatch samples, the rings between the
+ * processes come first (up to SIGNSKY_RING_PROC_MAX) and the pools after.
+ */
+#define SIGNSKY_RING_CLEAR		0
+#define SIGNSKY_RING_CRYPTO		1
+#define SIGNSKY_RING_ENCRYPT		2
+#define SIGNSKY_RING_DECRYPT		3
+#define SIGNSKY_RING_PROC_MAX		4
+#define SIGNSKY_RING_POOL_SMALL		4
+#define SIGNSKY_RING_POOL_LARGE		5
+#define SIGNSKY_RING_MAX		6
+
+/*
+ * The occupancy of a ring as sampled by overwatch. For the rings this
+ * is the number of packets queued, for the packet pools the number of
+ * packets taken out of the pool (including those in process caches).
+ *
+ * The average depth is total / samples.
+ */
+struct signsky_ring_stats {
+	u_int32_t	size;
+	u_int32_t	last;
+	u_int32_t	high;
+	u_int64_t	total;
+	u_int64_t	samples;
+};
+
+/* The maximum number of peers a single instance can have. */
+#define SIGNSKY_PEERS_MAX		64
+
 /* ctl requests, some go to keying, some go to status. */
 #define SIGNSKY_CTL_STATUS		1
+#define SIGNSKY_CTL_STATS		2
+#define SIGNSKY_CTL_RINGS		3
 
 /*
  * A request to the status process for signsky.
@@ -38,11 +101,50 @@ struct signsky_ctl_status {
 };
 
 /*
- * The response to a SIGNSKY_CTL_STATUS_GET.
+ * The status of a single peer, ip and port in network byte order.
  */
-struct signsky_ctl_status_response {
+struct signsky_ctl_status_peer {
+	u_int32_t		ip;
+	u_int16_t		port;
 	struct signsky_ifstat	tx;
 	struct signsky_ifstat	rx;
 };
 
+/*
+ * The response to a SIGNSKY_CTL_STATUS_GET.
+ */
+struct signsky_ctl_status_response {
+	char				cipher[32];
+	u_int64_t			pool_empty;
+	u_int16_t			npeers;
+	struct signsky_ctl_status_peer	peers[SIGNSKY_PEERS_MAX];
+};
+
+/* The maximum number of process types in a SIGNSKY_CTL_STATS response. */
+#define SIGNSKY_CTL_STATS_PROCS		8
+
+/*
+ * The counters of all workers of a single process type added up.
+ */
+struct signsky_ctl_stats_proc {
+	char				name[16];
+	u_int16_t			workers;
+	struct signsky_proc_stats	stats;
+};
+
+/*
+ * The response to a SIGNSKY_CTL_STATS.
+ */
+struct signsky_ctl_stats_response {
+	u_int16_t			nprocs;
+	struct signsky_ctl_stats_proc	procs[SIGNSKY_CTL_STATS_PROCS];
+};
+
+/*
+ * The response to a SIGNSKY_CTL_RINGS, indexed by SIGNSKY_RING_*.
+ */
+struct signsky_ctl_rings_response {
+	struct signsky_ring_stats	rings[SIGNSKY_RING_MAX];
+};
+
 #endif
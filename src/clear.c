@@ -17,6 +17,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <netinet/in.h>
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+
+#include <limits.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,19 +33,51 @@
 
 #include "signsky.h"
 
-/* The number of packets in a single run we try to read. */
-#define PACKETS_PER_EVENT		64
-
 static void	clear_drop_access(void);
 static void	clear_recv_packets(int);
 static void	clear_send_packet(int, struct signsky_packet *);
+static void	clear_encrypt_queue(int, void **, size_t);
+static void	clear_mtu_refresh(void);
+static int	clear_read_check(struct signsky_packet *);
+static int	clear_pmtu_check(int, struct signsky_packet *);
+static void	clear_pmtu_icmp(int, struct signsky_packet *, size_t);
+static u_int16_t	clear_csum(const void *, size_t);
+
+#if defined(__linux__)
+static void	clear_recv_offload(int);
+static size_t	clear_recv_uring(int);
+
+/*
+ * The most packets a single super-packet is segmented into, enough for
+ * a 64KB super-packet at the IPv4 minimum MSS of 536 bytes. Super-packets
+ * with a smaller gso_size that need more are dropped.
+ */
+#define CLEAR_OFFLOAD_SEGMENTS		((65535 / 536) + 1)
+
+/* Set if the io_uring engine is used, see src/uring.c. */
+static int			uring = 0;
+#endif
+
+/*
+ * What a packet grows by on the wire once it is encrypted, without the
+ * cipher its overhead. Used to check packets against the path MTU.
+ */
+#define CLEAR_PMTU_OVERHEAD						\
+	(sizeof(struct ip) + sizeof(struct udphdr) +			\
+	sizeof(struct signsky_ipsec_hdr) + sizeof(struct signsky_ipsec_tail))
+
+/* The smallest next-hop MTU an ICMP fragmentation needed may carry. */
+#define CLEAR_PMTU_MIN		68
 
 /* Temporary packet for when the packet pool is empty. */
-static struct signsky_packet	tpkt;
+static struct signsky_packet	*tpkt = NULL;
 
 /* The local queues. */
 static struct signsky_proc_io	*io = NULL;
 
+/* When we last asked for the MTU of the tunnel device. */
+static u_int64_t		mtu_last = 0;
+
 /*
  * The process responsible for receiving packets on the clear side
  * and submitting them to the encryption worker.
@@ -46,13 +86,16 @@ void
 signsky_clear_entry(struct signsky_proc *proc)
 {
 	struct pollfd			pfd;
-	struct signsky_packet		*pkt;
-	int				fd, sig, running;
+	u_int64_t			idle;
+	size_t				idx, count;
+	int				fd, park, sig, running;
+	void				*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(proc != NULL);
 	PRECOND(proc->arg != NULL);
 
 	io = proc->arg;
+	tpkt = signsky_packet_scratch();
 	clear_drop_access();
 
 	signsky_signal_trap(SIGQUIT);
@@ -62,6 +105,17 @@ signsky_clear_entry(struct signsky_proc *proc)
 	pfd.fd = fd;
 	pfd.events = POLLIN;
 
+	clear_mtu_refresh();
+
+	park = fd;
+#if defined(__linux__)
+	if (signsky->flags & SIGNSKY_FLAG_IO_URING) {
+		park = signsky_uring_init(fd, SIGNSKY_PROC_CLEAR);
+		uring = 1;
+	}
+#endif
+
+	idle = 0;
 	running = 1;
 	signsky_proc_privsep(proc);
 
@@ -75,25 +129,47 @@ signsky_clear_entry(struct signsky_proc *proc)
 			}
 		}
 
-		if (poll(&pfd, 1, 0) == -1) {
-			if (errno == EINTR)
-				continue;
-			fatal("poll: %s", errno_s);
-		}
+		if (signsky_atomic_read(&signsky->uptime) != mtu_last)
+			clear_mtu_refresh();
 
-		if (pfd.revents & POLLIN)
-			clear_recv_packets(fd);
+#if defined(__linux__)
+		/* Completions are in our memory, no need to poll for them. */
+		if (uring) {
+			if (clear_recv_uring(fd) > 0)
+				idle = 0;
+		} else
+#endif
+		{
+			if (poll(&pfd, 1, 0) == -1) {
+				if (errno == EINTR)
+					continue;
+				fatal("poll: %s", errno_s);
+			}
 
-		while ((pkt = signsky_ring_dequeue(io->clear)))
-			clear_send_packet(fd, pkt);
+			if (pfd.revents & POLLIN) {
+				clear_recv_packets(fd);
+				idle = 0;
+			}
+		}
+
+		while ((count = signsky_ring_dequeue_burst(io->clear,
+		    pkts, SIGNSKY_PACKETS_PER_EVENT)) > 0) {
+			for (idx = 0; idx < count; idx++)
+				clear_send_packet(fd, pkts[idx]);
+			idle = 0;
+		}
 
-#if !defined(SIGNSKY_HIGH_PERFORMANCE)
-		usleep(500);
+#if defined(__linux__)
+		if (uring)
+			signsky_uring_submit();
 #endif
+
+		signsky_ring_idle(io->clear, park, &idle);
 	}
 
 	close(fd);
 
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -108,28 +184,48 @@ clear_drop_access(void)
 	signsky_shm_detach(io->tx);
 	signsky_shm_detach(io->rx);
 	signsky_shm_detach(io->arwin);
+	signsky_shm_detach(io->seqnr);
+	signsky_shm_detach(io->spi);
 	signsky_shm_detach(io->crypto);
 	signsky_shm_detach(io->decrypt);
+	signsky_shm_detach(io->handoff_tx);
+	signsky_shm_detach(io->handoff_rx);
 
 	io->tx = NULL;
 	io->rx = NULL;
 	io->arwin = NULL;
+	io->spi = NULL;
+	io->seqnr = NULL;
 	io->crypto = NULL;
 	io->decrypt = NULL;
+	io->handoff_tx = NULL;
+	io->handoff_rx = NULL;
 }
 
 /*
  * Send the given packet onto the clear interface.
- * This function will return the packet to the packet pool.
+ * This function will return the packet to the packet pool, or hand
+ * it to the io_uring engine which does so once it was written.
  */
 static void
 clear_send_packet(int fd, struct signsky_packet *pkt)
 {
-	ssize_t		ret;
+	ssize_t			ret;
 
 	PRECOND(fd >= 0);
 	PRECOND(pkt != NULL);
 	PRECOND(pkt->target == SIGNSKY_PROC_CLEAR);
+	PRECOND(pkt->peer < signsky->npeers);
+
+	signsky_stat_latency(signsky_stats->rx_latency,
+	    pkt->ts, signsky_time_ns());
+
+#if defined(__linux__)
+	if (uring) {
+		signsky_uring_send(pkt);
+		return;
+	}
+#endif
 
 	for (;;) {
 		if ((ret = signsky_platform_tundev_write(fd, pkt)) == -1) {
@@ -142,10 +238,7 @@ clear_send_packet(int fd, struct signsky_packet *pkt)
 			fatal("%s: write(): %s", __func__, errno_s);
 		}
 
-		signsky_atomic_add(&signsky->rx.pkt, 1);
-		signsky_atomic_add(&signsky->rx.bytes, pkt->length);
-		signsky_atomic_write(&signsky->rx.last, signsky->uptime);
-
+		signsky_stat_peer(pkt->peer, 1, pkt->length);
 		break;
 	}
 
@@ -153,24 +246,34 @@ clear_send_packet(int fd, struct signsky_packet *pkt)
 }
 
 /*
- * Read up to PACKETS_PER_EVENT number of packets, queueing them up
- * for encryption via the encryption queue.
+ * Read up to SIGNSKY_PACKETS_PER_EVENT number of packets, queueing them
+ * up for encryption via the encryption queue in a single burst.
  */
 static void
 clear_recv_packets(int fd)
 {
-	int				idx;
 	ssize_t				ret;
 	struct signsky_packet		*pkt;
+	size_t				idx, count;
+	void				*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(fd >= 0);
 
-	for (idx = 0; idx < PACKETS_PER_EVENT; idx++) {
+#if defined(__linux__)
+	if (signsky->flags & SIGNSKY_FLAG_TUN_OFFLOAD) {
+		clear_recv_offload(fd);
+		return;
+	}
+#endif
+
+	count = 0;
+
+	for (idx = 0; idx < SIGNSKY_PACKETS_PER_EVENT; idx++) {
 		if ((pkt = signsky_packet_get()) == NULL)
-			pkt = &tpkt;
+			pkt = tpkt;
 
 		if ((ret = signsky_platform_tundev_read(fd, pkt)) == -1) {
-			if (pkt != &tpkt)
+			if (pkt != tpkt)
 				signsky_packet_release(pkt);
 			if (errno == EINTR)
 				continue;
@@ -185,18 +288,330 @@ clear_recv_packets(int fd)
 			fatal("eof on tunnel interface");
 
 		if (ret <= SIGNSKY_PACKET_MIN_LEN) {
-			if (pkt != &tpkt)
+			if (pkt != tpkt) {
+				pkt->length = ret;
 				signsky_packet_release(pkt);
+			}
+			signsky_stat_add(invalid, 1);
 			continue;
 		}
 
-		if (pkt == &tpkt)
+		if (pkt == tpkt)
 			continue;
 
 		pkt->length = ret;
+
+		if (clear_read_check(pkt) == -1)
+			continue;
+
+		pkt->ts = signsky_time_ns();
 		pkt->target = SIGNSKY_PROC_ENCRYPT;
 
-		if (signsky_ring_queue(io->encrypt, pkt) == -1)
+		pkts[count++] = pkt;
+	}
+
+	clear_encrypt_queue(fd, pkts, count);
+}
+
+/*
+ * Ask for the MTU of the tunnel device once a second, it bounds what
+ * we read from it and thus the packet class we read into.
+ */
+static void
+clear_mtu_refresh(void)
+{
+	mtu_last = signsky_atomic_read(&signsky->uptime);
+	signsky_packet_readlen(signsky_platform_tundev_mtu());
+}
+
+/*
+ * Check a packet we read from the tunnel device that filled up all
+ * room it had, if its IP header says it is larger it was cut off.
+ * In that case it is dropped and we read into large packets from
+ * here on. Returns -1 if the packet was dropped.
+ */
+static int
+clear_read_check(struct signsky_packet *pkt)
+{
+	struct ip	*ip;
+	struct ip6_hdr	*ip6;
+	size_t		len;
+
+	PRECOND(pkt != NULL);
+
+	if (pkt->length != signsky_packet_room(pkt))
+		return (0);
+
+	ip = signsky_packet_data(pkt);
+	ip6 = signsky_packet_data(pkt);
+
+	if (pkt->length >= sizeof(*ip) && ip->ip_v == 4)
+		len = ntohs(ip->ip_len);
+	else if (pkt->length >= sizeof(*ip6) && ip->ip_v == 6)
+		len = ntohs(ip6->ip6_plen) + sizeof(*ip6);
+	else
+		len = pkt->length;
+
+	if (len <= pkt->length)
+		return (0);
+
+	if (pkt->class != SIGNSKY_PACKET_CLASS_LARGE)
+		signsky_packet_truncated();
+
+	signsky_packet_release(pkt);
+	signsky_stat_add(invalid, 1);
+
+	return (-1);
+}
+
+/*
+ * Queue the given packets for encryption in a single burst, any
+ * packets that did not fit onto the queue are dropped. Packets that
+ * will not fit in the path MTU towards their peer are answered.
+ */
+static void
+clear_encrypt_queue(int fd, void **pkts, size_t count)
+{
+	size_t		idx, ready, queued;
+
+	PRECOND(fd >= 0);
+	PRECOND(pkts != NULL);
+
+	ready = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		if (clear_pmtu_check(fd, pkts[idx]) != -1)
+			pkts[ready++] = pkts[idx];
+	}
+
+	count = ready;
+	queued = signsky_ring_queue_burst(io->encrypt, pkts, count);
+	signsky_stat_add(ring_full, count - queued);
+
+	for (idx = queued; idx < count; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+
+/*
+ * Check if the given packet still fits in the path MTU towards its
+ * peer once encrypted. If it does not it is answered with an ICMP
+ * fragmentation needed when it has DF set and dropped either way,
+ * the kernel would refuse to send it anyhow.
+ *
+ * Returns -1 if the packet was dropped, 0 otherwise.
+ */
+static int
+clear_pmtu_check(int fd, struct signsky_packet *pkt)
+{
+	size_t		overhead;
+	u_int32_t	pmtu;
+
+	PRECOND(fd >= 0);
+	PRECOND(pkt != NULL);
+
+	if ((pmtu = signsky_atomic_read_relaxed(&signsky->pmtu)) == 0)
+		return (0);
+
+	overhead = CLEAR_PMTU_OVERHEAD + signsky_cipher_overhead();
+
+	if (pkt->length + overhead <= pmtu)
+		return (0);
+
+	/* Encrypt drops the packet if it has no peer. */
+	if (signsky_packet_peer(pkt) == -1)
+		return (0);
+
+	pmtu = signsky_atomic_read_relaxed(&signsky->peers[pkt->peer].pmtu);
+	if (pmtu == 0 || pkt->length + overhead <= pmtu)
+		return (0);
+
+	signsky_stat_add(emsgsize, 1);
+
+	if (pmtu >= overhead + CLEAR_PMTU_MIN)
+		clear_pmtu_icmp(fd, pkt, pmtu - overhead);
+
+	signsky_packet_release(pkt);
+
+	return (-1);
+}
+
+/*
+ * Write an ICMP fragmentation needed with the given next-hop MTU for
+ * pkt onto the clear interface, if pkt is an IPv4 packet with DF set.
+ *
+ * It appears to come from the destination of pkt, it carries the IP
+ * header and the first 8 bytes of pkt and is built in the scratch
+ * packet, so pkt itself is left alone.
+ */
+static void
+clear_pmtu_icmp(int fd, struct signsky_packet *pkt, size_t mtu)
+{
+	struct ip		ip, orig;
+	struct icmp		icmp;
+	size_t			hlen, quote;
+	u_int8_t		*data, *out;
+
+	PRECOND(fd >= 0);
+	PRECOND(pkt != NULL);
+	PRECOND(mtu >= CLEAR_PMTU_MIN && mtu <= USHRT_MAX);
+
+	data = signsky_packet_data(pkt);
+
+	if (pkt->length < sizeof(orig))
+		return;
+
+	memcpy(&orig, data, sizeof(orig));
+	hlen = orig.ip_hl << 2;
+
+	if (orig.ip_v != IPVERSION || hlen < sizeof(orig) ||
+	    hlen > pkt->length || !(ntohs(orig.ip_off) & IP_DF))
+		return;
+
+	/* Never answer ICMP errors, only echo requests and replies. */
+	if (orig.ip_p == IPPROTO_ICMP && (pkt->length == hlen ||
+	    (data[hlen] != ICMP_ECHO && data[hlen] != ICMP_ECHOREPLY)))
+		return;
+
+	quote = hlen + 8;
+	if (quote > pkt->length)
+		quote = pkt->length;
+
+	out = signsky_packet_data(tpkt);
+	memcpy(out + sizeof(ip) + ICMP_MINLEN, data, quote);
+
+	memset(&icmp, 0, sizeof(icmp));
+	icmp.icmp_type = ICMP_UNREACH;
+	icmp.icmp_code = ICMP_UNREACH_NEEDFRAG;
+	icmp.icmp_nextmtu = htons(mtu);
+
+	memcpy(out + sizeof(ip), &icmp, ICMP_MINLEN);
+	icmp.icmp_cksum = clear_csum(out + sizeof(ip), ICMP_MINLEN + quote);
+	memcpy(out + sizeof(ip), &icmp, ICMP_MINLEN);
+
+	memset(&ip, 0, sizeof(ip));
+	ip.ip_v = IPVERSION;
+	ip.ip_hl = sizeof(ip) >> 2;
+	ip.ip_len = htons(sizeof(ip) + ICMP_MINLEN + quote);
+	ip.ip_ttl = IPDEFTTL;
+	ip.ip_p = IPPROTO_ICMP;
+	ip.ip_src = orig.ip_dst;
+	ip.ip_dst = orig.ip_src;
+	ip.ip_sum = clear_csum(&ip, sizeof(ip));
+
+	memcpy(out, &ip, sizeof(ip));
+	tpkt->length = sizeof(ip) + ICMP_MINLEN + quote;
+
+	(void)signsky_platform_tundev_write(fd, tpkt);
+}
+
+/*
+ * The internet checksum over len bytes at ptr.
+ */
+static u_int16_t
+clear_csum(const void *ptr, size_t len)
+{
+	u_int32_t		sum;
+	const u_int8_t		*p;
+
+	PRECOND(ptr != NULL);
+
+	p = ptr;
+	sum = 0;
+
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+
+	if (len == 1)
+		sum += p[0] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (htons(~sum & 0xffff));
+}
+
+#if defined(__linux__)
+/*
+ * Read frames from a tunnel device in offload mode until we have read
+ * at least SIGNSKY_PACKETS_PER_EVENT packets, each frame can be segmented
+ * into several packets which are queued for encryption in a single burst.
+ */
+static void
+clear_recv_offload(int fd)
+{
+	ssize_t		ret;
+	u_int64_t	now;
+	size_t		idx, reads, total;
+	void		*pkts[CLEAR_OFFLOAD_SEGMENTS];
+
+	PRECOND(fd >= 0);
+
+	total = 0;
+
+	for (reads = 0; reads < SIGNSKY_PACKETS_PER_EVENT &&
+	    total < SIGNSKY_PACKETS_PER_EVENT; reads++) {
+		if ((ret = signsky_platform_tundev_read_offload(fd,
+		    pkts, CLEAR_OFFLOAD_SEGMENTS)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EIO)
+				break;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			fatal("%s: read(): %s", __func__, errno_s);
+		}
+
+		now = signsky_time_ns();
+
+		for (idx = 0; idx < (size_t)ret; idx++)
+			((struct signsky_packet *)pkts[idx])->ts = now;
+
+		clear_encrypt_queue(fd, pkts, ret);
+		total += ret;
+	}
+}
+
+/*
+ * Take the packets the io_uring engine read from the tunnel device
+ * and queue them up for encryption, returns how many were read.
+ */
+static size_t
+clear_recv_uring(int fd)
+{
+	u_int64_t		now;
+	struct signsky_packet	*pkt;
+	size_t			idx, count, ret;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
+
+	if ((ret = signsky_uring_recv(pkts, SIGNSKY_PACKETS_PER_EVENT)) == 0)
+		return (0);
+
+	count = 0;
+	now = signsky_time_ns();
+
+	for (idx = 0; idx < ret; idx++) {
+		pkt = pkts[idx];
+
+		if (pkt->length <= SIGNSKY_PACKET_MIN_LEN) {
 			signsky_packet_release(pkt);
+			signsky_stat_add(invalid, 1);
+			continue;
+		}
+
+		if (clear_read_check(pkt) == -1)
+			continue;
+
+		pkt->ts = now;
+		pkt->target = SIGNSKY_PROC_ENCRYPT;
+
+		pkts[count++] = pkt;
 	}
+
+	clear_encrypt_queue(fd, pkts, count);
+
+	return (ret);
 }
+#endif
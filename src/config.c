@@ -31,11 +31,36 @@
 
 #include "signsky.h"
 
+/* The highest CPU number that can be given to the cpu option. */
+#define CONFIG_CPU_MAX		1023
+
+/* The highest queue number that can be given to the crypto-xdp option. */
+#define CONFIG_XDP_QUEUE_MAX	1023
+
 static void	config_parse_peer(char *);
+static void	config_parse_route(char *, struct signsky_route *);
 static void	config_parse_local(char *);
 static void	config_parse_runas(char *);
 static void	config_parse_keying(char *);
 static void	config_parse_status(char *);
+static void	config_parse_spin(char *);
+static void	config_parse_replay_window(char *);
+static void	config_parse_cipher(char *);
+static void	config_parse_pool(char *);
+static void	config_parse_pool_numa(char *);
+static void	config_parse_udp_gso(char *);
+static void	config_parse_udp_gro(char *);
+static void	config_parse_tun_offload(char *);
+static void	config_parse_crypto_xdp(char *);
+static void	config_parse_io_uring(char *);
+static void	config_parse_memory_hugepages(char *);
+static void	config_parse_memory_lock(char *);
+static void	config_parse_memory_prefault(char *);
+static int	config_parse_bool(const char *, const char *);
+static void	config_parse_workers(char *);
+static void	config_parse_cpu(char *);
+static void	config_parse_sched_fifo(char *);
+static u_int16_t	config_proc_type(const char *);
 static void	config_parse_instance(char *);
 static void	config_parse_host(char *, struct sockaddr_in *);
 static void	config_parse_unix(char *, struct signsky_sun *);
@@ -53,6 +78,22 @@ static const struct {
 	{ "run",		config_parse_runas },
 	{ "keying",		config_parse_keying },
 	{ "status",		config_parse_status },
+	{ "spin",		config_parse_spin },
+	{ "replay-window",	config_parse_replay_window },
+	{ "cipher",		config_parse_cipher },
+	{ "pool",		config_parse_pool },
+	{ "pool-numa",		config_parse_pool_numa },
+	{ "udp-gso",		config_parse_udp_gso },
+	{ "udp-gro",		config_parse_udp_gro },
+	{ "tun-offload",	config_parse_tun_offload },
+	{ "crypto-xdp",		config_parse_crypto_xdp },
+	{ "io-uring",		config_parse_io_uring },
+	{ "memory-hugepages",	config_parse_memory_hugepages },
+	{ "memory-lock",	config_parse_memory_lock },
+	{ "memory-prefault",	config_parse_memory_prefault },
+	{ "workers",		config_parse_workers },
+	{ "cpu",		config_parse_cpu },
+	{ "sched-fifo",		config_parse_sched_fifo },
 	{ "instance",		config_parse_instance },
 	{ NULL,			NULL },
 };
@@ -73,8 +114,22 @@ static const struct {
 void
 signsky_config_init(void)
 {
+	int		idx;
+
 	PRECOND(signsky != NULL);
 
+	for (idx = 0; idx < SIGNSKY_PROC_MAX; idx++)
+		signsky->workers[idx] = 1;
+
+	signsky->spin = SIGNSKY_SPIN_DEFAULT;
+	signsky->arwin_size = SIGNSKY_ARWIN_DEFAULT;
+	signsky->cipher = SIGNSKY_CIPHER_AES_256_GCM;
+
+	for (idx = 0; idx < SIGNSKY_PACKET_CLASS_MAX; idx++)
+		signsky->pool[idx] = SIGNSKY_PACKET_POOL_DEFAULT;
+
+	signsky->pool_numa = -1;
+
 	config_unix_set(&signsky->status, "/tmp/signsky-status", "root");
 	config_unix_set(&signsky->keying, "/tmp/signsky-keying", "root");
 }
@@ -116,6 +171,23 @@ signsky_config_load(const char *file)
 		fatal("error reading the configuration file");
 
 	fclose(fp);
+
+	/*
+	 * Without any peer configured there still is a single peer
+	 * with the default route, we learn its address once it talks
+	 * to us.
+	 */
+	if (signsky->npeers == 0) {
+		signsky->npeers = 1;
+		signsky->peers[0].nroutes = 1;
+	}
+
+	/* The io_uring engine reads and writes single packets only. */
+	if ((signsky->flags & SIGNSKY_FLAG_IO_URING) &&
+	    (signsky->flags & (SIGNSKY_FLAG_UDP_GSO | SIGNSKY_FLAG_UDP_GRO |
+	    SIGNSKY_FLAG_TUN_OFFLOAD)))
+		fatal("io-uring cannot be combined with udp-gso, "
+		    "udp-gro or tun-offload");
 }
 
 static char *
@@ -148,15 +220,72 @@ config_read_line(FILE *fp, char *in, size_t len)
 	return (p);
 }
 
+/*
+ * Add a new peer, in the form of "ip:port [prefix/len,...]". Each peer
+ * gets the next id, starting at 0. Without any prefixes the peer gets
+ * the default route.
+ */
+static void
+config_parse_peer(char *opt)
+{
+	struct signsky_peer	*peer;
+	char			*routes, *route;
+
+	PRECOND(opt != NULL);
+
+	if (signsky->npeers == SIGNSKY_PEERS_MAX)
+		fatal("too many peers configured (max %d)", SIGNSKY_PEERS_MAX);
+
+	peer = &signsky->peers[signsky->npeers++];
+
+	if ((routes = strchr(opt, ' ')) != NULL)
+		*(routes)++ = '\0';
+
+	config_parse_host(opt, &peer->addr);
+
+	signsky_atomic_write(&peer->port, peer->addr.sin_port);
+	signsky_atomic_write(&peer->ip, peer->addr.sin_addr.s_addr);
+
+	if (routes == NULL) {
+		peer->nroutes = 1;
+		return;
+	}
+
+	while ((route = strsep(&routes, ",")) != NULL) {
+		if (peer->nroutes == SIGNSKY_PEER_ROUTES_MAX)
+			fatal("too many routes for peer %s", opt);
+		config_parse_route(route, &peer->routes[peer->nroutes++]);
+	}
+}
+
+/*
+ * Parse an IPv4 prefix in the form of "ip/len".
+ */
 static void
-config_parse_peer(char *peer)
+config_parse_route(char *opt, struct signsky_route *route)
 {
-	PRECOND(peer != NULL);
+	u_int32_t	len;
+	char		*p;
+	const char	*errstr;
+
+	PRECOND(opt != NULL);
+	PRECOND(route != NULL);
+
+	if ((p = strchr(opt, '/')) == NULL)
+		fatal("route '%s' must be in format ip/len", opt);
+	*(p)++ = '\0';
+
+	if (inet_pton(AF_INET, opt, &route->net) != 1)
+		fatal("route ip '%s' invalid", opt);
+
+	len = strtonum(p, 0, 32, &errstr);
+	if (errstr)
+		fatal("route length '%s' invalid: %s", p, errstr);
 
-	config_parse_host(peer, &signsky->peer);
+	route->mask = len == 0 ? 0 : htonl(0xffffffff << (32 - len));
 
-	signsky_atomic_write(&signsky->peer_port, signsky->peer.sin_port);
-	signsky_atomic_write(&signsky->peer_ip, signsky->peer.sin_addr.s_addr);
+	if ((route->net & ~route->mask) != 0)
+		fatal("route %s/%s has host bits set", opt, p);
 }
 
 static void
@@ -199,6 +328,394 @@ config_parse_runas(char *runas)
 		fatal("strdup");
 }
 
+static void
+config_parse_workers(char *workers)
+{
+	u_int16_t	type;
+	const char	*errstr;
+	char		proc[16], count[8];
+
+	PRECOND(workers != NULL);
+
+	memset(proc, 0, sizeof(proc));
+	memset(count, 0, sizeof(count));
+
+	if (sscanf(workers, "%15s %7s", proc, count) != 2)
+		fatal("option 'workers %s' invalid", workers);
+
+	type = config_proc_type(proc);
+
+	switch (type) {
+	case SIGNSKY_PROC_CLEAR:
+#if !defined(__linux__)
+		fatal("multiple clear workers are only supported on Linux");
+#endif
+		break;
+	case SIGNSKY_PROC_ENCRYPT:
+	case SIGNSKY_PROC_DECRYPT:
+		break;
+	default:
+		fatal("process '%s' cannot have multiple workers", proc);
+	}
+
+	signsky->workers[type] = strtonum(count, 1,
+	    SIGNSKY_WORKERS_MAX, &errstr);
+	if (errstr)
+		fatal("workers '%s' invalid: %s", count, errstr);
+}
+
+/*
+ * Pin the workers of a process type to the given comma separated
+ * list of CPUs, worker n is pinned to the n-th CPU in the list
+ * (wrapping around if there are more workers than CPUs).
+ */
+static void
+config_parse_cpu(char *opt)
+{
+	u_int16_t			type;
+	struct signsky_proc_sched	*sched;
+	const char			*errstr;
+	char				proc[16], list[128], *cpu, *next;
+
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("cpu is only supported on Linux");
+#endif
+
+	memset(proc, 0, sizeof(proc));
+	memset(list, 0, sizeof(list));
+
+	if (sscanf(opt, "%15s %127s", proc, list) != 2)
+		fatal("option 'cpu %s' invalid", opt);
+
+	type = config_proc_type(proc);
+	sched = &signsky->sched[type];
+	sched->ncpu = 0;
+
+	for (next = list; (cpu = strsep(&next, ",")) != NULL;) {
+		if (sched->ncpu == SIGNSKY_WORKERS_MAX)
+			fatal("cpu %s: too many cpus", proc);
+
+		sched->cpu[sched->ncpu++] = strtonum(cpu, 0,
+		    CONFIG_CPU_MAX, &errstr);
+		if (errstr)
+			fatal("cpu '%s' invalid: %s", cpu, errstr);
+	}
+}
+
+/*
+ * Run the workers of a process type under SCHED_FIFO with the given
+ * priority. Be careful, a spinning worker can starve anything else
+ * running on the same CPU.
+ */
+static void
+config_parse_sched_fifo(char *opt)
+{
+	u_int16_t	type;
+	const char	*errstr;
+	char		proc[16], prio[8];
+
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("sched-fifo is only supported on Linux");
+#endif
+
+	memset(proc, 0, sizeof(proc));
+	memset(prio, 0, sizeof(prio));
+
+	if (sscanf(opt, "%15s %7s", proc, prio) != 2)
+		fatal("option 'sched-fifo %s' invalid", opt);
+
+	type = config_proc_type(proc);
+
+	signsky->sched[type].priority = strtonum(prio, 1, 99, &errstr);
+	if (errstr)
+		fatal("sched-fifo priority '%s' invalid: %s", prio, errstr);
+}
+
+static void
+config_parse_spin(char *spin)
+{
+	const char	*errstr;
+
+	PRECOND(spin != NULL);
+
+	signsky->spin = strtonum(spin, 0, 1000000, &errstr);
+	if (errstr)
+		fatal("spin '%s' invalid: %s", spin, errstr);
+}
+
+/*
+ * The size of the anti-replay window, in packets. A larger window
+ * tolerates more reordering between the peers (or decrypt workers).
+ */
+static void
+config_parse_replay_window(char *size)
+{
+	const char	*errstr;
+
+	PRECOND(size != NULL);
+
+	signsky->arwin_size = strtonum(size, 64, SIGNSKY_ARWIN_MAX, &errstr);
+	if (errstr)
+		fatal("replay-window '%s' invalid: %s", size, errstr);
+}
+
+/*
+ * Set the number of packets in the pool for the given class, this
+ * must be a power of 2 as the pool its freelist is a ring.
+ */
+static void
+config_parse_pool(char *pool)
+{
+	u_int32_t	elm;
+	int		class;
+	const char	*errstr;
+	char		name[16], count[8];
+
+	PRECOND(pool != NULL);
+
+	memset(name, 0, sizeof(name));
+	memset(count, 0, sizeof(count));
+
+	if (sscanf(pool, "%15s %7s", name, count) != 2)
+		fatal("option 'pool %s' invalid", pool);
+
+	if (!strcmp(name, "small"))
+		class = SIGNSKY_PACKET_CLASS_SMALL;
+	else if (!strcmp(name, "large"))
+		class = SIGNSKY_PACKET_CLASS_LARGE;
+	else
+		fatal("pool class '%s' is unknown", name);
+
+	elm = strtonum(count, 64, 4096, &errstr);
+	if (errstr)
+		fatal("pool size '%s' invalid: %s", count, errstr);
+
+	if ((elm & (elm - 1)) != 0)
+		fatal("pool size '%s' is not a power of 2", count);
+
+	signsky->pool[class] = elm;
+}
+
+/*
+ * Bind the packet pools to the given NUMA node, normally the node
+ * the NIC is attached to.
+ */
+static void
+config_parse_pool_numa(char *node)
+{
+	const char	*errstr;
+
+	PRECOND(node != NULL);
+
+#if !defined(__linux__)
+	fatal("pool-numa is only supported on Linux");
+#endif
+
+	signsky->pool_numa = strtonum(node, 0, 63, &errstr);
+	if (errstr)
+		fatal("pool-numa '%s' invalid: %s", node, errstr);
+}
+
+/*
+ * Both peers must use the same cipher suite. With auto we pick
+ * AES-256-GCM if the CPU accelerates it and ChaCha20-Poly1305
+ * otherwise (if this build supports it).
+ */
+static void
+config_parse_cipher(char *cipher)
+{
+	PRECOND(cipher != NULL);
+
+	if (!strcmp(cipher, "aes-256-gcm")) {
+		signsky->cipher = SIGNSKY_CIPHER_AES_256_GCM;
+	} else if (!strcmp(cipher, "chacha20-poly1305")) {
+		signsky->cipher = SIGNSKY_CIPHER_CHACHA20_POLY1305;
+	} else if (!strcmp(cipher, "auto")) {
+		if (!signsky_cpu_has_aes() && signsky_cipher_supports(
+		    SIGNSKY_CIPHER_CHACHA20_POLY1305))
+			signsky->cipher = SIGNSKY_CIPHER_CHACHA20_POLY1305;
+		else
+			signsky->cipher = SIGNSKY_CIPHER_AES_256_GCM;
+	} else {
+		fatal("cipher '%s' is unknown", cipher);
+	}
+
+	if (!signsky_cipher_supports(signsky->cipher))
+		fatal("cipher '%s' is not supported by this build", cipher);
+}
+
+static void
+config_parse_udp_gso(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("udp-gso is only supported on Linux");
+#endif
+
+	if (config_parse_bool("udp-gso", opt))
+		signsky->flags |= SIGNSKY_FLAG_UDP_GSO;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_UDP_GSO;
+}
+
+static void
+config_parse_udp_gro(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("udp-gro is only supported on Linux");
+#endif
+
+	if (config_parse_bool("udp-gro", opt))
+		signsky->flags |= SIGNSKY_FLAG_UDP_GRO;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_UDP_GRO;
+}
+
+static void
+config_parse_tun_offload(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("tun-offload is only supported on Linux");
+#endif
+
+	if (config_parse_bool("tun-offload", opt))
+		signsky->flags |= SIGNSKY_FLAG_TUN_OFFLOAD;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_TUN_OFFLOAD;
+}
+
+static void
+config_parse_crypto_xdp(char *opt)
+{
+	int		ret;
+	const char	*errstr;
+	char		ifname[16], queue[16];
+
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("crypto-xdp is only supported on Linux");
+#endif
+
+	memset(queue, 0, sizeof(queue));
+	memset(ifname, 0, sizeof(ifname));
+
+	ret = sscanf(opt, "%15s %15s", ifname, queue);
+	if (ret != 1 && ret != 2)
+		fatal("option 'crypto-xdp %s' invalid", opt);
+
+	signsky->xdp_queue = 0;
+
+	if (ret == 2) {
+		signsky->xdp_queue = strtonum(queue, 0,
+		    CONFIG_XDP_QUEUE_MAX, &errstr);
+		if (errstr)
+			fatal("crypto-xdp queue '%s' invalid: %s",
+			    queue, errstr);
+	}
+
+	memcpy(signsky->xdp_ifname, ifname, sizeof(ifname));
+	signsky->flags |= SIGNSKY_FLAG_XDP;
+}
+
+static void
+config_parse_io_uring(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("io-uring is only supported on Linux");
+#endif
+
+	if (config_parse_bool("io-uring", opt))
+		signsky->flags |= SIGNSKY_FLAG_IO_URING;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_IO_URING;
+}
+
+static void
+config_parse_memory_hugepages(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("memory-hugepages is only supported on Linux");
+#endif
+
+	if (config_parse_bool("memory-hugepages", opt))
+		signsky->flags |= SIGNSKY_FLAG_HUGEPAGES;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_HUGEPAGES;
+}
+
+static void
+config_parse_memory_lock(char *opt)
+{
+	PRECOND(opt != NULL);
+
+#if !defined(__linux__)
+	fatal("memory-lock is only supported on Linux");
+#endif
+
+	if (config_parse_bool("memory-lock", opt))
+		signsky->flags |= SIGNSKY_FLAG_MEM_LOCK;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_MEM_LOCK;
+}
+
+static void
+config_parse_memory_prefault(char *opt)
+{
+	PRECOND(opt != NULL);
+
+	if (config_parse_bool("memory-prefault", opt))
+		signsky->flags |= SIGNSKY_FLAG_MEM_PREFAULT;
+	else
+		signsky->flags &= ~SIGNSKY_FLAG_MEM_PREFAULT;
+}
+
+/*
+ * Returns the process type for the given process name.
+ */
+static u_int16_t
+config_proc_type(const char *proc)
+{
+	int		idx;
+
+	PRECOND(proc != NULL);
+
+	for (idx = 0; proctab[idx].name != NULL; idx++) {
+		if (!strcmp(proctab[idx].name, proc))
+			return (proctab[idx].type);
+	}
+
+	fatal("process '%s' is unknown", proc);
+}
+
+static int
+config_parse_bool(const char *option, const char *opt)
+{
+	PRECOND(option != NULL);
+	PRECOND(opt != NULL);
+
+	if (!strcmp(opt, "yes"))
+		return (1);
+
+	if (!strcmp(opt, "no"))
+		return (0);
+
+	fatal("option '%s %s' invalid, expected yes or no", option, opt);
+}
+
 static void
 config_parse_keying(char *path)
 {
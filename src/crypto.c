@@ -20,9 +20,15 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#endif
+
 #include <poll.h>
 #include <fcntl.h>
-#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -30,17 +36,63 @@
 
 #include "signsky.h"
 
-/* The number of packets in a single run we try to read. */
-#define PACKETS_PER_EVENT		64
-
 static void	crypto_drop_access(void);
 static void	crypto_recv_packets(int);
 static int	crypto_bind_address(void);
 static int	crypto_packet_check(struct signsky_packet *);
+static void	crypto_truncated(struct signsky_packet *);
+static void	crypto_send_packets(int, void **, size_t);
+
+#if defined(__linux__)
+static void	crypto_recv_gro(int);
+static size_t	crypto_recv_xdp(void);
+static size_t	crypto_recv_uring(void);
+static void	crypto_recv_batch(void **, size_t);
+static int	crypto_send_xdp(struct signsky_packet *);
+static void	crypto_send_uring(void **, size_t);
+static int	crypto_xdp_park(int);
+static void	crypto_decrypt_queue(void **, size_t);
+static void	crypto_pmtu_refresh(void);
+static void	crypto_pmtu_update(u_int32_t);
+static void	crypto_pmtu_publish(void);
+#else
 static void	crypto_send_packet(int, struct signsky_packet *);
+#endif
 
 /* Temporary packet for when the packet pool is empty. */
-static struct signsky_packet	tpkt;
+static struct signsky_packet	*tpkt = NULL;
+
+#if defined(__linux__)
+/*
+ * With UDP_GRO the kernel hands us up to 64KB of coalesced datagrams
+ * at once, which we read into these buffers before we split them into
+ * packets. With UDP_SEGMENT we do the reverse on send, up to the
+ * same maximum size.
+ */
+#define CRYPTO_GRO_BATCH	8
+#define CRYPTO_GRO_BUFLEN	65535
+#define CRYPTO_GSO_MAXLEN	65000
+
+#define CRYPTO_GSO_CMSG		CMSG_SPACE(sizeof(u_int16_t))
+#define CRYPTO_GRO_CMSG		CMSG_SPACE(sizeof(int))
+
+static u_int8_t			*grobuf = NULL;
+static int			udp_gso = 0;
+
+/* The AF_XDP socket if crypto-xdp is enabled, see src/xdp.c. */
+static int			xdpfd = -1;
+
+/* The ring if the io_uring engine is used, see src/uring.c. */
+static int			uringfd = -1;
+
+/*
+ * A socket that is only used to ask the kernel for the path MTU
+ * towards a peer, by connecting it to the peer. We do this for all
+ * peers every second and right away when a send fails with EMSGSIZE.
+ */
+static int			pmtufd = -1;
+static u_int64_t		pmtu_last = 0;
+#endif
 
 /* The local queues. */
 static struct signsky_proc_io	*io = NULL;
@@ -53,13 +105,16 @@ void
 signsky_crypto_entry(struct signsky_proc *proc)
 {
 	struct pollfd			pfd;
-	struct signsky_packet		*pkt;
-	int				fd, sig, running;
+	u_int64_t			idle;
+	size_t				count;
+	int				fd, park, sig, running;
+	void				*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(proc != NULL);
 	PRECOND(proc->arg != NULL);
 
 	io = proc->arg;
+	tpkt = signsky_packet_scratch();
 	crypto_drop_access();
 
 	signsky_signal_trap(SIGQUIT);
@@ -71,6 +126,15 @@ signsky_crypto_entry(struct signsky_proc *proc)
 	pfd.revents = 0;
 	pfd.events = POLLIN;
 
+	park = fd;
+#if defined(__linux__)
+	if (uringfd != -1)
+		park = uringfd;
+	if (xdpfd != -1)
+		park = crypto_xdp_park(park);
+#endif
+
+	idle = 0;
 	running = 1;
 	signsky_proc_privsep(proc);
 
@@ -84,23 +148,50 @@ signsky_crypto_entry(struct signsky_proc *proc)
 			}
 		}
 
-		if (poll(&pfd, 1, 0) == -1) {
-			if (errno == EINTR)
-				continue;
-			fatal("poll: %s", errno_s);
+#if defined(__linux__)
+		if (signsky_atomic_read(&signsky->uptime) != pmtu_last)
+			crypto_pmtu_refresh();
+
+		/* Completions are in our memory, no need to poll for them. */
+		if (uringfd != -1) {
+			if (crypto_recv_uring() > 0)
+				idle = 0;
+		} else
+#endif
+		{
+			if (poll(&pfd, 1, 0) == -1) {
+				if (errno == EINTR)
+					continue;
+				fatal("poll: %s", errno_s);
+			}
+
+			if (pfd.revents & POLLIN) {
+				crypto_recv_packets(fd);
+				idle = 0;
+			}
 		}
 
-		if (pfd.revents & POLLIN)
-			crypto_recv_packets(fd);
+#if defined(__linux__)
+		/* The rx ring is in our memory, no need to poll for it. */
+		if (xdpfd != -1 && crypto_recv_xdp() > 0)
+			idle = 0;
+#endif
 
-		while ((pkt = signsky_ring_dequeue(io->crypto)))
-			crypto_send_packet(fd, pkt);
+		while ((count = signsky_ring_dequeue_burst(io->crypto,
+		    pkts, SIGNSKY_PACKETS_PER_EVENT)) > 0) {
+			crypto_send_packets(fd, pkts, count);
+			idle = 0;
+		}
 
-#if !defined(SIGNSKY_HIGH_PERFORMANCE)
-		usleep(500);
+#if defined(__linux__)
+		if (uringfd != -1)
+			signsky_uring_submit();
 #endif
+
+		signsky_ring_idle(io->crypto, park, &idle);
 	}
 
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -114,13 +205,19 @@ crypto_drop_access(void)
 {
 	signsky_shm_detach(io->tx);
 	signsky_shm_detach(io->rx);
+	signsky_shm_detach(io->seqnr);
 	signsky_shm_detach(io->clear);
 	signsky_shm_detach(io->encrypt);
+	signsky_shm_detach(io->handoff_tx);
+	signsky_shm_detach(io->handoff_rx);
 
 	io->tx = NULL;
 	io->rx = NULL;
+	io->seqnr = NULL;
 	io->clear = NULL;
 	io->encrypt = NULL;
+	io->handoff_tx = NULL;
+	io->handoff_rx = NULL;
 }
 
 /*
@@ -154,6 +251,28 @@ crypto_bind_address(void)
 	if (setsockopt(fd, IPPROTO_IP,
 	    IP_MTU_DISCOVER, &val, sizeof(val)) == -1)
 		fatal("%s: setsockopt: %s", __func__, errno_s);
+
+	if ((pmtufd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		fatal("%s: socket: %s", __func__, errno_s);
+
+	if (signsky->flags & SIGNSKY_FLAG_UDP_GSO)
+		udp_gso = 1;
+
+	if (signsky->flags & SIGNSKY_FLAG_UDP_GRO) {
+		val = 1;
+		if (setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val)) == -1)
+			fatal("%s: setsockopt: %s", __func__, errno_s);
+
+		if ((grobuf = calloc(CRYPTO_GRO_BATCH,
+		    CRYPTO_GRO_BUFLEN)) == NULL)
+			fatal("%s: calloc failed", __func__);
+	}
+
+	if (signsky->flags & SIGNSKY_FLAG_XDP)
+		xdpfd = signsky_xdp_init(&signsky->local);
+
+	if (signsky->flags & SIGNSKY_FLAG_IO_URING)
+		uringfd = signsky_uring_init(fd, SIGNSKY_PROC_CRYPTO);
 #else
 	val = 1;
 	if (setsockopt(fd, IPPROTO_IP, IP_DONTFRAG, &val, sizeof(val)) == -1)
@@ -163,6 +282,686 @@ crypto_bind_address(void)
 	return (fd);
 }
 
+#if defined(__linux__)
+/*
+ * Send the given packets onto the crypto interface using as few
+ * sendmmsg() calls as possible.
+ *
+ * If UDP_SEGMENT is enabled consecutive packets of the same size for
+ * the same peer are handed to the kernel as a single message, which it
+ * splits up again. Only the last packet in such a message may be smaller.
+ *
+ * Packets for a peer whose address is not yet known are dropped.
+ *
+ * With crypto-xdp packets are sent via the AF_XDP socket where possible,
+ * the rest still goes out via sendmmsg().
+ *
+ * This function will return all packets to the packet pool, with the
+ * io_uring engine that happens once their sends complete.
+ */
+static void
+crypto_send_packets(int fd, void **pkts, size_t count)
+{
+	int			ret;
+	struct cmsghdr		*cmsg;
+	struct signsky_peer	*peer;
+	u_int64_t		now;
+	struct signsky_packet	*pkt;
+	size_t			idx, nmsg, off, total, seglen;
+	u_int32_t		owner[SIGNSKY_PACKETS_PER_EVENT];
+	u_int16_t		gso[SIGNSKY_PACKETS_PER_EVENT];
+	struct iovec		iov[SIGNSKY_PACKETS_PER_EVENT];
+	struct mmsghdr		msg[SIGNSKY_PACKETS_PER_EVENT];
+	struct sockaddr_in	addr[SIGNSKY_PACKETS_PER_EVENT];
+	u_int8_t		cbuf[SIGNSKY_PACKETS_PER_EVENT][CRYPTO_GSO_CMSG]
+				    __attribute__((aligned(sizeof(size_t))));
+
+	PRECOND(fd >= 0);
+	PRECOND(pkts != NULL);
+	PRECOND(count <= SIGNSKY_PACKETS_PER_EVENT);
+
+	if (uringfd != -1) {
+		crypto_send_uring(pkts, count);
+		return;
+	}
+
+	memset(msg, 0, count * sizeof(msg[0]));
+
+	nmsg = 0;
+	now = signsky_time_ns();
+	total = 0;
+	seglen = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		pkt = pkts[idx];
+		PRECOND(pkt->target == SIGNSKY_PROC_CRYPTO);
+		PRECOND(pkt->peer < signsky->npeers);
+
+		signsky_stat_latency(signsky_stats->tx_latency, pkt->ts, now);
+
+		/* Never merge over a packet that did not get a message. */
+		if (xdpfd != -1 && crypto_send_xdp(pkt) == 0) {
+			seglen = 0;
+			continue;
+		}
+
+		iov[idx].iov_len = pkt->length;
+		iov[idx].iov_base = signsky_packet_head(pkt);
+
+		if (udp_gso && nmsg > 0 && owner[nmsg - 1] == pkt->peer &&
+		    pkt->length <= seglen &&
+		    total + pkt->length <= CRYPTO_GSO_MAXLEN) {
+			msg[nmsg - 1].msg_hdr.msg_iovlen++;
+			total += pkt->length;
+
+			if (pkt->length < seglen)
+				seglen = 0;
+			continue;
+		}
+
+		peer = &signsky->peers[pkt->peer];
+
+		addr[nmsg].sin_family = AF_INET;
+		addr[nmsg].sin_port = signsky_atomic_read(&peer->port);
+		addr[nmsg].sin_addr.s_addr = signsky_atomic_read(&peer->ip);
+
+		if (addr[nmsg].sin_addr.s_addr == 0) {
+			seglen = 0;
+			continue;
+		}
+
+		msg[nmsg].msg_hdr.msg_iov = &iov[idx];
+		msg[nmsg].msg_hdr.msg_iovlen = 1;
+		msg[nmsg].msg_hdr.msg_name = &addr[nmsg];
+		msg[nmsg].msg_hdr.msg_namelen = sizeof(addr[nmsg]);
+
+		owner[nmsg] = pkt->peer;
+		gso[nmsg] = pkt->length;
+		seglen = pkt->length;
+		total = pkt->length;
+		nmsg++;
+	}
+
+	if (xdpfd != -1)
+		signsky_xdp_flush();
+
+	for (idx = 0; idx < nmsg; idx++) {
+		if (msg[idx].msg_hdr.msg_iovlen == 1)
+			continue;
+
+		msg[idx].msg_hdr.msg_control = cbuf[idx];
+		msg[idx].msg_hdr.msg_controllen = sizeof(cbuf[idx]);
+
+		cmsg = CMSG_FIRSTHDR(&msg[idx].msg_hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+		memcpy(CMSG_DATA(cmsg), &gso[idx], sizeof(gso[idx]));
+	}
+
+	off = 0;
+
+	while (off < nmsg) {
+		if ((ret = sendmmsg(fd, &msg[off], nmsg - off, 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EMSGSIZE) {
+				syslog(LOG_INFO,
+				    "packet (size=%u) too large for crypto, "
+				    "lower tunnel MTU", gso[off]);
+				signsky_stat_add(emsgsize,
+				    msg[off].msg_hdr.msg_iovlen);
+				crypto_pmtu_update(owner[off]);
+				crypto_pmtu_publish();
+				off++;
+				continue;
+			}
+			if (errno == EIO && udp_gso) {
+				syslog(LOG_NOTICE,
+				    "UDP_SEGMENT failed, disabling it");
+				udp_gso = 0;
+				break;
+			}
+			if (errno == ENETUNREACH || errno == EHOSTUNREACH) {
+				syslog(LOG_INFO, "host %s unreachable (%s)",
+				    inet_ntoa(addr[off].sin_addr), errno_s);
+				off++;
+				continue;
+			}
+			fatal("sendmmsg: %s", errno_s);
+		}
+
+		for (idx = off; idx < off + ret; idx++) {
+			signsky_stat_peer(owner[idx],
+			    msg[idx].msg_hdr.msg_iovlen, msg[idx].msg_len);
+		}
+
+		off += ret;
+	}
+
+	for (idx = 0; idx < count; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+
+/*
+ * Read up to SIGNSKY_PACKETS_PER_EVENT number of packets using a single
+ * recvmmsg() call, queueing them up for decryption via the decryption
+ * queue in a single burst.
+ */
+static void
+crypto_recv_packets(int fd)
+{
+	int			ret;
+	u_int64_t		now;
+	struct signsky_packet	*pkt;
+	size_t			idx, count;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
+	struct iovec		iov[SIGNSKY_PACKETS_PER_EVENT];
+	struct mmsghdr		msg[SIGNSKY_PACKETS_PER_EVENT];
+
+	PRECOND(fd >= 0);
+
+	if (grobuf != NULL) {
+		crypto_recv_gro(fd);
+		return;
+	}
+
+	memset(msg, 0, sizeof(msg));
+
+	for (idx = 0; idx < SIGNSKY_PACKETS_PER_EVENT; idx++) {
+		if ((pkt = signsky_packet_get()) == NULL)
+			pkt = tpkt;
+
+		pkts[idx] = pkt;
+
+		iov[idx].iov_len = pkt->size;
+		iov[idx].iov_base = signsky_packet_head(pkt);
+
+		msg[idx].msg_hdr.msg_iov = &iov[idx];
+		msg[idx].msg_hdr.msg_iovlen = 1;
+		msg[idx].msg_hdr.msg_name = &pkt->addr;
+		msg[idx].msg_hdr.msg_namelen = sizeof(pkt->addr);
+	}
+
+	for (;;) {
+		if ((ret = recvmmsg(fd, msg,
+		    SIGNSKY_PACKETS_PER_EVENT, 0, NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EIO)
+				break;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			fatal("read error: %s", errno_s);
+		}
+		break;
+	}
+
+	if (ret == -1)
+		ret = 0;
+
+	count = 0;
+	now = signsky_time_ns();
+
+	for (idx = 0; idx < SIGNSKY_PACKETS_PER_EVENT; idx++) {
+		pkt = pkts[idx];
+
+		if (pkt == tpkt)
+			continue;
+
+		if (idx >= (size_t)ret) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		if (msg[idx].msg_len == 0)
+			fatal("eof on crypto interface");
+
+		pkt->ts = now;
+		pkt->length = msg[idx].msg_len;
+		pkt->target = SIGNSKY_PROC_DECRYPT;
+
+		if (msg[idx].msg_hdr.msg_flags & MSG_TRUNC) {
+			crypto_truncated(pkt);
+			continue;
+		}
+
+		if (crypto_packet_check(pkt) == -1) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		pkts[count++] = pkt;
+	}
+
+	crypto_decrypt_queue(pkts, count);
+}
+
+/*
+ * Read up to CRYPTO_GRO_BATCH coalesced buffers using a single recvmmsg()
+ * call and split each of them into packets of the segment size the
+ * kernel told us about, queueing them up for decryption.
+ */
+static void
+crypto_recv_gro(int fd)
+{
+	int			ret, val;
+	u_int64_t		now;
+	struct cmsghdr		*cmsg;
+	struct signsky_packet	*pkt;
+	u_int8_t		*data;
+	size_t			idx, off, len, seglen, count;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
+	struct sockaddr_in	addr[CRYPTO_GRO_BATCH];
+	struct iovec		iov[CRYPTO_GRO_BATCH];
+	struct mmsghdr		msg[CRYPTO_GRO_BATCH];
+	u_int8_t		cbuf[CRYPTO_GRO_BATCH][CRYPTO_GRO_CMSG]
+				    __attribute__((aligned(sizeof(size_t))));
+
+	PRECOND(fd >= 0);
+	PRECOND(grobuf != NULL);
+
+	memset(msg, 0, sizeof(msg));
+
+	for (idx = 0; idx < CRYPTO_GRO_BATCH; idx++) {
+		iov[idx].iov_len = CRYPTO_GRO_BUFLEN;
+		iov[idx].iov_base = &grobuf[idx * CRYPTO_GRO_BUFLEN];
+
+		msg[idx].msg_hdr.msg_iov = &iov[idx];
+		msg[idx].msg_hdr.msg_iovlen = 1;
+		msg[idx].msg_hdr.msg_name = &addr[idx];
+		msg[idx].msg_hdr.msg_namelen = sizeof(addr[idx]);
+		msg[idx].msg_hdr.msg_control = cbuf[idx];
+		msg[idx].msg_hdr.msg_controllen = sizeof(cbuf[idx]);
+	}
+
+	for (;;) {
+		if ((ret = recvmmsg(fd, msg,
+		    CRYPTO_GRO_BATCH, 0, NULL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EIO)
+				return;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			fatal("read error: %s", errno_s);
+		}
+		break;
+	}
+
+	count = 0;
+	now = signsky_time_ns();
+
+	for (idx = 0; idx < (size_t)ret; idx++) {
+		len = msg[idx].msg_len;
+		seglen = len;
+
+		if (len == 0)
+			fatal("eof on crypto interface");
+
+		for (cmsg = CMSG_FIRSTHDR(&msg[idx].msg_hdr); cmsg != NULL;
+		    cmsg = CMSG_NXTHDR(&msg[idx].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_UDP &&
+			    cmsg->cmsg_type == UDP_GRO) {
+				memcpy(&val, CMSG_DATA(cmsg), sizeof(val));
+				if (val > 0)
+					seglen = val;
+			}
+		}
+
+		data = iov[idx].iov_base;
+
+		for (off = 0; off < len; off += seglen) {
+			if (len - off < seglen)
+				seglen = len - off;
+
+			if (seglen > SIGNSKY_PACKET_MAX_LEN)
+				continue;
+
+			/* A full sized packet its ciphertext is larger. */
+			if ((pkt = signsky_packet_get_len(
+			    seglen < SIGNSKY_PACKET_DATA_LEN ?
+			    seglen : SIGNSKY_PACKET_DATA_LEN)) == NULL)
+				break;
+
+			memcpy(signsky_packet_head(pkt), &data[off], seglen);
+			memcpy(&pkt->addr, &addr[idx], sizeof(pkt->addr));
+
+			pkt->ts = now;
+			pkt->length = seglen;
+			pkt->target = SIGNSKY_PROC_DECRYPT;
+
+			if (crypto_packet_check(pkt) == -1) {
+				signsky_packet_release(pkt);
+				continue;
+			}
+
+			pkts[count++] = pkt;
+
+			if (count == SIGNSKY_PACKETS_PER_EVENT) {
+				crypto_decrypt_queue(pkts, count);
+				count = 0;
+			}
+		}
+	}
+
+	crypto_decrypt_queue(pkts, count);
+}
+
+/*
+ * Read the packets that arrived on the AF_XDP socket and queue them up
+ * for decryption, returns how many were read.
+ */
+static size_t
+crypto_recv_xdp(void)
+{
+	size_t		ret;
+	void		*pkts[SIGNSKY_PACKETS_PER_EVENT];
+
+	PRECOND(xdpfd != -1);
+
+	ret = signsky_xdp_recv(pkts, SIGNSKY_PACKETS_PER_EVENT);
+	crypto_recv_batch(pkts, ret);
+
+	return (ret);
+}
+
+/*
+ * Take the packets the io_uring engine received and queue them up
+ * for decryption, returns how many were received.
+ */
+static size_t
+crypto_recv_uring(void)
+{
+	size_t		ret;
+	void		*pkts[SIGNSKY_PACKETS_PER_EVENT];
+
+	PRECOND(uringfd != -1);
+
+	ret = signsky_uring_recv(pkts, SIGNSKY_PACKETS_PER_EVENT);
+	crypto_recv_batch(pkts, ret);
+
+	return (ret);
+}
+
+/*
+ * Check the given received packets and queue the valid ones for
+ * decryption in a single burst.
+ */
+static void
+crypto_recv_batch(void **pkts, size_t ret)
+{
+	u_int64_t		now;
+	struct signsky_packet	*pkt;
+	size_t			idx, count;
+
+	PRECOND(pkts != NULL);
+
+	if (ret == 0)
+		return;
+
+	count = 0;
+	now = signsky_time_ns();
+
+	for (idx = 0; idx < ret; idx++) {
+		pkt = pkts[idx];
+
+		pkt->ts = now;
+		pkt->target = SIGNSKY_PROC_DECRYPT;
+
+		if (crypto_packet_check(pkt) == -1) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		pkts[count++] = pkt;
+	}
+
+	crypto_decrypt_queue(pkts, count);
+}
+
+/*
+ * Hand the given packets to the io_uring engine (or the AF_XDP socket),
+ * each is sent to the peer its address which we place in pkt->addr.
+ * Packets for a peer whose address is not yet known are dropped.
+ */
+static void
+crypto_send_uring(void **pkts, size_t count)
+{
+	size_t			idx;
+	u_int64_t		now;
+	struct signsky_peer	*peer;
+	struct signsky_packet	*pkt;
+
+	PRECOND(pkts != NULL);
+	PRECOND(uringfd != -1);
+
+	now = signsky_time_ns();
+
+	for (idx = 0; idx < count; idx++) {
+		pkt = pkts[idx];
+		PRECOND(pkt->target == SIGNSKY_PROC_CRYPTO);
+		PRECOND(pkt->peer < signsky->npeers);
+
+		signsky_stat_latency(signsky_stats->tx_latency, pkt->ts, now);
+
+		if (xdpfd != -1 && crypto_send_xdp(pkt) == 0) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		peer = &signsky->peers[pkt->peer];
+
+		pkt->addr.sin_family = AF_INET;
+		pkt->addr.sin_port = signsky_atomic_read(&peer->port);
+		pkt->addr.sin_addr.s_addr = signsky_atomic_read(&peer->ip);
+
+		if (pkt->addr.sin_addr.s_addr == 0) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		signsky_uring_send(pkt);
+	}
+
+	if (xdpfd != -1)
+		signsky_xdp_flush();
+
+	signsky_uring_submit();
+}
+
+/*
+ * Send the given packet via the AF_XDP socket, which is only possible
+ * once we learned the ethernet address the peer its packets come from.
+ * Returns -1 if the caller must send the packet via the socket instead,
+ * the caller keeps the packet in either case.
+ */
+static int
+crypto_send_xdp(struct signsky_packet *pkt)
+{
+	struct sockaddr_in	addr;
+	struct signsky_peer	*peer;
+
+	PRECOND(xdpfd != -1);
+	PRECOND(pkt != NULL);
+
+	peer = &signsky->peers[pkt->peer];
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = signsky_atomic_read(&peer->port);
+	addr.sin_addr.s_addr = signsky_atomic_read(&peer->ip);
+
+	if (addr.sin_addr.s_addr == 0)
+		return (-1);
+
+	if (signsky_xdp_send(pkt, &addr,
+	    signsky_atomic_read(&peer->ether)) == -1)
+		return (-1);
+
+	signsky_stat_peer(pkt->peer, 1, pkt->length);
+
+	return (0);
+}
+
+/*
+ * Packets can arrive on both the socket and the AF_XDP socket, so when
+ * idle we park on an epoll descriptor that holds both.
+ */
+static int
+crypto_xdp_park(int fd)
+{
+	int			efd;
+	struct epoll_event	evt;
+
+	PRECOND(fd >= 0);
+	PRECOND(xdpfd != -1);
+
+	if ((efd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		fatal("%s: epoll_create1: %s", __func__, errno_s);
+
+	memset(&evt, 0, sizeof(evt));
+	evt.events = EPOLLIN;
+
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &evt) == -1 ||
+	    epoll_ctl(efd, EPOLL_CTL_ADD, xdpfd, &evt) == -1)
+		fatal("%s: epoll_ctl: %s", __func__, errno_s);
+
+	return (efd);
+}
+
+/*
+ * Queue the given packets for decryption in a single burst, any
+ * packets that did not fit onto the queue are dropped.
+ */
+static void
+crypto_decrypt_queue(void **pkts, size_t count)
+{
+	size_t		idx, queued;
+
+	PRECOND(pkts != NULL);
+
+	queued = signsky_ring_queue_burst(io->decrypt, pkts, count);
+	signsky_stat_add(ring_full, count - queued);
+
+	for (idx = queued; idx < count; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+
+/*
+ * Ask the kernel for the path MTU of all peers, called once a second
+ * so we notice when it changed (or when a lower one expired).
+ */
+static void
+crypto_pmtu_refresh(void)
+{
+	u_int32_t	peer;
+
+	pmtu_last = signsky_atomic_read(&signsky->uptime);
+
+	for (peer = 0; peer < signsky->npeers; peer++)
+		crypto_pmtu_update(peer);
+
+	crypto_pmtu_publish();
+}
+
+/*
+ * Ask the kernel for the path MTU towards the given peer, which it
+ * learns from the ICMP errors for the packets we send with DF set.
+ *
+ * The clear processes use it to answer packets that would not fit
+ * once encrypted with an ICMP fragmentation needed.
+ */
+static void
+crypto_pmtu_update(u_int32_t idx)
+{
+	int			mtu;
+	socklen_t		len;
+	struct sockaddr_in	sin;
+	struct signsky_peer	*peer;
+
+	PRECOND(idx < signsky->npeers);
+	PRECOND(pmtufd != -1);
+
+	peer = &signsky->peers[idx];
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = signsky_atomic_read(&peer->port);
+	sin.sin_addr.s_addr = signsky_atomic_read(&peer->ip);
+
+	if (sin.sin_addr.s_addr == 0)
+		return;
+
+	if (connect(pmtufd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		return;
+
+	len = sizeof(mtu);
+	if (getsockopt(pmtufd, IPPROTO_IP, IP_MTU, &mtu, &len) == -1 ||
+	    mtu <= 0)
+		return;
+
+	if ((u_int32_t)mtu != signsky_atomic_read(&peer->pmtu)) {
+		syslog(LOG_INFO, "peer %u path mtu is now %d", idx, mtu);
+		signsky_atomic_write(&peer->pmtu, mtu);
+	}
+}
+
+/*
+ * Publish the smallest path MTU of all peers, the clear processes only
+ * look at the path MTU of a peer if a packet is larger than this.
+ *
+ * The largest path MTU of all peers bounds the datagrams we expect
+ * to read, unless we do not know the path MTU of one of them.
+ */
+static void
+crypto_pmtu_publish(void)
+{
+	int		unknown;
+	u_int32_t	idx, mtu, min, max;
+
+	min = 0;
+	max = 0;
+	unknown = 0;
+
+	for (idx = 0; idx < signsky->npeers; idx++) {
+		mtu = signsky_atomic_read(&signsky->peers[idx].pmtu);
+		if (mtu != 0 && (min == 0 || mtu < min))
+			min = mtu;
+
+		if (mtu == 0)
+			unknown = 1;
+		else if (mtu > max)
+			max = mtu;
+	}
+
+	if (min != signsky_atomic_read(&signsky->pmtu))
+		signsky_atomic_write(&signsky->pmtu, min);
+
+	if (unknown || max <= sizeof(struct ip) + sizeof(struct udphdr))
+		signsky_packet_readlen(0);
+	else
+		signsky_packet_readlen(max - sizeof(struct ip) -
+		    sizeof(struct udphdr));
+}
+#else
+/*
+ * Send the given packets onto the crypto interface one at a time.
+ * This function will return all packets to the packet pool.
+ */
+static void
+crypto_send_packets(int fd, void **pkts, size_t count)
+{
+	size_t			idx;
+
+	PRECOND(fd >= 0);
+	PRECOND(pkts != NULL);
+
+	for (idx = 0; idx < count; idx++)
+		crypto_send_packet(fd, pkts[idx]);
+}
+
 /*
  * Send the given packet onto the crypto interface.
  * This function will return the packet to the packet pool.
@@ -171,18 +970,25 @@ static void
 crypto_send_packet(int fd, struct signsky_packet *pkt)
 {
 	ssize_t			ret;
-	struct sockaddr_in	peer;
+	struct sockaddr_in	addr;
+	struct signsky_peer	*peer;
 	u_int8_t		*data;
 
 	PRECOND(fd >= 0);
 	PRECOND(pkt != NULL);
 	PRECOND(pkt->target == SIGNSKY_PROC_CRYPTO);
+	PRECOND(pkt->peer < signsky->npeers);
 
-	peer.sin_family = AF_INET;
-	peer.sin_port = signsky_atomic_read(&signsky->peer_port);
-	peer.sin_addr.s_addr = signsky_atomic_read(&signsky->peer_ip);
+	signsky_stat_latency(signsky_stats->tx_latency,
+	    pkt->ts, signsky_time_ns());
 
-	if (peer.sin_addr.s_addr == 0) {
+	peer = &signsky->peers[pkt->peer];
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = signsky_atomic_read(&peer->port);
+	addr.sin_addr.s_addr = signsky_atomic_read(&peer->ip);
+
+	if (addr.sin_addr.s_addr == 0) {
 		signsky_packet_release(pkt);
 		return;
 	}
@@ -191,7 +997,7 @@ crypto_send_packet(int fd, struct signsky_packet *pkt)
 		data = signsky_packet_head(pkt);
 
 		if ((ret = sendto(fd, data, pkt->length, 0,
-		    (struct sockaddr *)&peer, sizeof(peer))) == -1) {
+		    (struct sockaddr *)&addr, sizeof(addr))) == -1) {
 			if (errno == EINTR)
 				continue;
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -200,20 +1006,18 @@ crypto_send_packet(int fd, struct signsky_packet *pkt)
 				syslog(LOG_INFO,
 				    "packet (size=%zu) too large for crypto, "
 				    "lower tunnel MTU", pkt->length);
+				signsky_stat_add(emsgsize, 1);
 				break;
 			}
 			if (errno == ENETUNREACH || errno == EHOSTUNREACH) {
 				syslog(LOG_INFO, "host %s unreachable (%s)",
-				    inet_ntoa(signsky->peer.sin_addr),
-				    errno_s);
+				    inet_ntoa(addr.sin_addr), errno_s);
 				break;
 			}
 			fatal("sendto: %s", errno_s);
 		}
 
-		signsky_atomic_add(&signsky->tx.pkt, 1);
-		signsky_atomic_add(&signsky->tx.bytes, pkt->length);
-		signsky_atomic_write(&signsky->tx.last, signsky->uptime);
+		signsky_stat_peer(pkt->peer, 1, pkt->length);
 		break;
 	}
 
@@ -221,30 +1025,38 @@ crypto_send_packet(int fd, struct signsky_packet *pkt)
 }
 
 /*
- * Read up to PACKETS_PER_EVENT number of packets, queueing them up
- * for decryption via the decryption queue.
+ * Read up to SIGNSKY_PACKETS_PER_EVENT number of packets, queueing them
+ * up for decryption via the decryption queue in a single burst.
  */
 static void
 crypto_recv_packets(int fd)
 {
-	int			idx;
 	ssize_t			ret;
+	struct iovec		iov;
+	struct msghdr		msg;
 	struct signsky_packet	*pkt;
-	u_int8_t		*data;
-	socklen_t		socklen;
+	size_t			idx, count, queued;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(fd >= 0);
 
-	for (idx = 0; idx < PACKETS_PER_EVENT; idx++) {
+	count = 0;
+
+	for (idx = 0; idx < SIGNSKY_PACKETS_PER_EVENT; idx++) {
 		if ((pkt = signsky_packet_get()) == NULL)
-			pkt = &tpkt;
+			pkt = tpkt;
 
-		socklen = sizeof(pkt->addr);
-		data = signsky_packet_head(pkt);
+		iov.iov_len = pkt->size;
+		iov.iov_base = signsky_packet_head(pkt);
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_name = &pkt->addr;
+		msg.msg_namelen = sizeof(pkt->addr);
 
-		if ((ret = recvfrom(fd, data, SIGNSKY_PACKET_DATA_LEN, 0,
-		    (struct sockaddr *)&pkt->addr, &socklen)) == -1) {
-			if (pkt != &tpkt)
+		if ((ret = recvmsg(fd, &msg, 0)) == -1) {
+			if (pkt != tpkt)
 				signsky_packet_release(pkt);
 			if (errno == EINTR)
 				continue;
@@ -258,21 +1070,49 @@ crypto_recv_packets(int fd)
 		if (ret == 0)
 			fatal("eof on crypto interface");
 
-		if (pkt == &tpkt)
+		if (pkt == tpkt)
 			continue;
 
 		pkt->length = ret;
+		pkt->ts = signsky_time_ns();
 		pkt->target = SIGNSKY_PROC_DECRYPT;
 
-		if (crypto_packet_check(pkt) == -1) {
-			signsky_packet_release(pkt);
+		if (msg.msg_flags & MSG_TRUNC) {
+			crypto_truncated(pkt);
 			continue;
 		}
 
-		if (signsky_ring_queue(io->decrypt, pkt) == -1)
+		if (crypto_packet_check(pkt) == -1) {
 			signsky_packet_release(pkt);
+			continue;
+		}
 
+		pkts[count++] = pkt;
 	}
+
+	queued = signsky_ring_queue_burst(io->decrypt, pkts, count);
+	signsky_stat_add(ring_full, count - queued);
+
+	for (idx = queued; idx < count; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+#endif
+
+/*
+ * A datagram did not fit in the packet we read it into, drop it and
+ * read into large packets from here on if it was not one already.
+ */
+static void
+crypto_truncated(struct signsky_packet *pkt)
+{
+	PRECOND(pkt != NULL);
+
+	if (pkt->class != SIGNSKY_PACKET_CLASS_LARGE)
+		signsky_packet_truncated();
+
+	pkt->length = pkt->size;
+	signsky_packet_release(pkt);
+	signsky_stat_add(invalid, 1);
 }
 
 /*
@@ -283,6 +1123,10 @@ crypto_recv_packets(int fd)
  * If these checks fail we do not move the packet forward to the
  * decryption process and instead it will get dropped.
  *
+ * The SPI is looked up in the SPI table which tells us which peer
+ * the packet belongs to, this is set on the packet so the decryption
+ * process can find the right SA.
+ *
  * For the anti-replay check we only check if the packet falls
  * inside of the anti-replay window here, the rest is up to
  * the decryption process. We need to account for the fact that
@@ -293,13 +1137,13 @@ static int
 crypto_packet_check(struct signsky_packet *pkt)
 {
 	struct signsky_ipsec_hdr	*hdr;
-	u_int32_t			seq, spi;
+	u_int32_t			seq, spi, peer;
 	u_int64_t			pn, last;
 
 	PRECOND(pkt != NULL);
 
 	if (signsky_packet_crypto_checklen(pkt) == -1)
-		return (-1);
+		goto invalid;
 
 	hdr = signsky_packet_head(pkt);
 	spi = be32toh(hdr->esp.spi);
@@ -307,25 +1151,32 @@ crypto_packet_check(struct signsky_packet *pkt)
 	pn = be64toh(hdr->pn);
 
 	if (spi == 0)
-		return (-1);
+		goto invalid;
 
-	if (spi != signsky_atomic_read(&signsky->rx.spi)) {
-		if (spi != signsky_atomic_read(&signsky->rx_pending))
-			return (-1);
-	}
+	if (signsky_spi_lookup(io->spi, spi, &peer) == -1)
+		goto invalid;
+
+	if (peer >= signsky->npeers)
+		goto invalid;
 
 	if ((pn & 0xffffffff) != seq)
-		return (-1);
+		goto invalid;
 
-	last = signsky_atomic_read(&io->arwin->last);
+	pkt->peer = peer;
+	last = signsky_atomic_read(&io->arwin[peer].last);
 
 	if (pn > last)
 		return (0);
 
-	if (pn > 0 && (SIGNSKY_ARWIN_SIZE + 1023) > last - pn)
+	if (pn > 0 && (signsky->arwin_size + 1023) > last - pn)
 		return (0);
 
-	syslog(LOG_INFO, "dropped too old packet, seq=0x%" PRIx64, pn);
+	signsky_stat_add(replay, 1);
+
+	return (-1);
+
+invalid:
+	signsky_stat_add(invalid, 1);
 
 	return (-1);
 }
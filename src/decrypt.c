@@ -21,7 +21,6 @@
 #include <arpa/inet.h>
 
 #include <poll.h>
-#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -31,22 +30,52 @@
 
 static void	decrypt_drop_access(void);
 static void	decrypt_keys_install(void);
-static void	decrypt_packet_process(struct signsky_packet *);
+static int	decrypt_handoff_export(void);
+static int	decrypt_handoff_import(void);
+static void	decrypt_burst_process(void **, size_t);
+static int	decrypt_packet_process(struct signsky_packet *);
+static int	decrypt_packet_prepare(struct signsky_packet *);
 static int	decrypt_with_slot(struct signsky_sa *, struct signsky_packet *);
+static void	decrypt_slot_nonce(struct signsky_sa *,
+		    struct signsky_ipsec_hdr *, u_int8_t *, u_int8_t *);
+static int	decrypt_slot_finish(struct signsky_sa *,
+		    struct signsky_packet *);
 
 static int	decrypt_arwin_check(struct signsky_packet *,
 		    struct signsky_ipsec_hdr *);
-static void	decrypt_arwin_update(struct signsky_packet *,
+static int	decrypt_arwin_update(struct signsky_packet *,
 		    struct signsky_ipsec_hdr *);
 
+static void	decrypt_arwin_lock(struct signsky_arwin *);
+static void	decrypt_arwin_unlock(struct signsky_arwin *);
+
 /* The local queues. */
 static struct signsky_proc_io	*io = NULL;
 
-/* The local state for RX. */
+/* The worker id, used to find our RX key slot for each peer. */
+static u_int16_t		worker = 0;
+
+/* Our pid, which we place in the anti-replay window locks we hold. */
+static pid_t			self = 0;
+
+/* The keying generation we last looked at our key slots for. */
+static u_int32_t		keygen = 0;
+
+/* Our handoff slot while our successor sets itself up, or NULL. */
+static struct signsky_handoff	*handing = NULL;
+
+/* Set if there are retired ciphers waiting to be cleaned up. */
+static int			retired = 0;
+
+/*
+ * The local state for RX, per peer. The cipher of slot_1 is retired
+ * when slot_2 takes over and is cleaned up outside of the burst.
+ */
 static struct {
 	struct signsky_sa	slot_1;
 	struct signsky_sa	slot_2;
-} state;
+	void			*retired;
+} state[SIGNSKY_PEERS_MAX];
 
 /*
  * The worker process responsible for encryption of packets coming
@@ -55,23 +84,34 @@ static struct {
 void
 signsky_decrypt_entry(struct signsky_proc *proc)
 {
-	struct signsky_packet		*pkt;
+	size_t				count;
+	u_int64_t			idle;
+	u_int16_t			peer;
 	int				sig, running;
+	void				*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(proc != NULL);
 	PRECOND(proc->arg != NULL);
 
 	io = proc->arg;
+	worker = proc->id;
+	self = proc->pid;
+
 	decrypt_drop_access();
 
 	signsky_signal_trap(SIGQUIT);
+	signsky_signal_trap(SIGUSR1);
 	signsky_signal_ignore(SIGINT);
 
 	memset(&state, 0, sizeof(state));
 
+	idle = 0;
 	running = 1;
 	signsky_proc_privsep(proc);
 
+	if (decrypt_handoff_import() == -1)
+		running = 0;
+
 	while (running) {
 		if ((sig = signsky_last_signal()) != -1) {
 			syslog(LOG_NOTICE, "received signal %d", sig);
@@ -79,19 +119,58 @@ signsky_decrypt_entry(struct signsky_proc *proc)
 			case SIGQUIT:
 				running = 0;
 				continue;
+			case SIGUSR1:
+				if (handing == NULL &&
+				    decrypt_handoff_export() == -1) {
+					running = 0;
+					continue;
+				}
+				break;
 			}
 		}
 
-		decrypt_keys_install();
+		if (handing != NULL && signsky_handoff_asked(handing)) {
+			signsky_handoff_release(handing);
+			running = 0;
+			continue;
+		}
+
+		/* Keys that become pending now are for our successor. */
+		if (handing == NULL)
+			decrypt_keys_install();
 
-		while ((pkt = signsky_ring_dequeue(io->decrypt)))
-			decrypt_packet_process(pkt);
+		while ((count = signsky_ring_dequeue_burst(io->decrypt,
+		    pkts, SIGNSKY_PACKETS_PER_EVENT)) > 0) {
+			decrypt_burst_process(pkts, count);
+			idle = 0;
 
-#if !defined(SIGNSKY_HIGH_PERFORMANCE)
-		usleep(500);
-#endif
+			if (handing != NULL) {
+				if (signsky_handoff_asked(handing))
+					break;
+			} else {
+				decrypt_keys_install();
+			}
+
+			if (signsky_signal_pending() != -1)
+				break;
+		}
+
+		/* Never park while our successor may ask us to stop. */
+		if (handing != NULL)
+			signsky_cpu_pause();
+		else
+			signsky_ring_idle(io->decrypt, -1, &idle);
+	}
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		signsky_sa_clear(&state[peer].slot_1);
+		signsky_sa_clear(&state[peer].slot_2);
+
+		if (state[peer].retired != NULL)
+			signsky_cipher_cleanup(state[peer].retired);
 	}
 
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -104,88 +183,317 @@ static void
 decrypt_drop_access(void)
 {
 	signsky_shm_detach(io->tx);
+	signsky_shm_detach(io->spi);
+	signsky_shm_detach(io->seqnr);
 	signsky_shm_detach(io->crypto);
 	signsky_shm_detach(io->encrypt);
+	signsky_shm_detach(io->handoff_tx);
 
 	io->tx = NULL;
+	io->spi = NULL;
+	io->seqnr = NULL;
 	io->crypto = NULL;
 	io->encrypt = NULL;
+	io->handoff_tx = NULL;
 }
 
 /*
- * Attempt to install any pending keys into the correct slot.
+ * Attempt to install any pending keys into the correct slot, for
+ * each of the configured peers.
  *
  * Once we have a primary RX key in slot_1, all keys that are
  * pending will be installed under slot_2 first.
+ *
+ * This is only called in between bursts, it cleans up any retired
+ * ciphers and only walks the key slots if keying made new keys
+ * pending since the last time we looked.
  */
 static void
 decrypt_keys_install(void)
 {
-	if (state.slot_1.cipher == NULL) {
-		if (signsky_key_install(io->rx, &state.slot_1) != -1) {
-			signsky_atomic_write(&signsky->rx.spi,
-			    state.slot_1.spi);
-			syslog(LOG_NOTICE, "new RX SA (spi=0x%08x)",
-			    state.slot_1.spi);
+	u_int32_t		gen;
+	u_int16_t		peer;
+	struct signsky_key	*key;
+
+	if (retired) {
+		for (peer = 0; peer < signsky->npeers; peer++) {
+			if (state[peer].retired == NULL)
+				continue;
+			signsky_cipher_cleanup(state[peer].retired);
+			state[peer].retired = NULL;
 		}
-	} else {
-		if (signsky_key_install(io->rx, &state.slot_2) != -1) {
-			signsky_atomic_write(&signsky->rx_pending,
-			    state.slot_2.spi);
-			syslog(LOG_NOTICE, "pending RX SA (spi=0x%08x)",
-			    state.slot_2.spi);
+		retired = 0;
+	}
+
+	if ((gen = signsky_atomic_read(&signsky->keygen)) == keygen)
+		return;
+
+	keygen = gen;
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		key = SIGNSKY_KEY_SLOT(io->rx, SIGNSKY_PROC_DECRYPT,
+		    peer, worker);
+
+		if (state[peer].slot_1.cipher == NULL) {
+			if (signsky_key_install(key,
+			    &state[peer].slot_1) == -1)
+				continue;
+			signsky_atomic_write(&signsky->peers[peer].rx_spi,
+			    state[peer].slot_1.spi);
+			syslog(LOG_NOTICE, "new RX SA (peer=%u, spi=0x%08x)",
+			    peer, state[peer].slot_1.spi);
+		} else {
+			if (signsky_key_install(key,
+			    &state[peer].slot_2) == -1)
+				continue;
+			signsky_atomic_write(&signsky->peers[peer].rx_pending,
+			    state[peer].slot_2.spi);
+			syslog(LOG_NOTICE,
+			    "pending RX SA (peer=%u, spi=0x%08x)",
+			    peer, state[peer].slot_2.spi);
 		}
 	}
 }
 
 /*
- * Decrypt and verify a single packet under the current RX key, or if
- * that fails and there is a pending key, under the pending RX key.
+ * Hand both our RX SAs to the worker that takes over from us on a
+ * warm restart. We keep decrypting with them until it set itself up
+ * and asks us to stop, the anti-replay windows are shared.
  *
- * If successfull the packet is sent onto the clear interface.
- * If the pending RX key was used, it becomes the active one.
+ * Should we switch to the pending SA of a peer in the meantime, our
+ * successor does the same on the first packet it sees for it.
+ *
+ * Returns -1 if the handoff was not expected and we should stop.
+ */
+static int
+decrypt_handoff_export(void)
+{
+	u_int16_t		peer;
+	struct signsky_handoff	*slot;
+
+	slot = SIGNSKY_HANDOFF_SLOT(io, SIGNSKY_PROC_DECRYPT, worker);
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		signsky_sa_export(&state[peer].slot_1, &slot->sa[peer][0]);
+		signsky_sa_export(&state[peer].slot_2, &slot->sa[peer][1]);
+	}
+
+	if (signsky_handoff_ready(slot) == -1)
+		return (-1);
+
+	handing = slot;
+	syslog(LOG_NOTICE, "handed over RX SAs");
+
+	return (0);
+}
+
+/*
+ * Take over the RX SAs of our predecessor if we were started for a
+ * warm restart, before we touch any of the rings.
+ *
+ * Returns -1 if we were told to quit while waiting for it.
+ */
+static int
+decrypt_handoff_import(void)
+{
+	u_int16_t		peer;
+	struct signsky_handoff	*slot;
+
+	slot = SIGNSKY_HANDOFF_SLOT(io, SIGNSKY_PROC_DECRYPT, worker);
+
+	if (signsky_handoff_wait(slot) == -1)
+		return (0);
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		signsky_sa_import(&slot->sa[peer][0], &state[peer].slot_1);
+		signsky_sa_import(&slot->sa[peer][1], &state[peer].slot_2);
+	}
+
+	if (signsky_handoff_takeover(slot) == -1)
+		return (-1);
+
+	syslog(LOG_NOTICE, "took over RX SAs");
+
+	return (0);
+}
+
+/*
+ * Decrypt and verify a burst of packets and hand all of them that
+ * were successfully decrypted to the clear side in a single burst.
+ *
+ * All packets for the current RX key of a peer are decrypted in
+ * batches, one per run of packets from the same peer, anything else
+ * (such as packets for a pending RX key) goes through
+ * decrypt_packet_process() one by one.
  */
 static void
+decrypt_burst_process(void **pkts, size_t count)
+{
+	struct signsky_ipsec_hdr	*hdr;
+	struct signsky_sa		*sa;
+	struct signsky_packet		*pkt;
+	size_t				idx, ready, queued, nops, run;
+	int				batched[SIGNSKY_PACKETS_PER_EVENT];
+	struct signsky_cipher_op	ops[SIGNSKY_PACKETS_PER_EVENT];
+
+	PRECOND(pkts != NULL);
+	PRECOND(count <= SIGNSKY_PACKETS_PER_EVENT);
+
+	nops = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		pkt = pkts[idx];
+		batched[idx] = -1;
+
+		if (decrypt_packet_prepare(pkt) == -1) {
+			signsky_stat_add(invalid, 1);
+			signsky_packet_release(pkt);
+			pkts[idx] = NULL;
+			continue;
+		}
+
+		hdr = signsky_packet_head(pkt);
+		sa = &state[pkt->peer].slot_1;
+
+		if (sa->cipher == NULL || hdr->esp.spi != sa->spi)
+			continue;
+
+		if (decrypt_arwin_check(pkt, hdr) == -1) {
+			signsky_packet_release(pkt);
+			pkts[idx] = NULL;
+			continue;
+		}
+
+		ops[nops].pkt = pkt;
+		decrypt_slot_nonce(sa, hdr, ops[nops].nonce, ops[nops].aad);
+
+		batched[idx] = nops++;
+	}
+
+	for (idx = 0; idx < nops; idx += run) {
+		pkt = ops[idx].pkt;
+
+		for (run = 1; idx + run < nops; run++) {
+			if (ops[idx + run].pkt->peer != pkt->peer)
+				break;
+		}
+
+		signsky_cipher_decrypt_batch(state[pkt->peer].slot_1.cipher,
+		    &ops[idx], run);
+	}
+
+	ready = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		if ((pkt = pkts[idx]) == NULL)
+			continue;
+
+		if (batched[idx] == -1) {
+			if (decrypt_packet_process(pkt) != -1)
+				pkts[ready++] = pkt;
+			continue;
+		}
+
+		if (ops[batched[idx]].ret == -1) {
+			signsky_stat_add(tag_fail, 1);
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		if (decrypt_slot_finish(&state[pkt->peer].slot_1, pkt) == -1) {
+			signsky_packet_release(pkt);
+			continue;
+		}
+
+		pkts[ready++] = pkt;
+	}
+
+	queued = signsky_ring_queue_burst(io->clear, pkts, ready);
+	signsky_stat_add(ring_full, ready - queued);
+
+	for (idx = queued; idx < ready; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+
+/*
+ * Decrypt and verify a single packet that was prepared with
+ * decrypt_packet_prepare() under the current RX key, or if that
+ * fails and there is a pending key, under the pending RX key.
+ *
+ * If successfull the packet is ready to be sent onto the clear interface,
+ * otherwise it is released and -1 is returned.
+ * If the pending RX key was used, it becomes the active one.
+ */
+static int
 decrypt_packet_process(struct signsky_packet *pkt)
 {
 	struct signsky_ipsec_hdr	*hdr;
+	u_int32_t			peer;
 
 	PRECOND(pkt != NULL);
 	PRECOND(pkt->target == SIGNSKY_PROC_DECRYPT);
 
-	decrypt_keys_install();
+	peer = pkt->peer;
+
+	if (decrypt_with_slot(&state[peer].slot_1, pkt) != -1)
+		return (0);
 
-	if (signsky_packet_crypto_checklen(pkt) == -1) {
+	if (decrypt_with_slot(&state[peer].slot_2, pkt) == -1) {
+		hdr = signsky_packet_head(pkt);
+		if (hdr->esp.spi != state[peer].slot_1.spi &&
+		    hdr->esp.spi != state[peer].slot_2.spi)
+			signsky_stat_add(invalid, 1);
 		signsky_packet_release(pkt);
-		return;
+		return (-1);
 	}
 
-	hdr = signsky_packet_head(pkt);
-	hdr->esp.spi = be32toh(hdr->esp.spi);
-	hdr->esp.seq = be32toh(hdr->esp.seq);
-	hdr->pn = be64toh(hdr->pn);
+	signsky_atomic_write(&signsky->peers[peer].rx_spi,
+	    state[peer].slot_2.spi);
+	signsky_atomic_write(&signsky->peers[peer].rx_pending, 0);
 
-	if (decrypt_with_slot(&state.slot_1, pkt) != -1)
-		return;
+	syslog(LOG_NOTICE, "swapping RX SA (peer=%u, spi=0x%08x)",
+	    peer, state[peer].slot_2.spi);
 
-	if (decrypt_with_slot(&state.slot_2, pkt) == -1) {
-		signsky_packet_release(pkt);
-		return;
-	}
+	if (state[peer].retired != NULL)
+		signsky_cipher_cleanup(state[peer].retired);
+
+	retired = 1;
+	state[peer].retired = state[peer].slot_1.cipher;
+
+	state[peer].slot_1.spi = state[peer].slot_2.spi;
+	state[peer].slot_1.salt = state[peer].slot_2.salt;
+	state[peer].slot_1.seqnr = state[peer].slot_2.seqnr;
+	state[peer].slot_1.cipher = state[peer].slot_2.cipher;
+	memcpy(state[peer].slot_1.key, state[peer].slot_2.key,
+	    sizeof(state[peer].slot_1.key));
 
-	signsky_atomic_write(&signsky->rx.spi, state.slot_2.spi);
-	signsky_atomic_write(&signsky->rx_pending, 0);
+	signsky_mem_zero(&state[peer].slot_2, sizeof(state[peer].slot_2));
+
+	return (0);
+}
+
+/*
+ * Check the length of the packet and convert its ESP header into
+ * host byte order.
+ */
+static int
+decrypt_packet_prepare(struct signsky_packet *pkt)
+{
+	struct signsky_ipsec_hdr	*hdr;
 
-	syslog(LOG_NOTICE, "swapping RX SA (spi=0x%08x)", state.slot_2.spi);
+	PRECOND(pkt != NULL);
+	PRECOND(pkt->target == SIGNSKY_PROC_DECRYPT);
+	PRECOND(pkt->peer < signsky->npeers);
 
-	signsky_cipher_cleanup(state.slot_1.cipher);
+	if (signsky_packet_crypto_checklen(pkt) == -1)
+		return (-1);
 
-	state.slot_1.spi = state.slot_2.spi;
-	state.slot_1.salt = state.slot_2.salt;
-	state.slot_1.seqnr = state.slot_2.seqnr;
-	state.slot_1.cipher = state.slot_2.cipher;
+	hdr = signsky_packet_head(pkt);
+	hdr->esp.spi = be32toh(hdr->esp.spi);
+	hdr->esp.seq = be32toh(hdr->esp.seq);
+	hdr->pn = be64toh(hdr->pn);
 
-	signsky_mem_zero(&state.slot_2, sizeof(state.slot_2));
+	return (0);
 }
 
 /*
@@ -195,7 +503,6 @@ static int
 decrypt_with_slot(struct signsky_sa *sa, struct signsky_packet *pkt)
 {
 	struct signsky_ipsec_hdr	*hdr;
-	struct signsky_ipsec_tail	*tail;
 	u_int8_t			nonce[12], aad[12];
 
 	PRECOND(sa != NULL);
@@ -211,41 +518,87 @@ decrypt_with_slot(struct signsky_sa *sa, struct signsky_packet *pkt)
 	if (decrypt_arwin_check(pkt, hdr) == -1)
 		return (-1);
 
+	decrypt_slot_nonce(sa, hdr, nonce, aad);
+
+	if (signsky_cipher_decrypt(sa->cipher, nonce, sizeof(nonce),
+	    aad, sizeof(aad), pkt) == -1) {
+		signsky_stat_add(tag_fail, 1);
+		return (-1);
+	}
+
+	return (decrypt_slot_finish(sa, pkt));
+}
+
+/*
+ * Construct the 12 byte nonce and aad for the given packet header
+ * under the given SA.
+ */
+static void
+decrypt_slot_nonce(struct signsky_sa *sa, struct signsky_ipsec_hdr *hdr,
+    u_int8_t *nonce, u_int8_t *aad)
+{
+	PRECOND(sa != NULL);
+	PRECOND(hdr != NULL);
+	PRECOND(nonce != NULL);
+	PRECOND(aad != NULL);
+
 	memcpy(nonce, &sa->salt, sizeof(sa->salt));
 	memcpy(&nonce[sizeof(sa->salt)], &hdr->pn, sizeof(hdr->pn));
 
 	memcpy(aad, &sa->spi, sizeof(sa->spi));
 	memcpy(&aad[sizeof(sa->spi)], &hdr->pn, sizeof(hdr->pn));
+}
 
-	if (signsky_cipher_decrypt(sa->cipher, nonce, sizeof(nonce),
-	    aad, sizeof(aad), pkt) == -1)
+/*
+ * Finish up a packet that was successfully decrypted and verified
+ * under the given SA: update the anti-replay window, track the peer
+ * its address (and ethernet address for XDP) and strip the ESP header
+ * and trailer.
+ */
+static int
+decrypt_slot_finish(struct signsky_sa *sa, struct signsky_packet *pkt)
+{
+	struct signsky_peer		*peer;
+	struct signsky_ipsec_hdr	*hdr;
+	struct signsky_ipsec_tail	*tail;
+
+	PRECOND(sa != NULL);
+	PRECOND(pkt != NULL);
+
+	hdr = signsky_packet_head(pkt);
+
+	if (decrypt_arwin_update(pkt, hdr) == -1)
 		return (-1);
 
-	decrypt_arwin_update(pkt, hdr);
+	peer = &signsky->peers[pkt->peer];
 
-	if (pkt->addr.sin_addr.s_addr != signsky->peer_ip ||
-	    pkt->addr.sin_port != signsky->peer_port) {
-		syslog(LOG_NOTICE, "peer address change (new=%s:%u)",
-		    inet_ntoa(pkt->addr.sin_addr), ntohs(pkt->addr.sin_port));
+	if (pkt->addr.sin_addr.s_addr != peer->ip ||
+	    pkt->addr.sin_port != peer->port) {
+		syslog(LOG_NOTICE, "peer %u address change (new=%s:%u)",
+		    pkt->peer, inet_ntoa(pkt->addr.sin_addr),
+		    ntohs(pkt->addr.sin_port));
 
-		signsky_atomic_write(&signsky->peer_ip,
-		    pkt->addr.sin_addr.s_addr);
-		signsky_atomic_write(&signsky->peer_port, pkt->addr.sin_port);
+		signsky_atomic_write(&peer->ip, pkt->addr.sin_addr.s_addr);
+		signsky_atomic_write(&peer->port, pkt->addr.sin_port);
+		signsky_atomic_write(&peer->ether, pkt->ether);
 	}
 
+	/* Only packets from the AF_XDP socket carry an ethernet address. */
+	if (pkt->ether != 0 && pkt->ether != peer->ether)
+		signsky_atomic_write(&peer->ether, pkt->ether);
+
 	pkt->length -= sizeof(struct signsky_ipsec_hdr);
 	pkt->length -= sizeof(struct signsky_ipsec_tail);
 	pkt->length -= signsky_cipher_overhead();
 
 	tail = signsky_packet_tail(pkt);
-	if (tail->pad != 0 || tail->next != IPPROTO_IP)
+	if (tail->pad != 0 || tail->next != IPPROTO_IP) {
+		signsky_stat_add(invalid, 1);
 		return (-1);
+	}
 
 	pkt->target = SIGNSKY_PROC_CLEAR;
 
-	if (signsky_ring_queue(io->clear, pkt) == -1)
-		signsky_packet_release(pkt);
-
 	return (0);
 }
 
@@ -255,56 +608,102 @@ decrypt_with_slot(struct signsky_sa *sa, struct signsky_packet *pkt)
 static int
 decrypt_arwin_check(struct signsky_packet *pkt, struct signsky_ipsec_hdr *hdr)
 {
-	u_int64_t	bit;
+	struct signsky_arwin	*arwin;
+	u_int64_t		last, word;
 
 	PRECOND(pkt != NULL);
 	PRECOND(hdr != NULL);
 
-	if ((hdr->pn & 0xffffffff) != hdr->esp.seq)
+	if ((hdr->pn & 0xffffffff) != hdr->esp.seq) {
+		signsky_stat_add(invalid, 1);
 		return (-1);
+	}
 
-	if (hdr->pn > io->arwin->last)
-		return (0);
+	arwin = &io->arwin[pkt->peer];
+	last = signsky_atomic_read(&arwin->last);
 
-	if (hdr->pn > 0 && SIGNSKY_ARWIN_SIZE > io->arwin->last - hdr->pn) {
-		bit = (SIGNSKY_ARWIN_SIZE - 1) - (io->arwin->last - hdr->pn);
-		if (io->arwin->bitmap & ((u_int64_t)1 << bit)) {
-			syslog(LOG_INFO,
-			    "packet seq=0x%" PRIx64 " already seen", hdr->pn);
-			return (-1);
-		}
+	if (hdr->pn > last)
 		return (0);
+
+	if (hdr->pn > 0 && signsky->arwin_size > last - hdr->pn) {
+		word = arwin->bitmap[(hdr->pn >> 6) & SIGNSKY_ARWIN_MASK];
+		if ((word & ((u_int64_t)1 << (hdr->pn & 63))) == 0)
+			return (0);
 	}
 
+	signsky_stat_add(replay, 1);
+
 	return (-1);
 }
 
 /*
- * Update the anti-replay window.
+ * Update the anti-replay window with the packet number of the
+ * given packet, if the packet was seen already -1 is returned.
+ *
+ * If the window moves forward any words it moved over are cleared
+ * before the bit for the packet is set.
  */
-static void
+static int
 decrypt_arwin_update(struct signsky_packet *pkt, struct signsky_ipsec_hdr *hdr)
 {
-	u_int64_t	bit;
+	int			ret;
+	struct signsky_arwin	*arwin;
+	u_int64_t		idx, words;
 
 	PRECOND(pkt != NULL);
 	PRECOND(hdr != NULL);
 
-	if (hdr->pn > io->arwin->last) {
-		if (hdr->pn - io->arwin->last >= SIGNSKY_ARWIN_SIZE) {
-			io->arwin->bitmap = ((u_int64_t)1 << 63);
-		} else {
-			io->arwin->bitmap >>= (hdr->pn - io->arwin->last);
-			io->arwin->bitmap |= ((u_int64_t)1 << 63);
-		}
+	ret = 0;
+	arwin = &io->arwin[pkt->peer];
 
-		signsky_atomic_write(&io->arwin->last, hdr->pn);
-		return;
+	decrypt_arwin_lock(arwin);
+
+	if (hdr->pn > arwin->last) {
+		idx = arwin->last >> 6;
+		words = (hdr->pn >> 6) - idx;
+
+		if (words > SIGNSKY_ARWIN_WORDS)
+			words = SIGNSKY_ARWIN_WORDS;
+
+		while (words-- > 0)
+			arwin->bitmap[++idx & SIGNSKY_ARWIN_MASK] = 0;
+
+		signsky_atomic_write(&arwin->last, hdr->pn);
+	} else if (decrypt_arwin_check(pkt, hdr) == -1) {
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		arwin->bitmap[(hdr->pn >> 6) & SIGNSKY_ARWIN_MASK] |=
+		    ((u_int64_t)1 << (hdr->pn & 63));
 	}
 
-	if (io->arwin->last < hdr->pn)
-		fatal("%s: window corrupt", __func__);
+	decrypt_arwin_unlock(arwin);
+
+	return (ret);
+}
+
+/*
+ * Grab the lock for the given anti-replay window, shared between
+ * all decrypt workers. The lock holds our pid while we have it.
+ */
+static void
+decrypt_arwin_lock(struct signsky_arwin *arwin)
+{
+	PRECOND(arwin != NULL);
+
+	while (!signsky_atomic_cas_simple(&arwin->lock, 0, self))
+		signsky_cpu_pause();
+}
+
+/*
+ * Release the lock for the given anti-replay window.
+ */
+static void
+decrypt_arwin_unlock(struct signsky_arwin *arwin)
+{
+	PRECOND(arwin != NULL);
 
-	bit = (SIGNSKY_ARWIN_SIZE - 1) - (io->arwin->last - hdr->pn);
-	io->arwin->bitmap |= ((u_int64_t)1 << bit);
+	if (!signsky_atomic_cas_simple(&arwin->lock, self, 0))
+		fatal("%s: lock was not held", __func__);
 }
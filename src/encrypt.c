@@ -25,13 +25,29 @@
 #include "signsky.h"
 
 static void	encrypt_drop_access(void);
-static void	encrypt_packet_process(struct signsky_packet *);
+static void	encrypt_keys_install(void);
+static int	encrypt_handoff_export(void);
+static int	encrypt_handoff_import(void);
+static void	encrypt_burst_process(void **, size_t);
+static int	encrypt_packet_check(struct signsky_packet *);
+static void	encrypt_packet_prepare(struct signsky_sa *,
+		    struct signsky_packet *, struct signsky_cipher_op *,
+		    u_int64_t);
 
 /* The shared queues. */
 static struct signsky_proc_io	*io = NULL;
 
-/* The local state for TX. */
-static struct signsky_sa	state;
+/* The id of this worker, used to find its TX key slots. */
+static u_int16_t		worker = 0;
+
+/* The keying generation we last looked at our key slots for. */
+static u_int32_t		keygen = 0;
+
+/* The local state for TX, per peer. */
+static struct signsky_sa	state[SIGNSKY_PEERS_MAX];
+
+/* Our handoff slot while our successor sets itself up, or NULL. */
+static struct signsky_handoff	*handing = NULL;
 
 /*
  * The process responsible for encryption of packets coming
@@ -40,23 +56,33 @@ static struct signsky_sa	state;
 void
 signsky_encrypt_entry(struct signsky_proc *proc)
 {
-	struct signsky_packet	*pkt;
+	size_t			count;
+	u_int64_t		idle;
+	u_int16_t		peer;
 	int			sig, running;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	PRECOND(proc != NULL);
 	PRECOND(proc->arg != NULL);
 
 	io = proc->arg;
+	worker = proc->id;
+
 	encrypt_drop_access();
 
 	signsky_signal_trap(SIGQUIT);
+	signsky_signal_trap(SIGUSR1);
 	signsky_signal_ignore(SIGINT);
 
 	memset(&state, 0, sizeof(state));
 
+	idle = 0;
 	running = 1;
 	signsky_proc_privsep(proc);
 
+	if (encrypt_handoff_import() == -1)
+		running = 0;
+
 	while (running) {
 		if ((sig = signsky_last_signal()) != -1) {
 			syslog(LOG_NOTICE, "received signal %d", sig);
@@ -64,23 +90,53 @@ signsky_encrypt_entry(struct signsky_proc *proc)
 			case SIGQUIT:
 				running = 0;
 				continue;
+			case SIGUSR1:
+				if (handing == NULL &&
+				    encrypt_handoff_export() == -1) {
+					running = 0;
+					continue;
+				}
+				break;
 			}
 		}
 
-		if (signsky_key_install(io->tx, &state) != -1) {
-			signsky_atomic_write(&signsky->tx.spi, state.spi);
-			syslog(LOG_NOTICE, "new TX SA (spi=0x%08x)",
-			    state.spi);
+		if (handing != NULL && signsky_handoff_asked(handing)) {
+			signsky_handoff_release(handing);
+			running = 0;
+			continue;
 		}
 
-		while ((pkt = signsky_ring_dequeue(io->encrypt)))
-			encrypt_packet_process(pkt);
+		/* Keys that become pending now are for our successor. */
+		if (handing == NULL)
+			encrypt_keys_install();
+
+		while ((count = signsky_ring_dequeue_burst(io->encrypt,
+		    pkts, SIGNSKY_PACKETS_PER_EVENT)) > 0) {
+			encrypt_burst_process(pkts, count);
+			idle = 0;
 
-#if !defined(SIGNSKY_HIGH_PERFORMANCE)
-		usleep(500);
-#endif
+			if (handing != NULL) {
+				if (signsky_handoff_asked(handing))
+					break;
+			} else {
+				encrypt_keys_install();
+			}
+
+			if (signsky_signal_pending() != -1)
+				break;
+		}
+
+		/* Never park while our successor may ask us to stop. */
+		if (handing != NULL)
+			signsky_cpu_pause();
+		else
+			signsky_ring_idle(io->encrypt, -1, &idle);
 	}
 
+	for (peer = 0; peer < signsky->npeers; peer++)
+		signsky_sa_clear(&state[peer]);
+
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -93,57 +149,234 @@ static void
 encrypt_drop_access(void)
 {
 	signsky_shm_detach(io->rx);
+	signsky_shm_detach(io->spi);
 	signsky_shm_detach(io->arwin);
 	signsky_shm_detach(io->clear);
 	signsky_shm_detach(io->decrypt);
+	signsky_shm_detach(io->handoff_rx);
 
 	io->rx = NULL;
+	io->spi = NULL;
 	io->arwin = NULL;
 	io->clear = NULL;
 	io->decrypt = NULL;
+	io->handoff_rx = NULL;
 }
 
 /*
- * Encrypt a single packet under the current TX key.
+ * Install any pending TX keys, for all peers.
+ *
+ * This is only called in between bursts and only walks the key slots
+ * if keying made new keys pending since the last time we looked.
  */
 static void
-encrypt_packet_process(struct signsky_packet *pkt)
+encrypt_keys_install(void)
 {
-	struct signsky_ipsec_hdr	*hdr;
-	struct signsky_ipsec_tail	*tail;
-	size_t				overhead;
-	u_int8_t			nonce[12], aad[12];
+	u_int32_t		gen;
+	u_int16_t		peer;
+	struct signsky_key	*key;
 
-	PRECOND(pkt != NULL);
-	PRECOND(pkt->target == SIGNSKY_PROC_ENCRYPT);
+	if ((gen = signsky_atomic_read(&signsky->keygen)) == keygen)
+		return;
+
+	keygen = gen;
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		key = SIGNSKY_KEY_SLOT(io->tx,
+		    SIGNSKY_PROC_ENCRYPT, peer, worker);
 
-	/* Install any pending TX key first. */
-	if (signsky_key_install(io->tx, &state) != -1) {
-		signsky_atomic_write(&signsky->tx.spi, state.spi);
-		syslog(LOG_NOTICE, "new TX SA (spi=0x%08x)", state.spi);
+		if (signsky_key_install(key, &state[peer]) == -1)
+			continue;
+
+		signsky_atomic_write(&signsky->peers[peer].tx_spi,
+		    state[peer].spi);
+		syslog(LOG_NOTICE, "new TX SA (peer=%u, spi=0x%08x)",
+		    peer, state[peer].spi);
 	}
+}
 
-	/* If we don't have a cipher state, we shall not submit. */
-	if (state.cipher == NULL) {
-		signsky_packet_release(pkt);
+/*
+ * Hand our TX SAs to the worker that takes over from us on a warm
+ * restart. We keep encrypting with them until it set itself up and
+ * asks us to stop, the sequence numbers are shared.
+ *
+ * Returns -1 if the handoff was not expected and we should stop.
+ */
+static int
+encrypt_handoff_export(void)
+{
+	u_int16_t		peer;
+	struct signsky_handoff	*slot;
+
+	slot = SIGNSKY_HANDOFF_SLOT(io, SIGNSKY_PROC_ENCRYPT, worker);
+
+	for (peer = 0; peer < signsky->npeers; peer++)
+		signsky_sa_export(&state[peer], &slot->sa[peer][0]);
+
+	if (signsky_handoff_ready(slot) == -1)
+		return (-1);
+
+	handing = slot;
+	syslog(LOG_NOTICE, "handed over TX SAs");
+
+	return (0);
+}
+
+/*
+ * Take over the TX SAs of our predecessor if we were started for a
+ * warm restart, before we touch any of the rings.
+ *
+ * Returns -1 if we were told to quit while waiting for it.
+ */
+static int
+encrypt_handoff_import(void)
+{
+	u_int16_t		peer;
+	struct signsky_handoff	*slot;
+
+	slot = SIGNSKY_HANDOFF_SLOT(io, SIGNSKY_PROC_ENCRYPT, worker);
+
+	if (signsky_handoff_wait(slot) == -1)
+		return (0);
+
+	for (peer = 0; peer < signsky->npeers; peer++)
+		signsky_sa_import(&slot->sa[peer][0], &state[peer]);
+
+	if (signsky_handoff_takeover(slot) == -1)
+		return (-1);
+
+	syslog(LOG_NOTICE, "took over TX SAs");
+
+	return (0);
+}
+
+/*
+ * Encrypt a burst of packets and ship all of them that were
+ * successfully encrypted to the crypto side in a single burst.
+ *
+ * Consecutive packets for the same peer get their packet numbers from
+ * a single update of that peer its sequence number and are handed to
+ * the cipher as a single batch.
+ */
+static void
+encrypt_burst_process(void **pkts, size_t count)
+{
+	u_int64_t			pn;
+	struct signsky_sa		*sa;
+	u_int32_t			peer;
+	struct signsky_packet		*pkt;
+	size_t				idx, ready, queued, run, off;
+	struct signsky_cipher_op	ops[SIGNSKY_PACKETS_PER_EVENT];
+
+	PRECOND(pkts != NULL);
+	PRECOND(count <= SIGNSKY_PACKETS_PER_EVENT);
+
+	ready = 0;
+
+	for (idx = 0; idx < count; idx++) {
+		if (encrypt_packet_check(pkts[idx]) != -1)
+			pkts[ready++] = pkts[idx];
+	}
+
+	if (ready == 0)
 		return;
+
+	for (idx = 0; idx < ready; idx += run) {
+		pkt = pkts[idx];
+		peer = pkt->peer;
+		sa = &state[peer];
+
+		for (run = 1; idx + run < ready; run++) {
+			pkt = pkts[idx + run];
+			if (pkt->peer != peer)
+				break;
+		}
+
+		pn = signsky_atomic_add(&io->seqnr[peer].next, run);
+
+		for (off = 0; off < run; off++) {
+			encrypt_packet_prepare(sa, pkts[idx + off],
+			    &ops[idx + off], pn + off);
+		}
+
+		/* Do the cipher dance. */
+		signsky_cipher_encrypt_batch(sa->cipher, &ops[idx], run);
 	}
 
+	for (idx = 0; idx < ready; idx++) {
+		/* Account for the header. */
+		VERIFY(ops[idx].pkt->length +
+		    sizeof(struct signsky_ipsec_hdr) <
+		    ops[idx].pkt->size);
+
+		ops[idx].pkt->length += sizeof(struct signsky_ipsec_hdr);
+		ops[idx].pkt->target = SIGNSKY_PROC_CRYPTO;
+	}
+
+	queued = signsky_ring_queue_burst(io->crypto, pkts, ready);
+	signsky_stat_add(ring_full, ready - queued);
+
+	for (idx = queued; idx < ready; idx++)
+		signsky_packet_release(pkts[idx]);
+}
+
+/*
+ * Check if a packet can be encrypted, it must be routed to a peer for
+ * which we have a TX key. If it cannot it is released and -1 is returned.
+ */
+static int
+encrypt_packet_check(struct signsky_packet *pkt)
+{
+	size_t		overhead;
+
+	PRECOND(pkt != NULL);
+	PRECOND(pkt->target == SIGNSKY_PROC_ENCRYPT);
+
+	if (signsky_packet_peer(pkt) == -1)
+		goto drop;
+
+	/* If we don't have a cipher state, we shall not submit. */
+	if (state[pkt->peer].cipher == NULL)
+		goto drop;
+
 	/* Belts and suspenders. */
-	overhead = sizeof(*hdr) + sizeof(*tail) + signsky_cipher_overhead();
+	overhead = sizeof(struct signsky_ipsec_hdr) +
+	    sizeof(struct signsky_ipsec_tail) + signsky_cipher_overhead();
 
 	if ((pkt->length + overhead < pkt->length) ||
-	    (pkt->length + overhead > sizeof(pkt->buf))) {
-		signsky_packet_release(pkt);
-		return;
-	}
+	    (pkt->length + overhead > pkt->size))
+		goto drop;
+
+	return (0);
+
+drop:
+	signsky_stat_add(invalid, 1);
+	signsky_packet_release(pkt);
+
+	return (-1);
+}
+
+/*
+ * Fill in the ESP header and trailer for the given packet using
+ * packet number pn under the given SA, and prepare its cipher operation.
+ */
+static void
+encrypt_packet_prepare(struct signsky_sa *sa, struct signsky_packet *pkt,
+    struct signsky_cipher_op *op, u_int64_t pn)
+{
+	struct signsky_ipsec_hdr	*hdr;
+	struct signsky_ipsec_tail	*tail;
+
+	PRECOND(sa != NULL);
+	PRECOND(pkt != NULL);
+	PRECOND(op != NULL);
 
 	/* Fill in ESP header and t(r)ail. */
 	hdr = signsky_packet_head(pkt);
 	tail = signsky_packet_tail(pkt);
 
-	hdr->pn = state.seqnr++;
-	hdr->esp.spi = htobe32(state.spi);
+	hdr->pn = pn;
+	hdr->esp.spi = htobe32(sa->spi);
 	hdr->esp.seq = htobe32(hdr->pn & 0xffffffff);
 
 	/* We don't pad, RFC says its a SHOULD not a MUST. */
@@ -154,25 +387,13 @@ encrypt_packet_process(struct signsky_packet *pkt)
 	pkt->length += sizeof(*tail);
 
 	/* Prepare the nonce and aad. */
-	memcpy(nonce, &state.salt, sizeof(state.salt));
-	memcpy(&nonce[sizeof(state.salt)], &hdr->pn, sizeof(hdr->pn));
-
-	memcpy(aad, &state.spi, sizeof(state.spi));
-	memcpy(&aad[sizeof(state.spi)], &hdr->pn, sizeof(hdr->pn));
-
-	hdr->pn = htobe64(hdr->pn);
-
-	/* Do the cipher dance. */
-	signsky_cipher_encrypt(state.cipher, nonce, sizeof(nonce),
-	    aad, sizeof(aad), pkt);
+	op->pkt = pkt;
 
-	/* Account for the header. */
-	VERIFY(pkt->length + sizeof(*hdr) < sizeof(pkt->buf));
+	memcpy(op->nonce, &sa->salt, sizeof(sa->salt));
+	memcpy(&op->nonce[sizeof(sa->salt)], &hdr->pn, sizeof(hdr->pn));
 
-	pkt->length += sizeof(*hdr);
-	pkt->target = SIGNSKY_PROC_CRYPTO;
+	memcpy(op->aad, &sa->spi, sizeof(sa->spi));
+	memcpy(&op->aad[sizeof(sa->spi)], &hdr->pn, sizeof(hdr->pn));
 
-	/* Ship it. */
-	if (signsky_ring_queue(io->crypto, pkt) == -1)
-		signsky_packet_release(pkt);
+	hdr->pn = htobe64(hdr->pn);
 }
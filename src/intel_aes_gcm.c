@@ -61,6 +61,15 @@ signsky_cipher_setup(struct signsky_key *key)
 	return (cipher);
 }
 
+/*
+ * This implementation only does AES-256-GCM.
+ */
+int
+signsky_cipher_supports(u_int32_t suite)
+{
+	return (suite == SIGNSKY_CIPHER_AES_256_GCM);
+}
+
 /*
  * Returns the overhead for AES-GCM. In this case it's the
  * 16 byte tag.
@@ -88,7 +97,7 @@ signsky_cipher_encrypt(void *arg, const void *nonce, size_t nonce_len,
 	PRECOND(aad != NULL);
 	PRECOND(pkt != NULL);
 
-	VERIFY(pkt->length + CIPHER_AES_GCM_TAG_SIZE < sizeof(pkt->buf));
+	VERIFY(pkt->length + CIPHER_AES_GCM_TAG_SIZE < pkt->size);
 
 	cipher = arg;
 	nptr.cp = nonce;
@@ -138,6 +147,48 @@ signsky_cipher_decrypt(void *arg, const void *nonce, size_t nonce_len,
 	return (0);
 }
 
+/*
+ * Encrypt a batch of packets under the same key.
+ * ISA-L has no multi-buffer AES-GCM, its aes_gcm_enc_256() already picks
+ * the widest (VAES) implementation the CPU has at runtime. We run the
+ * batch back to back over the expanded key which stays hot in cache.
+ */
+void
+signsky_cipher_encrypt_batch(void *arg, struct signsky_cipher_op *ops,
+    size_t count)
+{
+	size_t		idx;
+
+	PRECOND(arg != NULL);
+	PRECOND(ops != NULL);
+
+	for (idx = 0; idx < count; idx++) {
+		signsky_cipher_encrypt(arg, ops[idx].nonce,
+		    sizeof(ops[idx].nonce), ops[idx].aad,
+		    sizeof(ops[idx].aad), ops[idx].pkt);
+	}
+}
+
+/*
+ * Decrypt and verify a batch of packets under the same key, the
+ * result for each packet is stored in its op.
+ */
+void
+signsky_cipher_decrypt_batch(void *arg, struct signsky_cipher_op *ops,
+    size_t count)
+{
+	size_t		idx;
+
+	PRECOND(arg != NULL);
+	PRECOND(ops != NULL);
+
+	for (idx = 0; idx < count; idx++) {
+		ops[idx].ret = signsky_cipher_decrypt(arg, ops[idx].nonce,
+		    sizeof(ops[idx].nonce), ops[idx].aad,
+		    sizeof(ops[idx].aad), ops[idx].pkt);
+	}
+}
+
 /*
  * Cleanup the cipher states.
  */
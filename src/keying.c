@@ -31,20 +31,34 @@
 
 /*
  * How a request over the UNIX socket must look like.
+ *
+ * The peer id was added later and may be omitted, in which case
+ * the request is for peer 0.
  */
 struct request {
 	u_int32_t	tx_spi;
 	u_int32_t	rx_spi;
 	u_int8_t	ss[SIGNSKY_KEY_LENGTH];
+	u_int16_t	peer;
 } __attribute__((packed));
 
+/*
+ * The number of RX SPIs we remember per peer, at most the newest one,
+ * the one before it and the one decrypt has active are ever in use.
+ */
+#define KEYING_RX_SPI_MAX	4
+
 static void	keying_drop_access(void);
 static void	keying_handle_request(int);
+static int	keying_spi_track(u_int16_t, u_int32_t);
 static void	keying_install(struct signsky_key *, u_int32_t, void *, size_t);
 
 /* The local queues. */
 static struct signsky_proc_io	*io = NULL;
 
+/* The RX SPIs we added to the SPI table per peer, newest first. */
+static u_int32_t		rxspi[SIGNSKY_PEERS_MAX][KEYING_RX_SPI_MAX];
+
 /*
  * The keying process.
  *
@@ -96,6 +110,7 @@ signsky_keying_entry(struct signsky_proc *proc)
 			keying_handle_request(pfd.fd);
 	}
 
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -108,16 +123,22 @@ static void
 keying_drop_access(void)
 {
 	signsky_shm_detach(io->arwin);
+	signsky_shm_detach(io->seqnr);
 	signsky_shm_detach(io->clear);
 	signsky_shm_detach(io->crypto);
 	signsky_shm_detach(io->encrypt);
 	signsky_shm_detach(io->decrypt);
+	signsky_shm_detach(io->handoff_tx);
+	signsky_shm_detach(io->handoff_rx);
 
 	io->clear = NULL;
 	io->arwin = NULL;
+	io->seqnr = NULL;
 	io->crypto = NULL;
 	io->encrypt = NULL;
 	io->decrypt = NULL;
+	io->handoff_tx = NULL;
+	io->handoff_rx = NULL;
 }
 
 /*
@@ -128,6 +149,7 @@ keying_handle_request(int fd)
 {
 	ssize_t			ret;
 	struct request		req;
+	u_int16_t		idx, encrypt, decrypt;
 	struct sockaddr_un	peer;
 	socklen_t		socklen;
 
@@ -146,16 +168,95 @@ keying_handle_request(int fd)
 		if (ret == 0)
 			fatal("eof on keying socket");
 
-		if ((size_t)ret != sizeof(req))
+		if ((size_t)ret == sizeof(req) - sizeof(req.peer))
+			req.peer = 0;
+		else if ((size_t)ret != sizeof(req))
 			break;
 
-		/* XXX - RX/TX derivation. */
-		keying_install(io->tx, req.tx_spi, req.ss, sizeof(req.ss));
-		keying_install(io->rx, req.rx_spi, req.ss, sizeof(req.ss));
+		if (req.peer >= signsky->npeers) {
+			syslog(LOG_NOTICE, "key for unknown peer %u", req.peer);
+			break;
+		}
+
+		if (req.tx_spi == 0 || req.rx_spi == 0) {
+			syslog(LOG_NOTICE, "key with an spi of 0 for peer %u",
+			    req.peer);
+			break;
+		}
+
+		if (keying_spi_track(req.peer, req.rx_spi) == -1)
+			break;
+
+		/*
+		 * XXX - RX/TX derivation.
+		 *
+		 * Each encrypt and decrypt worker has its own key slot
+		 * per peer and gets its own copy of the keys.
+		 */
+		encrypt = signsky->workers[SIGNSKY_PROC_ENCRYPT];
+		decrypt = signsky->workers[SIGNSKY_PROC_DECRYPT];
+
+		for (idx = 0; idx < encrypt; idx++) {
+			keying_install(SIGNSKY_KEY_SLOT(io->tx,
+			    SIGNSKY_PROC_ENCRYPT, req.peer, idx),
+			    req.tx_spi, req.ss, sizeof(req.ss));
+		}
+
+		for (idx = 0; idx < decrypt; idx++) {
+			keying_install(SIGNSKY_KEY_SLOT(io->rx,
+			    SIGNSKY_PROC_DECRYPT, req.peer, idx),
+			    req.rx_spi, req.ss, sizeof(req.ss));
+		}
+
+		signsky_atomic_add(&signsky->keygen, 1);
 		break;
 	}
 }
 
+/*
+ * Add the RX SPI for the given peer to the SPI table, so the crypto
+ * process accepts packets for it, and remove the ones for this peer
+ * that are no longer in use by any decrypt worker.
+ */
+static int
+keying_spi_track(u_int16_t peer, u_int32_t spi)
+{
+	u_int32_t	active, owner, old, keep[KEYING_RX_SPI_MAX];
+	int		idx, n;
+
+	PRECOND(peer < signsky->npeers);
+	PRECOND(spi != 0);
+
+	if (signsky_spi_lookup(io->spi, spi, &owner) != -1 && owner != peer) {
+		syslog(LOG_NOTICE, "spi 0x%08x for peer %u in use by peer %u",
+		    spi, peer, owner);
+		return (-1);
+	}
+
+	signsky_spi_insert(io->spi, spi, peer);
+
+	active = signsky_atomic_read(&signsky->peers[peer].rx_spi);
+
+	n = 0;
+	keep[n++] = spi;
+
+	for (idx = 0; idx < KEYING_RX_SPI_MAX; idx++) {
+		old = rxspi[peer][idx];
+		if (old == 0 || old == spi)
+			continue;
+
+		if (n == 1 || old == active)
+			keep[n++] = old;
+		else
+			signsky_spi_remove(io->spi, old);
+	}
+
+	for (idx = 0; idx < KEYING_RX_SPI_MAX; idx++)
+		rxspi[peer][idx] = idx < n ? keep[idx] : 0;
+
+	return (0);
+}
+
 /*
  * Install the given key into shared memory so that RX/TX can pick these up.
  */
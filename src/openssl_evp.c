@@ -0,0 +1,281 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * AES-GCM and ChaCha20-Poly1305 support via the OpenSSL EVP interface.
+ *
+ * Unlike the low-level CRYPTO_gcm128 interface this lets libcrypto
+ * pick its stitched AES-NI/PCLMUL or ARMv8 crypto extension GCM
+ * implementations, or its NEON/AVX2 ChaCha20-Poly1305 ones.
+ *
+ * Which of the two is used is decided by the cipher configuration
+ * option. Both use a 12 byte nonce (salt + packet number, RFC 7634)
+ * and a 16 byte tag.
+ *
+ * Each SA gets its own EVP_CIPHER_CTX which is initialised with
+ * the key once in signsky_cipher_setup(), so that for each packet
+ * we only have to set the IV.
+ */
+
+#include <sys/types.h>
+
+#include <openssl/evp.h>
+
+#include <stdio.h>
+
+#include "signsky.h"
+
+#define CIPHER_EVP_TAG_SIZE		16
+#define CIPHER_EVP_IV_SIZE		12
+
+/*
+ * The local cipher state.
+ */
+struct cipher_evp {
+	EVP_CIPHER_CTX		*enc;
+	EVP_CIPHER_CTX		*dec;
+};
+
+static EVP_CIPHER_CTX	*cipher_evp_context(struct signsky_key *, int);
+
+/*
+ * Setup the cipher by creating an encryption and a decryption context
+ * that are both initialised with the given key.
+ */
+void *
+signsky_cipher_setup(struct signsky_key *key)
+{
+	struct cipher_evp	*cipher;
+
+	PRECOND(key != NULL);
+
+	if ((cipher = calloc(1, sizeof(*cipher))) == NULL)
+		fatal("failed to allocate cipher context");
+
+	cipher->enc = cipher_evp_context(key, 1);
+	cipher->dec = cipher_evp_context(key, 0);
+
+	return (cipher);
+}
+
+/*
+ * We support both AES-256-GCM and ChaCha20-Poly1305.
+ */
+int
+signsky_cipher_supports(u_int32_t suite)
+{
+	return (suite == SIGNSKY_CIPHER_AES_256_GCM ||
+	    suite == SIGNSKY_CIPHER_CHACHA20_POLY1305);
+}
+
+/*
+ * Returns the overhead for both AEADs, the 16 byte tag.
+ */
+size_t
+signsky_cipher_overhead(void)
+{
+	return (CIPHER_EVP_TAG_SIZE);
+}
+
+/*
+ * Encrypt the packet data.
+ * Automatically adds the integrity tag at the end of the ciphertext.
+ */
+void
+signsky_cipher_encrypt(void *arg, const void *nonce, size_t nonce_len,
+    const void *aad, size_t aad_len, struct signsky_packet *pkt)
+{
+	int			len;
+	struct cipher_evp	*cipher;
+	u_int8_t		*data, *tag;
+
+	PRECOND(arg != NULL);
+	PRECOND(nonce != NULL);
+	PRECOND(nonce_len == CIPHER_EVP_IV_SIZE);
+	PRECOND(aad != NULL);
+	PRECOND(pkt != NULL);
+
+	VERIFY(pkt->length + CIPHER_EVP_TAG_SIZE < pkt->size);
+
+	cipher = arg;
+
+	data = signsky_packet_data(pkt);
+	tag = data + pkt->length;
+
+	if (!EVP_EncryptInit_ex(cipher->enc, NULL, NULL, NULL, nonce))
+		fatal("EVP_EncryptInit_ex failed");
+
+	if (!EVP_EncryptUpdate(cipher->enc, NULL, &len, aad, aad_len))
+		fatal("EVP_EncryptUpdate (aad) failed");
+
+	if (!EVP_EncryptUpdate(cipher->enc, data, &len, data, pkt->length))
+		fatal("EVP_EncryptUpdate failed");
+
+	if (!EVP_EncryptFinal_ex(cipher->enc, data + len, &len))
+		fatal("EVP_EncryptFinal_ex failed");
+
+	if (!EVP_CIPHER_CTX_ctrl(cipher->enc, EVP_CTRL_AEAD_GET_TAG,
+	    CIPHER_EVP_TAG_SIZE, tag))
+		fatal("EVP_CTRL_AEAD_GET_TAG failed");
+
+	pkt->length += CIPHER_EVP_TAG_SIZE;
+}
+
+/*
+ * Decrypt and verify a packet.
+ */
+int
+signsky_cipher_decrypt(void *arg, const void *nonce, size_t nonce_len,
+    const void *aad, size_t aad_len, struct signsky_packet *pkt)
+{
+	int			len;
+	size_t			ctlen;
+	struct cipher_evp	*cipher;
+	u_int8_t		*data, *tag;
+
+	PRECOND(arg != NULL);
+	PRECOND(nonce != NULL);
+	PRECOND(nonce_len == CIPHER_EVP_IV_SIZE);
+	PRECOND(aad != NULL);
+	PRECOND(pkt != NULL);
+
+	if (pkt->length < CIPHER_EVP_TAG_SIZE)
+		return (-1);
+
+	cipher = arg;
+
+	data = signsky_packet_data(pkt);
+	tag = &pkt->buf[pkt->length - CIPHER_EVP_TAG_SIZE];
+	ctlen = tag - data;
+
+	if (!EVP_DecryptInit_ex(cipher->dec, NULL, NULL, NULL, nonce))
+		fatal("EVP_DecryptInit_ex failed");
+
+	if (!EVP_CIPHER_CTX_ctrl(cipher->dec, EVP_CTRL_AEAD_SET_TAG,
+	    CIPHER_EVP_TAG_SIZE, tag))
+		fatal("EVP_CTRL_AEAD_SET_TAG failed");
+
+	if (!EVP_DecryptUpdate(cipher->dec, NULL, &len, aad, aad_len))
+		fatal("EVP_DecryptUpdate (aad) failed");
+
+	if (!EVP_DecryptUpdate(cipher->dec, data, &len, data, ctlen))
+		fatal("EVP_DecryptUpdate failed");
+
+	if (EVP_DecryptFinal_ex(cipher->dec, data + len, &len) <= 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Encrypt a batch of packets under the same key.
+ * The EVP context is already set up with the key so this only
+ * sets a new IV for each packet in turn.
+ */
+void
+signsky_cipher_encrypt_batch(void *arg, struct signsky_cipher_op *ops,
+    size_t count)
+{
+	size_t		idx;
+
+	PRECOND(arg != NULL);
+	PRECOND(ops != NULL);
+
+	for (idx = 0; idx < count; idx++) {
+		signsky_cipher_encrypt(arg, ops[idx].nonce,
+		    sizeof(ops[idx].nonce), ops[idx].aad,
+		    sizeof(ops[idx].aad), ops[idx].pkt);
+	}
+}
+
+/*
+ * Decrypt and verify a batch of packets under the same key, the
+ * result for each packet is stored in its op.
+ */
+void
+signsky_cipher_decrypt_batch(void *arg, struct signsky_cipher_op *ops,
+    size_t count)
+{
+	size_t		idx;
+
+	PRECOND(arg != NULL);
+	PRECOND(ops != NULL);
+
+	for (idx = 0; idx < count; idx++) {
+		ops[idx].ret = signsky_cipher_decrypt(arg, ops[idx].nonce,
+		    sizeof(ops[idx].nonce), ops[idx].aad,
+		    sizeof(ops[idx].aad), ops[idx].pkt);
+	}
+}
+
+/*
+ * Cleanup the cipher states.
+ */
+void
+signsky_cipher_cleanup(void *arg)
+{
+	struct cipher_evp	*cipher;
+
+	PRECOND(arg != NULL);
+
+	cipher = arg;
+
+	EVP_CIPHER_CTX_free(cipher->enc);
+	EVP_CIPHER_CTX_free(cipher->dec);
+
+	free(cipher);
+}
+
+/*
+ * Create a new EVP context for the configured cipher suite in the
+ * given direction, initialised with the given key. The IV is set
+ * per packet.
+ */
+static EVP_CIPHER_CTX *
+cipher_evp_context(struct signsky_key *key, int enc)
+{
+	EVP_CIPHER_CTX		*ctx;
+	const EVP_CIPHER	*type;
+
+	PRECOND(key != NULL);
+	PRECOND(enc == 0 || enc == 1);
+
+	switch (signsky->cipher) {
+	case SIGNSKY_CIPHER_AES_256_GCM:
+		type = EVP_aes_256_gcm();
+		break;
+	case SIGNSKY_CIPHER_CHACHA20_POLY1305:
+		type = EVP_chacha20_poly1305();
+		break;
+	default:
+		fatal("%s: unknown cipher %u", __func__, signsky->cipher);
+	}
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		fatal("EVP_CIPHER_CTX_new failed");
+
+	if (!EVP_CipherInit_ex(ctx, type, NULL, NULL, NULL, enc))
+		fatal("EVP_CipherInit_ex failed");
+
+	if (!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN,
+	    CIPHER_EVP_IV_SIZE, NULL))
+		fatal("EVP_CTRL_AEAD_SET_IVLEN failed");
+
+	if (!EVP_CipherInit_ex(ctx, NULL, NULL, key->key, NULL, enc))
+		fatal("EVP_CipherInit_ex failed");
+
+	return (ctx);
+}
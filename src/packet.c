@@ -20,56 +20,260 @@
 
 #include "signsky.h"
 
+static void	packet_cache_account(void);
+
 /*
- * Shared pool of packets that are to be processed.
+ * Shared pools of packets that are to be processed, one per class.
  *
  * The clear and crypto io processes will for each received packet grab
- * one from the pool and hand them over to either the encryption or decryption
+ * one from a pool and hand them over to either the encryption or decryption
  * processes who in turn hand them over to the crypto or clear io processes.
  */
-struct signsky_pool	*pktpool;
+static struct signsky_pool	*pktpool[SIGNSKY_PACKET_CLASS_MAX];
+
+/*
+ * The process local caches in front of each packet pool, this keeps
+ * most gets and releases away from the shared freelist.
+ */
+static struct signsky_pool_cache	pktcache[SIGNSKY_PACKET_CLASS_MAX];
+
+/* The buffer size of each packet class. */
+static const size_t		pktsize[SIGNSKY_PACKET_CLASS_MAX] = {
+	SIGNSKY_PACKET_SMALL_DATA_LEN + 64,
+	SIGNSKY_PACKET_MAX_LEN,
+};
+
+/*
+ * The packet data length this process expects to read from its
+ * interface, signsky_packet_get() picks the class from it. Once a
+ * read did not fit the packet it got it stays at the largest length.
+ */
+static size_t			pktread = SIGNSKY_PACKET_DATA_LEN;
+static int			pktread_grown = 0;
 
 /*
- * Setup the packet pool, the 1024 could maybe be tuneable.
+ * The scratch packet, used by the io processes to drain an interface
+ * when the pools are empty. Each process has its own copy.
+ */
+static u_int8_t			scratch[sizeof(struct signsky_packet) +
+				    SIGNSKY_PACKET_MAX_LEN]
+				    __attribute__((aligned(16)));
+
+/*
+ * Setup the packet pools, each sized according to the configuration,
+ * and the local caches in front of them that every process inherits.
+ *
+ * If the small class would not be smaller than the large class (the
+ * normal build) it is not created and all packets come from the
+ * large pool.
  */
 void
 signsky_packet_init(void)
 {
-	pktpool = signsky_pool_init(1024, sizeof(struct signsky_packet));
+	int		class, type;
+	size_t		procs;
+
+	procs = 0;
+	for (type = SIGNSKY_PROC_CLEAR; type < SIGNSKY_PROC_MAX; type++)
+		procs += signsky->workers[type];
+
+	if (procs == 0)
+		procs = 1;
+
+	for (class = 0; class < SIGNSKY_PACKET_CLASS_MAX; class++) {
+		if (class != SIGNSKY_PACKET_CLASS_LARGE &&
+		    pktsize[class] >= pktsize[SIGNSKY_PACKET_CLASS_LARGE])
+			continue;
+
+		pktpool[class] = signsky_pool_init(signsky->pool[class],
+		    sizeof(struct signsky_packet) + pktsize[class]);
+
+		signsky_pool_cache_init(pktpool[class],
+		    &pktcache[class], procs);
+	}
 }
 
 /*
- * Obtain a new packet from the packet pool. If no packets are
- * available NULL is returned to the caller.
+ * Hand the packets in the local caches of this process back to the
+ * pools, called by every process before it exits.
+ */
+void
+signsky_packet_cache_flush(void)
+{
+	int		class;
+
+	for (class = 0; class < SIGNSKY_PACKET_CLASS_MAX; class++) {
+		if (pktpool[class] != NULL)
+			signsky_pool_cache_flush(pktpool[class],
+			    &pktcache[class]);
+	}
+
+	packet_cache_account();
+}
+
+/*
+ * Sample how many packets of each pool are in use, called periodically
+ * by overwatch. Packets sitting in the process local caches count as
+ * in use, they are not in the shared freelist.
+ */
+void
+signsky_packet_sample(void)
+{
+	int		class;
+	size_t		size;
+
+	for (class = 0; class < SIGNSKY_PACKET_CLASS_MAX; class++) {
+		if (pktpool[class] == NULL)
+			continue;
+
+		size = pktpool[class]->queue.elm;
+		signsky_ring_sample(&signsky->rings[SIGNSKY_RING_POOL_SMALL +
+		    class], size - signsky_ring_pending(&pktpool[class]->queue),
+		    size);
+	}
+}
+
+/*
+ * Set the packet data length the io process expects to read from its
+ * interface, as bound by the MTU of that interface. A length of 0
+ * means it is not known and the largest length is used.
+ */
+void
+signsky_packet_readlen(size_t len)
+{
+	if (pktread_grown)
+		return;
+
+	if (len == 0 || len > SIGNSKY_PACKET_DATA_LEN)
+		len = SIGNSKY_PACKET_DATA_LEN;
+
+	pktread = len;
+}
+
+/*
+ * Called by an io process when a read did not fit in the packet it
+ * got from signsky_packet_get(), from here on all reads get packets
+ * of the largest class.
+ */
+void
+signsky_packet_truncated(void)
+{
+	if (pktread_grown)
+		return;
+
+	syslog(LOG_NOTICE,
+	    "read larger than the expected %zu bytes, using large packets",
+	    pktread);
+
+	pktread = SIGNSKY_PACKET_DATA_LEN;
+	pktread_grown = 1;
+}
+
+/*
+ * Obtain a new packet to read into from the interface, it is taken
+ * from the smallest class that holds what we expect to read. If no
+ * packets are available NULL is returned to the caller.
+ *
+ * Readers must not read more than signsky_packet_room() bytes of
+ * packet data into it and must call signsky_packet_truncated() if
+ * a packet was larger than that.
  */
 struct signsky_packet *
 signsky_packet_get(void)
 {
+	return (signsky_packet_get_len(pktread));
+}
+
+/*
+ * Obtain a new packet that can hold at least len bytes of packet data
+ * from the smallest class that has one available. If no packets are
+ * available NULL is returned to the caller.
+ */
+struct signsky_packet *
+signsky_packet_get_len(size_t len)
+{
+	int			class;
 	struct signsky_packet	*pkt;
+#if !defined(SIGNSKY_HIGH_PERFORMANCE)
+	size_t			used;
+#endif
+
+	PRECOND(len <= SIGNSKY_PACKET_DATA_LEN);
+
+	pkt = NULL;
 
-	if ((pkt = signsky_pool_get(pktpool)) == NULL)
+	for (class = 0; class < SIGNSKY_PACKET_CLASS_MAX; class++) {
+		if (pktpool[class] == NULL ||
+		    pktsize[class] < SIGNSKY_PACKET_MAX_LEN -
+		    SIGNSKY_PACKET_DATA_LEN + len)
+			continue;
+
+		if ((pkt = signsky_pool_cache_get(pktpool[class],
+		    &pktcache[class])) != NULL)
+			break;
+	}
+
+	packet_cache_account();
+
+	if (pkt == NULL) {
+		signsky_stat_add(pool_empty, 1);
 		return (NULL);
+	}
 
 #if defined(SIGNSKY_HIGH_PERFORMANCE)
 	pkt->length = 0;
 	pkt->target = 0;
+	pkt->ether = 0;
 #else
-	signsky_mem_zero(pkt, sizeof(*pkt));
+	/*
+	 * Only clear what the previous user of the packet wrote into it,
+	 * its length plus the room for the ESP header, tail and the tag
+	 * which covers the length of the packet in any stage.
+	 */
+	used = pkt->length + (SIGNSKY_PACKET_MAX_LEN - SIGNSKY_PACKET_DATA_LEN);
+	if (used > pktsize[class])
+		used = pktsize[class];
+
+	signsky_mem_zero(pkt, sizeof(*pkt) + used);
 #endif
 
+	pkt->class = class;
+	pkt->size = pktsize[class];
+
 	return (pkt);
 }
 
 /*
- * Place a packet back into the packet pool, making it available again
- * for clear or crypto.
+ * Returns the scratch packet to the caller. The scratch packet may be
+ * read into but must never be queued or released.
+ */
+struct signsky_packet *
+signsky_packet_scratch(void)
+{
+	struct signsky_packet	*pkt;
+
+	pkt = (struct signsky_packet *)scratch;
+	pkt->class = SIGNSKY_PACKET_CLASS_MAX;
+	pkt->size = SIGNSKY_PACKET_MAX_LEN;
+
+	return (pkt);
+}
+
+/*
+ * Place a packet back into the packet pool it came from, making
+ * it available again for clear or crypto.
  */
 void
 signsky_packet_release(struct signsky_packet *pkt)
 {
 	PRECOND(pkt != NULL);
+	PRECOND(pkt->class < SIGNSKY_PACKET_CLASS_MAX);
+	PRECOND(pktpool[pkt->class] != NULL);
 
-	signsky_pool_put(pktpool, pkt);
+	signsky_pool_cache_put(pktpool[pkt->class],
+	    &pktcache[pkt->class], pkt);
+
+	packet_cache_account();
 }
 
 /*
@@ -94,6 +298,18 @@ signsky_packet_data(struct signsky_packet *pkt)
 	return (&pkt->buf[SIGNSKY_PACKET_HEAD_LEN]);
 }
 
+/*
+ * Returns how many bytes of packet data the given packet can hold.
+ */
+size_t
+signsky_packet_room(struct signsky_packet *pkt)
+{
+	PRECOND(pkt != NULL);
+	PRECOND(pkt->size >= SIGNSKY_PACKET_MAX_LEN - SIGNSKY_PACKET_DATA_LEN);
+
+	return (pkt->size - (SIGNSKY_PACKET_MAX_LEN - SIGNSKY_PACKET_DATA_LEN));
+}
+
 /*
  * Returns a pointer to the packet tail (immediately after the packet data).
  */
@@ -101,23 +317,102 @@ void *
 signsky_packet_tail(struct signsky_packet *pkt)
 {
 	PRECOND(pkt != NULL);
-	PRECOND(pkt->length <= SIGNSKY_PACKET_DATA_LEN);
+	PRECOND(SIGNSKY_PACKET_HEAD_LEN + pkt->length <= pkt->size);
 
 	return (&pkt->buf[SIGNSKY_PACKET_HEAD_LEN + pkt->length]);
 }
 
+/*
+ * Find the peer the given packet must be sent to based on its inner
+ * IPv4 destination, the longest matching route wins. Anything that
+ * isn't IPv4 can only be sent if there is a single peer.
+ */
+int
+signsky_packet_peer(struct signsky_packet *pkt)
+{
+	struct signsky_peer	*peer;
+	struct signsky_route	*route;
+	int			match;
+	u_int8_t		*data;
+	u_int16_t		idx, ridx;
+	u_int32_t		dst, mask;
+
+	PRECOND(pkt != NULL);
+
+	data = signsky_packet_data(pkt);
+
+	if (pkt->length < 20 || (data[0] >> 4) != 4) {
+		if (signsky->npeers != 1)
+			return (-1);
+		pkt->peer = 0;
+		return (0);
+	}
+
+	memcpy(&dst, &data[16], sizeof(dst));
+
+	mask = 0;
+	match = -1;
+
+	for (idx = 0; idx < signsky->npeers; idx++) {
+		peer = &signsky->peers[idx];
+
+		for (ridx = 0; ridx < peer->nroutes; ridx++) {
+			route = &peer->routes[ridx];
+
+			if ((dst & route->mask) != route->net)
+				continue;
+
+			if (match == -1 || ntohl(route->mask) > ntohl(mask)) {
+				match = idx;
+				mask = route->mask;
+			}
+		}
+	}
+
+	if (match == -1)
+		return (-1);
+
+	pkt->peer = match;
+
+	return (0);
+}
+
 /*
  * Check if the given packet contains enough data to satisfy
- * an IPSec header, tail and cipher overhead.
+ * an IPSec header, tail and cipher overhead and if what remains
+ * fits on the clear interface.
  */
 int
 signsky_packet_crypto_checklen(struct signsky_packet *pkt)
 {
+	size_t		overhead;
+
 	PRECOND(pkt != NULL);
 
-	if (pkt->length < sizeof(struct signsky_ipsec_hdr) +
-	    sizeof(struct signsky_ipsec_tail) + signsky_cipher_overhead())
+	overhead = sizeof(struct signsky_ipsec_hdr) +
+	    sizeof(struct signsky_ipsec_tail) + signsky_cipher_overhead();
+
+	if (pkt->length < overhead ||
+	    pkt->length - overhead > SIGNSKY_PACKET_DATA_LEN)
 		return (-1);
 
 	return (0);
 }
+
+/*
+ * Publish how many packets sit in the local caches of this process,
+ * overwatch needs this if it ever has to kill us (the packets are
+ * lost with us then).
+ */
+static void
+packet_cache_account(void)
+{
+	int		class;
+	u_int64_t	cached;
+
+	cached = 0;
+	for (class = 0; class < SIGNSKY_PACKET_CLASS_MAX; class++)
+		cached += pktcache[class].count;
+
+	signsky_atomic_write_relaxed(&signsky_stats->cached, cached);
+}
@@ -86,6 +86,16 @@ signsky_platform_tundev_create(void)
 	return (fd);
 }
 
+/*
+ * We do not know the name of the utun device we got, so we do not
+ * know its MTU either.
+ */
+u_int32_t
+signsky_platform_tundev_mtu(void)
+{
+	return (0);
+}
+
 /*
  * Read a packet from the tunnel device. On MacOS this is prefixed
  * with the protocol (4 bytes), so split up the read into two
@@ -107,7 +117,7 @@ signsky_platform_tundev_read(int fd, struct signsky_packet *pkt)
 	iov[0].iov_base = &protocol;
 	iov[0].iov_len = sizeof(protocol);
 	iov[1].iov_base = data;
-	iov[1].iov_len = SIGNSKY_PACKET_DATA_LEN;
+	iov[1].iov_len = signsky_packet_room(pkt);
 
 	/*
 	 * We have to adjust the total data read with the protocol
@@ -147,3 +157,76 @@ signsky_platform_tundev_write(int fd, struct signsky_packet *pkt)
 
 	return (writev(fd, iov, 2));
 }
+
+/*
+ * Create a doorbell for a ring, on macOS this is a non-blocking pipe
+ * of which fds[0] is polled on and fds[1] is written to.
+ */
+void
+signsky_platform_doorbell_create(int *fds)
+{
+	int		idx, flags;
+
+	PRECOND(fds != NULL);
+
+	if (pipe(fds) == -1)
+		fatal("pipe: %s", errno_s);
+
+	for (idx = 0; idx < 2; idx++) {
+		if ((flags = fcntl(fds[idx], F_GETFL, 0)) == -1)
+			fatal("fcntl: %s", errno_s);
+
+		flags |= O_NONBLOCK;
+
+		if (fcntl(fds[idx], F_SETFL, flags) == -1)
+			fatal("fcntl: %s", errno_s);
+	}
+}
+
+/*
+ * Ring the doorbell, waking up anyone polling on it. If the pipe
+ * is full there is already a wakeup pending.
+ */
+void
+signsky_platform_doorbell_ring(int fd)
+{
+	u_int8_t	val;
+
+	PRECOND(fd >= 0);
+
+	val = 1;
+
+	for (;;) {
+		if (write(fd, &val, sizeof(val)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("%s: write: %s", __func__, errno_s);
+		}
+		break;
+	}
+}
+
+/* Drain the doorbell after having been woken up by it. */
+void
+signsky_platform_doorbell_drain(int fd)
+{
+	ssize_t		ret;
+	u_int8_t	buf[64];
+
+	PRECOND(fd >= 0);
+
+	for (;;) {
+		if ((ret = read(fd, buf, sizeof(buf))) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("%s: read: %s", __func__, errno_s);
+		}
+
+		if ((size_t)ret < sizeof(buf))
+			break;
+	}
+}
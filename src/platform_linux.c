@@ -15,22 +15,75 @@
  */
 
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/mempolicy.h>
+#include <linux/virtio_net.h>
 
 #include <fcntl.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "signsky.h"
 
+/* The largest super-packet the kernel can hand us in offload mode. */
+#define TUNDEV_OFFLOAD_MAX	65535
+
+/* UDP segmentation offload on tun devices, from Linux 6.2 onwards. */
+#if !defined(TUN_F_USO4)
+#define TUN_F_USO4		0x20
+#define TUN_F_USO6		0x40
+#endif
+
+#if !defined(VIRTIO_NET_HDR_GSO_UDP_L4)
+#define VIRTIO_NET_HDR_GSO_UDP_L4	5
+#endif
+
+static ssize_t	tundev_offload_segment(struct signsky_packet *,
+		    u_int8_t *, size_t, const struct virtio_net_hdr *,
+		    void **, size_t);
+static int	tundev_offload_csum(u_int8_t *, size_t,
+		    const struct virtio_net_hdr *);
+static u_int64_t	tundev_csum_add(u_int64_t, const void *, size_t);
+static u_int16_t	tundev_csum_fold(u_int64_t);
+
+/* Holds super-packets while they are being segmented. */
+static u_int8_t			tundev_super[TUNDEV_OFFLOAD_MAX];
+
+/* Temporary packet for when the packet pool is empty. */
+static struct signsky_packet	*tundev_tpkt = NULL;
+
+/* The socket we ask the MTU of the tunnel device on. */
+static int			tundev_mtufd = -1;
+
 /*
  * Linux tunnel device creation. The signsky.clr device is created and a
  * file descriptor for it is returned to the caller.
  *
+ * If there are multiple clear workers the device is created with
+ * IFF_MULTI_QUEUE and each worker calling this attaches its own queue,
+ * the kernel spreads flows across these queues.
+ *
+ * In offload mode the device is created with IFF_VNET_HDR and we tell
+ * the kernel it can hand us unchecksummed packets and TCP and UDP
+ * super-packets which we segment ourselves in
+ * signsky_platform_tundev_read_offload(). Kernels that do not know
+ * about UDP segmentation offload only get TCP offload enabled.
+ *
  * XXX - permissions on tunnel device.
  */
 int
@@ -50,9 +103,27 @@ signsky_platform_tundev_create(void)
 
 	ifr.ifr_flags = IFF_TUN | IFF_UP | IFF_NO_PI;
 
+	if (signsky->workers[SIGNSKY_PROC_CLEAR] > 1)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+
+	if (signsky->flags & SIGNSKY_FLAG_TUN_OFFLOAD)
+		ifr.ifr_flags |= IFF_VNET_HDR;
+
 	if (ioctl(fd, TUNSETIFF, &ifr) == -1)
 		fatal("ioctl: %s", errno_s);
 
+	if (signsky->flags & SIGNSKY_FLAG_TUN_OFFLOAD) {
+		flags = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+
+		if (ioctl(fd, TUNSETOFFLOAD,
+		    flags | TUN_F_USO4 | TUN_F_USO6) == -1) {
+			if (errno != EINVAL)
+				fatal("ioctl: %s", errno_s);
+			if (ioctl(fd, TUNSETOFFLOAD, flags) == -1)
+				fatal("ioctl: %s", errno_s);
+		}
+	}
+
 	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
 		fatal("fcntl: %s", errno_s);
 
@@ -61,10 +132,37 @@ signsky_platform_tundev_create(void)
 	if (fcntl(fd, F_SETFL, flags) == -1)
 		fatal("fcntl: %s", errno_s);
 
+	if ((tundev_mtufd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		fatal("socket: %s", errno_s);
+
+	tundev_tpkt = signsky_packet_scratch();
+
 	return (fd);
 }
 
-/* Read a single packet from the tunnel device. */
+/*
+ * Returns the MTU of the tunnel device, or 0 if we could not get it.
+ */
+u_int32_t
+signsky_platform_tundev_mtu(void)
+{
+	struct ifreq	ifr;
+
+	PRECOND(tundev_mtufd != -1);
+
+	memset(&ifr, 0, sizeof(ifr));
+	(void)snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "signsky.clr");
+
+	if (ioctl(tundev_mtufd, SIOCGIFMTU, &ifr) == -1 || ifr.ifr_mtu <= 0)
+		return (0);
+
+	return (ifr.ifr_mtu);
+}
+
+/*
+ * Read a single packet from the tunnel device, at most as much as the
+ * packet has room for. The kernel cuts off what does not fit.
+ */
 ssize_t
 signsky_platform_tundev_read(int fd, struct signsky_packet *pkt)
 {
@@ -75,13 +173,119 @@ signsky_platform_tundev_read(int fd, struct signsky_packet *pkt)
 
 	data = signsky_packet_data(pkt);
 
-	return (read(fd, data, SIGNSKY_PACKET_DATA_LEN));
+	return (read(fd, data, signsky_packet_room(pkt)));
 }
 
-/* Write a single packet to the tunnel device. */
+/*
+ * Read a single frame from a tunnel device in offload mode. If it is
+ * a super-packet it is segmented into packets of at most the segment
+ * size the kernel gave us, otherwise it becomes a single packet.
+ *
+ * The packets are stored in pkts (up to n of them) and the number of
+ * packets is returned, or -1 if the read failed.
+ *
+ * Whatever does not fit in the packet we read into ends up in the
+ * super-packet buffer right behind where it would have been, a frame
+ * that is not a super-packet is moved to a packet large enough for it.
+ */
+ssize_t
+signsky_platform_tundev_read_offload(int fd, void **pkts, size_t n)
+{
+	ssize_t			ret;
+	size_t			len, room;
+	struct signsky_packet	*large;
+	struct iovec		iov[3];
+	struct virtio_net_hdr	vhdr;
+	struct signsky_packet	*pkt;
+	u_int8_t		*data;
+
+	PRECOND(fd >= 0);
+	PRECOND(pkts != NULL);
+	PRECOND(n > 0);
+
+	if ((pkt = signsky_packet_get()) == NULL)
+		pkt = tundev_tpkt;
+
+	data = signsky_packet_data(pkt);
+	room = signsky_packet_room(pkt);
+
+	iov[0].iov_base = &vhdr;
+	iov[0].iov_len = sizeof(vhdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = room;
+	iov[2].iov_base = &tundev_super[room];
+	iov[2].iov_len = sizeof(tundev_super) - room;
+
+	if ((ret = readv(fd, iov, 3)) == -1) {
+		if (pkt != tundev_tpkt)
+			signsky_packet_release(pkt);
+		return (-1);
+	}
+
+	if (ret == 0)
+		fatal("eof on tunnel interface");
+
+	if (pkt == tundev_tpkt)
+		return (0);
+
+	if ((size_t)ret <= sizeof(vhdr) + SIGNSKY_PACKET_MIN_LEN) {
+		pkt->length = ret;
+		signsky_packet_release(pkt);
+		signsky_stat_add(invalid, 1);
+		return (0);
+	}
+
+	len = ret - sizeof(vhdr);
+
+	if (vhdr.gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+		pkt->length = len < room ? len : room;
+		memcpy(tundev_super, data, pkt->length);
+		return (tundev_offload_segment(pkt,
+		    tundev_super, len, &vhdr, pkts, n));
+	}
+
+	if (len > room && len <= SIGNSKY_PACKET_DATA_LEN) {
+		if ((large = signsky_packet_get_len(len)) == NULL) {
+			pkt->length = room;
+			signsky_packet_release(pkt);
+			return (0);
+		}
+
+		memcpy(signsky_packet_data(large), data, room);
+		memcpy((u_int8_t *)signsky_packet_data(large) + room,
+		    &tundev_super[room], len - room);
+
+		pkt->length = room;
+		signsky_packet_release(pkt);
+
+		pkt = large;
+		data = signsky_packet_data(pkt);
+		room = signsky_packet_room(pkt);
+	}
+
+	if (len > room || tundev_offload_csum(data, len, &vhdr) == -1) {
+		pkt->length = room;
+		signsky_packet_release(pkt);
+		signsky_stat_add(invalid, 1);
+		return (0);
+	}
+
+	pkt->length = len;
+	pkt->target = SIGNSKY_PROC_ENCRYPT;
+	pkts[0] = pkt;
+
+	return (1);
+}
+
+/*
+ * Write a single packet to the tunnel device, in offload mode it is
+ * prefixed with an empty virtio-net header as it is fully checksummed.
+ */
 ssize_t
 signsky_platform_tundev_write(int fd, struct signsky_packet *pkt)
 {
+	struct iovec		iov[2];
+	struct virtio_net_hdr	vhdr;
 	u_int8_t		*data;
 
 	PRECOND(fd >= 0);
@@ -89,5 +293,384 @@ signsky_platform_tundev_write(int fd, struct signsky_packet *pkt)
 
 	data = signsky_packet_data(pkt);
 
-	return (write(fd, data, pkt->length));
+	if (!(signsky->flags & SIGNSKY_FLAG_TUN_OFFLOAD))
+		return (write(fd, data, pkt->length));
+
+	memset(&vhdr, 0, sizeof(vhdr));
+
+	iov[0].iov_base = &vhdr;
+	iov[0].iov_len = sizeof(vhdr);
+	iov[1].iov_base = data;
+	iov[1].iov_len = pkt->length;
+
+	return (writev(fd, iov, 2));
+}
+
+/*
+ * Bind the memory at ptr to the given NUMA node, any pages that were
+ * already faulted in are moved there.
+ */
+void
+signsky_platform_numa_bind(void *ptr, size_t len, int node)
+{
+	unsigned long	mask;
+
+	PRECOND(ptr != NULL);
+	PRECOND(len > 0);
+	PRECOND(node >= 0 && node < (int)(sizeof(mask) * 8));
+
+	mask = 1UL << node;
+
+	if (syscall(SYS_mbind, ptr, len, MPOL_BIND, &mask,
+	    sizeof(mask) * 8, MPOL_MF_MOVE) == -1)
+		fatal("mbind to node %d: %s", node, errno_s);
+}
+
+/*
+ * Pin the calling process to the given CPU.
+ */
+void
+signsky_platform_cpu_pin(u_int16_t cpu)
+{
+	cpu_set_t	set;
+
+	if (cpu >= CPU_SETSIZE)
+		fatal("cpu %u is out of range", cpu);
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		fatal("sched_setaffinity(%u): %s", cpu, errno_s);
+}
+
+/*
+ * Create a doorbell for a ring, on Linux this is a single non-blocking
+ * eventfd that is used for both ringing and waiting.
+ */
+void
+signsky_platform_doorbell_create(int *fds)
+{
+	int		fd;
+
+	PRECOND(fds != NULL);
+
+	if ((fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		fatal("eventfd: %s", errno_s);
+
+	fds[0] = fd;
+	fds[1] = fd;
+}
+
+/* Ring the doorbell, waking up anyone polling on it. */
+void
+signsky_platform_doorbell_ring(int fd)
+{
+	u_int64_t	val;
+
+	PRECOND(fd >= 0);
+
+	val = 1;
+
+	for (;;) {
+		if (write(fd, &val, sizeof(val)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("%s: write: %s", __func__, errno_s);
+		}
+		break;
+	}
+}
+
+/* Drain the doorbell after having been woken up by it. */
+void
+signsky_platform_doorbell_drain(int fd)
+{
+	u_int64_t	val;
+
+	PRECOND(fd >= 0);
+
+	for (;;) {
+		if (read(fd, &val, sizeof(val)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fatal("%s: read: %s", __func__, errno_s);
+		}
+		break;
+	}
+}
+
+/*
+ * Segment a TCP or UDP super-packet into packets carrying at most
+ * gso_size bytes of payload each. The first packet is the one the
+ * super-packet was read into, it is used for the first segment if it
+ * is large enough for one and released otherwise.
+ *
+ * Super-packets we cannot parse, that would need more than n segments
+ * or that we cannot get all packets for are dropped as a whole and
+ * counted as invalid, we never hand out only part of one.
+ *
+ * Each segment gets its own copy of the IP and TCP or UDP headers with
+ * the lengths, IPv4 id, TCP sequence number and checksums fixed up.
+ * Only the last TCP segment keeps FIN and PSH.
+ */
+static ssize_t
+tundev_offload_segment(struct signsky_packet *first, u_int8_t *frame,
+    size_t len, const struct virtio_net_hdr *vhdr, void **pkts, size_t n)
+{
+	struct ip		*ip;
+	struct ip6_hdr		*ip6;
+	struct tcphdr		*th;
+	struct udphdr		*uh;
+	struct signsky_packet	*pkt;
+	u_int64_t		sum;
+	u_int32_t		seq, tlen;
+	u_int16_t		id, csum;
+	u_int8_t		*out, flags, proto, version;
+	size_t			idx, off, chunk, hlen, iphlen, thlen;
+	size_t			mss, count, reuse;
+
+	PRECOND(first != NULL);
+	PRECOND(frame != NULL);
+	PRECOND(vhdr != NULL);
+	PRECOND(pkts != NULL);
+
+	th = NULL;
+	uh = NULL;
+
+	id = 0;
+	seq = 0;
+	flags = 0;
+	count = 0;
+	reuse = 0;
+
+	if (len < sizeof(*ip))
+		goto done;
+
+	ip = (struct ip *)frame;
+
+	switch (vhdr->gso_type) {
+	case VIRTIO_NET_HDR_GSO_TCPV4:
+		proto = IPPROTO_TCP;
+		version = 4;
+		break;
+	case VIRTIO_NET_HDR_GSO_TCPV6:
+		proto = IPPROTO_TCP;
+		version = 6;
+		break;
+	case VIRTIO_NET_HDR_GSO_UDP_L4:
+		proto = IPPROTO_UDP;
+		version = ip->ip_v;
+		break;
+	default:
+		goto done;
+	}
+
+	if (ip->ip_v != version)
+		goto done;
+
+	switch (version) {
+	case 4:
+		iphlen = ip->ip_hl << 2;
+		if (iphlen < sizeof(*ip) || ip->ip_p != proto)
+			goto done;
+		id = ntohs(ip->ip_id);
+		break;
+	case 6:
+		ip6 = (struct ip6_hdr *)frame;
+		if (len < sizeof(*ip6) || ip6->ip6_nxt != proto)
+			goto done;
+		iphlen = sizeof(*ip6);
+		break;
+	default:
+		goto done;
+	}
+
+	if (proto == IPPROTO_TCP) {
+		if (len < iphlen + sizeof(*th))
+			goto done;
+		th = (struct tcphdr *)(frame + iphlen);
+		thlen = th->th_off << 2;
+		if (thlen < sizeof(*th))
+			goto done;
+		seq = ntohl(th->th_seq);
+		flags = th->th_flags;
+	} else {
+		thlen = sizeof(*uh);
+	}
+
+	hlen = iphlen + thlen;
+	mss = vhdr->gso_size;
+
+	if (len <= hlen || mss == 0 || hlen + mss > SIGNSKY_PACKET_DATA_LEN)
+		goto done;
+
+	if ((len - hlen + mss - 1) / mss > n)
+		goto done;
+
+	if (signsky_packet_room(first) >= hlen + mss)
+		reuse = 1;
+
+	for (off = hlen; off < len; off += mss) {
+		if (count == 0 && reuse) {
+			pkt = first;
+		} else if ((pkt = signsky_packet_get_len(hlen + mss)) == NULL) {
+			for (idx = reuse; idx < count; idx++)
+				signsky_packet_release(pkts[idx]);
+			count = 0;
+			break;
+		}
+
+		chunk = len - off < mss ? len - off : mss;
+		out = signsky_packet_data(pkt);
+
+		memcpy(out, frame, hlen);
+		memcpy(out + hlen, frame + off, chunk);
+
+		/* The first packet was read into, clear what is left over. */
+		if (pkt->length > hlen + chunk) {
+			signsky_mem_zero(out + hlen + chunk,
+			    pkt->length - (hlen + chunk));
+		}
+
+		tlen = thlen + chunk;
+
+		if (proto == IPPROTO_TCP) {
+			th = (struct tcphdr *)(out + iphlen);
+			th->th_seq = htonl(seq + (off - hlen));
+			th->th_flags = flags;
+			th->th_sum = 0;
+
+			if (off + chunk < len)
+				th->th_flags &= ~(TH_FIN | TH_PUSH);
+		} else {
+			uh = (struct udphdr *)(out + iphlen);
+			uh->uh_ulen = htons(tlen);
+			uh->uh_sum = 0;
+		}
+
+		if (version == 4) {
+			ip = (struct ip *)out;
+			ip->ip_len = htons(hlen + chunk);
+			ip->ip_id = htons(id + count);
+			ip->ip_sum = 0;
+			ip->ip_sum = tundev_csum_fold(
+			    tundev_csum_add(0, ip, iphlen));
+
+			sum = tundev_csum_add(0, &ip->ip_src, 8);
+		} else {
+			ip6 = (struct ip6_hdr *)out;
+			ip6->ip6_plen = htons(tlen);
+
+			sum = tundev_csum_add(0, &ip6->ip6_src, 32);
+		}
+
+		sum += htons(tlen);
+		sum += htons(proto);
+
+		csum = tundev_csum_fold(tundev_csum_add(sum,
+		    out + iphlen, tlen));
+
+		if (proto == IPPROTO_TCP) {
+			th->th_sum = csum;
+		} else {
+			/* A zero UDP checksum means there is none. */
+			uh->uh_sum = csum == 0 ? 0xffff : csum;
+		}
+
+		pkt->length = hlen + chunk;
+		pkt->target = SIGNSKY_PROC_ENCRYPT;
+
+		pkts[count++] = pkt;
+	}
+
+done:
+	if (count == 0 || !reuse)
+		signsky_packet_release(first);
+
+	if (count == 0)
+		signsky_stat_add(invalid, 1);
+
+	return (count);
+}
+
+/*
+ * Finish the checksum of a packet the kernel handed us without one,
+ * the checksum field already holds the pseudo-header sum.
+ */
+static int
+tundev_offload_csum(u_int8_t *data, size_t len,
+    const struct virtio_net_hdr *vhdr)
+{
+	u_int16_t	csum;
+	size_t		start, offset;
+
+	PRECOND(data != NULL);
+	PRECOND(vhdr != NULL);
+
+	if (!(vhdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+		return (0);
+
+	start = vhdr->csum_start;
+	offset = vhdr->csum_offset;
+
+	if (start >= len || offset + sizeof(csum) > len - start)
+		return (-1);
+
+	csum = tundev_csum_fold(tundev_csum_add(0,
+	    data + start, len - start));
+	memcpy(data + start + offset, &csum, sizeof(csum));
+
+	return (0);
+}
+
+/*
+ * Add len bytes at ptr to the given internet checksum sum. This works
+ * in host byte order which gives the same result (RFC 1071), as long
+ * as all pieces that are added start at an even offset.
+ */
+static u_int64_t
+tundev_csum_add(u_int64_t sum, const void *ptr, size_t len)
+{
+	u_int32_t		w32;
+	u_int16_t		w16;
+	const u_int8_t		*p;
+
+	p = ptr;
+
+	while (len >= sizeof(w32)) {
+		memcpy(&w32, p, sizeof(w32));
+		sum += w32;
+		p += sizeof(w32);
+		len -= sizeof(w32);
+	}
+
+	if (len >= sizeof(w16)) {
+		memcpy(&w16, p, sizeof(w16));
+		sum += w16;
+		p += sizeof(w16);
+		len -= sizeof(w16);
+	}
+
+	if (len > 0) {
+		w16 = 0;
+		memcpy(&w16, p, 1);
+		sum += w16;
+	}
+
+	return (sum);
+}
+
+/* Fold the given sum into the final 16-bit internet checksum. */
+static u_int16_t
+tundev_csum_fold(u_int64_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (~sum & 0xffff);
 }
@@ -28,6 +28,13 @@ struct entry {
 	void		*uptr;
 };
 
+static void	pool_entry_busy(struct signsky_pool *, struct entry *);
+static void	pool_entry_free(struct signsky_pool *, struct entry *);
+
+#if defined(SIGNSKY_DEBUG)
+static void	pool_entry_check(struct signsky_pool *, struct entry *);
+#endif
+
 /*
  * Allocate a pool that can be shared between different processes.
  */
@@ -50,10 +57,15 @@ signsky_pool_init(size_t elm, size_t len)
 
 	pool = signsky_alloc_shared(total, NULL);
 
+#if defined(__linux__)
+	if (signsky->pool_numa != -1)
+		signsky_platform_numa_bind(pool, total, signsky->pool_numa);
+#endif
+
 	memset(pool, 0, sizeof(*pool));
 	pool->len = len;
 
-	signsky_ring_init(&pool->queue, elm);
+	signsky_ring_init(&pool->queue, elm, SIGNSKY_RING_MPMC);
 
 	total = (sizeof(*pool) + (POOL_ALIGN - 1)) & ~(POOL_ALIGN - 1);
 	pool->base = (u_int8_t *)pool + total;
@@ -85,8 +97,7 @@ signsky_pool_get(struct signsky_pool *pool)
 	if ((entry = signsky_ring_dequeue(&pool->queue)) == NULL)
 		return (NULL);
 
-	if (!signsky_atomic_cas_simple(&entry->free, 1, 0))
-		fatal("failed to mark entry as busy");
+	pool_entry_busy(pool, entry);
 
 	return (entry->uptr);
 }
@@ -106,9 +117,180 @@ signsky_pool_put(struct signsky_pool *pool, void *ptr)
 	uptr = (uintptr_t)ptr - sizeof(*entry);
 	entry = (struct entry *)uptr;
 
-	if (!signsky_atomic_cas_simple(&entry->free, 0, 1))
-		fatal("failed to mark %p as free", (void *)entry);
+	pool_entry_free(pool, entry);
 
 	if (signsky_ring_queue(&pool->queue, (void *)uptr) == -1)
 		fatal("failed to requeue a free element");
 }
+
+/*
+ * Setup a process local cache in front of the given pool, its limit is
+ * scaled down from the pool size and the number of processes sharing
+ * the pool so that the caches cannot strand most of a small pool.
+ */
+void
+signsky_pool_cache_init(struct signsky_pool *pool,
+    struct signsky_pool_cache *cache, size_t procs)
+{
+	size_t		max;
+
+	PRECOND(pool != NULL);
+	PRECOND(cache != NULL);
+	PRECOND(procs > 0);
+
+	max = pool->queue.elm / (procs * SIGNSKY_POOL_CACHE_SHARE);
+	if (max > SIGNSKY_POOL_CACHE_MAX)
+		max = SIGNSKY_POOL_CACHE_MAX;
+	if (max < 2)
+		max = 0;
+
+	cache->max = max;
+	cache->count = 0;
+}
+
+/*
+ * Return a free entry from the process local cache in front of the
+ * pool, refilling the cache from the pool in bulk when it is empty.
+ * Could return NULL if no more free entries are available.
+ */
+void *
+signsky_pool_cache_get(struct signsky_pool *pool,
+    struct signsky_pool_cache *cache)
+{
+	struct entry		*entry;
+
+	PRECOND(pool != NULL);
+	PRECOND(cache != NULL);
+	PRECOND(cache->count <= cache->max);
+
+	if (cache->max == 0)
+		return (signsky_pool_get(pool));
+
+	if (cache->count == 0) {
+		cache->count = signsky_ring_dequeue_burst(&pool->queue,
+		    cache->entries, cache->max / 2);
+		if (cache->count == 0)
+			return (NULL);
+	}
+
+	entry = cache->entries[--cache->count];
+	pool_entry_busy(pool, entry);
+
+	return (entry->uptr);
+}
+
+/*
+ * Place an element back into the process local cache in front of the
+ * pool, if the cache is full it is first drained into the pool in bulk.
+ */
+void
+signsky_pool_cache_put(struct signsky_pool *pool,
+    struct signsky_pool_cache *cache, void *ptr)
+{
+	size_t			bulk;
+	struct entry		*entry;
+
+	PRECOND(pool != NULL);
+	PRECOND(cache != NULL);
+	PRECOND(ptr != NULL);
+	PRECOND(cache->count <= cache->max);
+
+	if (cache->max == 0) {
+		signsky_pool_put(pool, ptr);
+		return;
+	}
+
+	entry = (struct entry *)((uintptr_t)ptr - sizeof(*entry));
+	pool_entry_free(pool, entry);
+
+	if (cache->count == cache->max) {
+		bulk = cache->max / 2;
+		cache->count -= bulk;
+		if (signsky_ring_queue_burst(&pool->queue,
+		    &cache->entries[cache->count], bulk) != bulk)
+			fatal("failed to requeue free elements");
+	}
+
+	cache->entries[cache->count++] = entry;
+}
+
+/*
+ * Hand all entries in the process local cache back to the pool, this
+ * must be done before a process exits or they are lost to the others.
+ */
+void
+signsky_pool_cache_flush(struct signsky_pool *pool,
+    struct signsky_pool_cache *cache)
+{
+	PRECOND(pool != NULL);
+	PRECOND(cache != NULL);
+	PRECOND(cache->count <= cache->max);
+
+	if (cache->count == 0)
+		return;
+
+	if (signsky_ring_queue_burst(&pool->queue,
+	    cache->entries, cache->count) != cache->count)
+		fatal("failed to requeue free elements");
+
+	cache->count = 0;
+}
+
+/*
+ * Mark the given entry as busy. Ownership is only tracked in debug
+ * builds as it costs an atomic operation per entry.
+ */
+static void
+pool_entry_busy(struct signsky_pool *pool, struct entry *entry)
+{
+	PRECOND(pool != NULL);
+	PRECOND(entry != NULL);
+
+#if defined(SIGNSKY_DEBUG)
+	pool_entry_check(pool, entry);
+
+	if (!signsky_atomic_cas_simple(&entry->free, 1, 0))
+		fatal("failed to mark entry as busy");
+#endif
+}
+
+/*
+ * Mark the given entry as free again, see pool_entry_busy().
+ */
+static void
+pool_entry_free(struct signsky_pool *pool, struct entry *entry)
+{
+	PRECOND(pool != NULL);
+	PRECOND(entry != NULL);
+
+#if defined(SIGNSKY_DEBUG)
+	pool_entry_check(pool, entry);
+
+	if (!signsky_atomic_cas_simple(&entry->free, 0, 1))
+		fatal("failed to mark %p as free", (void *)entry);
+#endif
+}
+
+#if defined(SIGNSKY_DEBUG)
+/*
+ * Check that the given entry actually belongs to the pool.
+ */
+static void
+pool_entry_check(struct signsky_pool *pool, struct entry *entry)
+{
+	uintptr_t	off;
+
+	PRECOND(pool != NULL);
+	PRECOND(entry != NULL);
+
+	if ((u_int8_t *)entry < pool->base)
+		fatal("entry %p is not from pool %p",
+		    (void *)entry, (void *)pool);
+
+	off = (u_int8_t *)entry - pool->base;
+
+	if (off % pool->len != 0 || off / pool->len >= pool->queue.elm)
+		fatal("entry %p is not from pool %p",
+		    (void *)entry, (void *)pool);
+}
+#endif
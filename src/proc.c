@@ -19,7 +19,9 @@
 #include <sys/wait.h>
 
 #include <grp.h>
+#include <inttypes.h>
 #include <pwd.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
@@ -27,6 +29,18 @@
 
 #include "signsky.h"
 
+/* How long a retired worker gets to hand over its SAs, in seconds. */
+#define PROC_HANDOFF_TIMEOUT	5
+
+static u_int32_t	proc_ring_type(u_int16_t, u_int16_t);
+static void		proc_sched_apply(struct signsky_proc *);
+static void		proc_arwin_release(struct signsky_proc *);
+static int		proc_handoff_quit(void);
+static int		proc_retiring(struct signsky_proc *);
+static void		proc_handoff_gone(struct signsky_proc *);
+static void		proc_stats_undo(struct signsky_proc *,
+			    struct signsky_proc_stats *);
+
 /* List of all worker processes. */
 static LIST_HEAD(, signsky_proc)		proclist;
 
@@ -41,6 +55,18 @@ static const char *proctab[] = {
 	"status"
 };
 
+/*
+ * The rings between the processes, overwatch keeps these mapped so
+ * it can sample their occupancy, see signsky_proc_sample().
+ */
+static struct signsky_ring	*rings[SIGNSKY_RING_PROC_MAX];
+
+/*
+ * The shared memory handed to all processes, overwatch keeps it mapped
+ * so it can start new encrypt and decrypt workers on a warm restart.
+ */
+static struct signsky_proc_io	io;
+
 /* Points to the process its own signsky_proc, or NULL or parent. */
 static struct signsky_proc	*process = NULL;
 
@@ -81,44 +107,436 @@ signsky_proc_init(char **argv)
  *
  * We create all the shared memory queues and pass them to each process.
  * The processes themselves will remove the queues they do not need.
+ *
+ *	decrypt ring: crypto -> decrypt workers
+ *	clear ring: decrypt workers -> clear workers
+ *	encrypt ring: clear workers -> encrypt workers
+ *	crypto ring: encrypt workers -> crypto
  */
 void
 signsky_proc_start(void)
 {
-	struct signsky_proc_io		io;
-
-	signsky_proc_create(SIGNSKY_PROC_STATUS, signsky_status_entry, NULL);
-
-	io.tx = signsky_alloc_shared(sizeof(struct signsky_key), NULL);
-	io.rx = signsky_alloc_shared(sizeof(struct signsky_key), NULL);
-	io.arwin = signsky_alloc_shared(sizeof(struct signsky_arwin), NULL);
-
-	io.clear = signsky_ring_alloc(1024);
-	io.crypto = signsky_ring_alloc(1024);
-	io.encrypt = signsky_ring_alloc(1024);
-	io.decrypt = signsky_ring_alloc(1024);
-
-	signsky_proc_create(SIGNSKY_PROC_CLEAR, signsky_clear_entry, &io);
-	signsky_proc_create(SIGNSKY_PROC_CRYPTO, signsky_crypto_entry, &io);
-	signsky_proc_create(SIGNSKY_PROC_KEYING, signsky_keying_entry, &io);
-	signsky_proc_create(SIGNSKY_PROC_ENCRYPT, signsky_encrypt_entry, &io);
-	signsky_proc_create(SIGNSKY_PROC_DECRYPT, signsky_decrypt_entry, &io);
-
-	signsky_shm_detach(io.tx);
-	signsky_shm_detach(io.rx);
-	signsky_shm_detach(io.arwin);
-	signsky_shm_detach(io.clear);
-	signsky_shm_detach(io.crypto);
-	signsky_shm_detach(io.encrypt);
-	signsky_shm_detach(io.decrypt);
+	size_t				len;
+	u_int16_t			idx, clear, encrypt, decrypt, npeers;
+
+	clear = signsky->workers[SIGNSKY_PROC_CLEAR];
+	encrypt = signsky->workers[SIGNSKY_PROC_ENCRYPT];
+	decrypt = signsky->workers[SIGNSKY_PROC_DECRYPT];
+
+	PRECOND(clear > 0 && clear <= SIGNSKY_WORKERS_MAX);
+	PRECOND(encrypt > 0 && encrypt <= SIGNSKY_WORKERS_MAX);
+	PRECOND(decrypt > 0 && decrypt <= SIGNSKY_WORKERS_MAX);
+
+	signsky_proc_create(SIGNSKY_PROC_STATUS, 0, signsky_status_entry, NULL);
+
+	npeers = signsky->npeers;
+	PRECOND(npeers > 0 && npeers <= SIGNSKY_PEERS_MAX);
+
+	len = sizeof(struct signsky_key);
+	io.tx = signsky_alloc_shared(npeers * encrypt * len, NULL);
+	io.rx = signsky_alloc_shared(npeers * decrypt * len, NULL);
+
+	len = sizeof(struct signsky_arwin);
+	io.arwin = signsky_alloc_shared(npeers * len, NULL);
+
+	len = sizeof(struct signsky_seqnr);
+	io.seqnr = signsky_alloc_shared(npeers * len, NULL);
+
+	for (idx = 0; idx < npeers; idx++)
+		io.seqnr[idx].next = 1;
+
+	io.spi = signsky_alloc_shared(sizeof(struct signsky_spi_table), NULL);
+
+	len = sizeof(struct signsky_handoff);
+	io.handoff_tx = signsky_alloc_shared(encrypt * len, NULL);
+	io.handoff_rx = signsky_alloc_shared(decrypt * len, NULL);
+
+	io.clear = signsky_ring_alloc(1024, proc_ring_type(decrypt, clear));
+	io.crypto = signsky_ring_alloc(1024, proc_ring_type(encrypt, 1));
+	io.encrypt = signsky_ring_alloc(1024, proc_ring_type(clear, encrypt));
+	io.decrypt = signsky_ring_alloc(1024, proc_ring_type(1, decrypt));
+
+	rings[SIGNSKY_RING_CLEAR] = io.clear;
+	rings[SIGNSKY_RING_CRYPTO] = io.crypto;
+	rings[SIGNSKY_RING_ENCRYPT] = io.encrypt;
+	rings[SIGNSKY_RING_DECRYPT] = io.decrypt;
+
+	for (idx = 0; idx < clear; idx++) {
+		signsky_proc_create(SIGNSKY_PROC_CLEAR,
+		    idx, signsky_clear_entry, &io);
+	}
+
+	signsky_proc_create(SIGNSKY_PROC_CRYPTO, 0, signsky_crypto_entry, &io);
+	signsky_proc_create(SIGNSKY_PROC_KEYING, 0, signsky_keying_entry, &io);
+
+	for (idx = 0; idx < encrypt; idx++) {
+		signsky_proc_create(SIGNSKY_PROC_ENCRYPT,
+		    idx, signsky_encrypt_entry, &io);
+	}
+
+	for (idx = 0; idx < decrypt; idx++) {
+		signsky_proc_create(SIGNSKY_PROC_DECRYPT,
+		    idx, signsky_decrypt_entry, &io);
+	}
+}
+
+/*
+ * Warm restart the encrypt and decrypt workers, these are new processes
+ * running the same image, a new signsky binary is not picked up.
+ *
+ * For each worker a new one is started first while the old one keeps
+ * working. The old one places its SAs in their handoff slot, the new
+ * one sets up its ciphers from them and only then asks the old one to
+ * stop (see signsky_handoff_takeover()). The rings go unserved only
+ * for as long as the old one needs to finish its current burst. The
+ * sequence numbers and anti-replay windows are in shared memory and
+ * carry over.
+ *
+ * If the old one does not hand over in time signsky_proc_retire_check()
+ * gets rid of it, the two never run on the same rings.
+ */
+void
+signsky_proc_restart(void)
+{
+	struct signsky_handoff	*slot;
+	struct signsky_proc	*proc;
+
+	LIST_FOREACH(proc, &proclist, list) {
+		if (proc->retired)
+			continue;
+
+		if (proc->type != SIGNSKY_PROC_ENCRYPT &&
+		    proc->type != SIGNSKY_PROC_DECRYPT)
+			continue;
+
+		slot = SIGNSKY_HANDOFF_SLOT(&io, proc->type, proc->id);
+
+		if (signsky_atomic_read(&slot->state) !=
+		    SIGNSKY_HANDOFF_EMPTY || proc_retiring(proc)) {
+			syslog(LOG_NOTICE, "%s (id=%u) still restarting",
+			    proc->name, proc->id);
+			continue;
+		}
+
+		signsky_atomic_write(&slot->gone, 0);
+		signsky_atomic_write(&slot->state, SIGNSKY_HANDOFF_WAIT);
+
+		/* New processes go to the head, we do not see them. */
+		signsky_proc_create(proc->type, proc->id, proc->entry, &io);
+
+		proc->retired = signsky_time_ns();
+
+		if (kill(proc->pid, SIGUSR1) == -1) {
+			syslog(LOG_NOTICE, "failed to signal %s (%s)",
+			    proc->name, errno_s);
+		}
+	}
+}
+
+/*
+ * Called by overwatch on every tick. A retired worker that is still
+ * around PROC_HANDOFF_TIMEOUT seconds after the warm restart is killed
+ * and reaped, only then is its successor told that it is gone and to
+ * start cold if it was still waiting for the SAs.
+ *
+ * Anti-replay window locks held by a killed decrypt worker are
+ * released, see proc_arwin_release().
+ *
+ * The packets in the pool caches of a killed worker are lost with it,
+ * as are any it was working on. We log how many were cached and undo
+ * its count on the ring waiting if it was parked, so that producers
+ * do not ring the doorbell for it forever. Its successor shares its
+ * stats entry, so this is only done while the successor has not yet
+ * started on the rings (the slot is WAIT, READY or TAKEOVER).
+ */
+void
+signsky_proc_retire_check(void)
+{
+	u_int64_t			now;
+	int				status, state;
+	struct signsky_handoff		*slot;
+	struct signsky_proc		*proc, *next;
+	struct signsky_proc_stats	*stats;
+
+	now = signsky_time_ns();
+
+	for (proc = LIST_FIRST(&proclist); proc != NULL; proc = next) {
+		next = LIST_NEXT(proc, list);
+
+		if (proc->retired == 0 ||
+		    now - proc->retired < PROC_HANDOFF_TIMEOUT * 1000000000ULL)
+			continue;
+
+		syslog(LOG_NOTICE, "%s (id=%u) did not retire in time",
+		    proc->name, proc->id);
+
+		if (kill(proc->pid, SIGKILL) == -1)
+			fatal("failed to kill %s: %s", proc->name, errno_s);
+
+		while (waitpid(proc->pid, &status, 0) == -1) {
+			if (errno != EINTR)
+				fatal("waitpid: %s", errno_s);
+		}
+
+		if (proc->type == SIGNSKY_PROC_DECRYPT)
+			proc_arwin_release(proc);
+
+		slot = SIGNSKY_HANDOFF_SLOT(&io, proc->type, proc->id);
+		state = signsky_atomic_read(&slot->state);
+
+		if (state == SIGNSKY_HANDOFF_WAIT ||
+		    state == SIGNSKY_HANDOFF_READY ||
+		    state == SIGNSKY_HANDOFF_TAKEOVER) {
+			stats = &signsky->stats[proc->type][proc->id].proc;
+			proc_stats_undo(proc, stats);
+		} else {
+			syslog(LOG_NOTICE, "%s (id=%u) killed",
+			    proc->name, proc->id);
+		}
+
+		proc_handoff_gone(proc);
+
+		LIST_REMOVE(proc, list);
+		free(proc);
+	}
+}
+
+/*
+ * Undo what a killed encrypt or decrypt worker left behind in its stats
+ * and on its ring, see signsky_proc_retire_check().
+ */
+static void
+proc_stats_undo(struct signsky_proc *proc, struct signsky_proc_stats *stats)
+{
+	struct signsky_ring	*ring;
+
+	PRECOND(proc != NULL);
+	PRECOND(stats != NULL);
+
+	if (signsky_atomic_read_relaxed(&stats->parked)) {
+		if (proc->type == SIGNSKY_PROC_ENCRYPT)
+			ring = io.encrypt;
+		else
+			ring = io.decrypt;
+
+		signsky_atomic_sub(&ring->waiting, 1);
+		signsky_atomic_write_relaxed(&stats->parked, 0);
+	}
+
+	syslog(LOG_NOTICE,
+	    "%s (id=%u) killed, %" PRIu64 " cached packets lost",
+	    proc->name, proc->id,
+	    signsky_atomic_read_relaxed(&stats->cached));
+	signsky_atomic_write_relaxed(&stats->cached, 0);
+}
+
+/*
+ * Called by an old encrypt or decrypt worker once it placed its SAs in
+ * the handoff slot. If overwatch no longer waits for us the SAs are
+ * wiped again, they must never be left behind for nobody to take.
+ *
+ * Returns 0 if the handoff is under way, the caller keeps working
+ * until signsky_handoff_asked() says its successor took over. Returns
+ * -1 if it was not expected, the caller stops right away.
+ */
+int
+signsky_handoff_ready(struct signsky_handoff *slot)
+{
+	PRECOND(slot != NULL);
+
+	if (!signsky_atomic_cas_simple(&slot->state,
+	    SIGNSKY_HANDOFF_WAIT, SIGNSKY_HANDOFF_READY)) {
+		signsky_mem_zero(slot->sa, sizeof(slot->sa));
+		syslog(LOG_NOTICE, "handoff no longer expected");
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Called by an old encrypt or decrypt worker that handed over its SAs
+ * in between bursts, returns 1 once its successor asks it to stop.
+ */
+int
+signsky_handoff_asked(struct signsky_handoff *slot)
+{
+	PRECOND(slot != NULL);
+
+	return (signsky_atomic_read(&slot->state) ==
+	    SIGNSKY_HANDOFF_TAKEOVER);
+}
+
+/*
+ * Called by an old encrypt or decrypt worker once it was asked to stop,
+ * it must no longer touch any ring after this.
+ */
+void
+signsky_handoff_release(struct signsky_handoff *slot)
+{
+	PRECOND(slot != NULL);
+	PRECOND(signsky_handoff_asked(slot));
+
+	signsky_atomic_write(&slot->state, SIGNSKY_HANDOFF_RELEASED);
+	syslog(LOG_NOTICE, "released the rings");
+}
+
+/*
+ * Called by a new encrypt or decrypt worker before it touches any ring.
+ * If it was started for a warm restart, wait until its predecessor
+ * placed its SAs in the handoff slot or until overwatch got rid of the
+ * predecessor and tells us to start cold.
+ *
+ * Returns 0 if the SAs are ready to be imported, -1 if there is nothing
+ * to take over or if we were told to quit while waiting. In the latter
+ * case SIGQUIT is left pending for the caller to handle before it
+ * touches any ring, other signals are not of interest here.
+ */
+int
+signsky_handoff_wait(struct signsky_handoff *slot)
+{
+	PRECOND(slot != NULL);
+
+	for (;;) {
+		switch (signsky_atomic_read(&slot->state)) {
+		case SIGNSKY_HANDOFF_EMPTY:
+			return (-1);
+		case SIGNSKY_HANDOFF_READY:
+			return (0);
+		case SIGNSKY_HANDOFF_COLD:
+			syslog(LOG_NOTICE, "no SAs handed over, starting cold");
+			signsky_atomic_write(&slot->state,
+			    SIGNSKY_HANDOFF_EMPTY);
+			return (-1);
+		}
+
+		if (proc_handoff_quit())
+			return (-1);
+
+		usleep(100);
+	}
+}
+
+/*
+ * Called by a new encrypt or decrypt worker once it imported the SAs
+ * its predecessor handed over. Ask the predecessor to stop and wait
+ * until it did, or until overwatch got rid of it, before the caller
+ * touches any ring. This only takes as long as the predecessor needs
+ * to finish the burst it is working on.
+ *
+ * Returns 0 once the rings are ours, -1 if we were told to quit while
+ * waiting (see signsky_handoff_wait()).
+ */
+int
+signsky_handoff_takeover(struct signsky_handoff *slot)
+{
+	PRECOND(slot != NULL);
+
+	signsky_atomic_write(&slot->state, SIGNSKY_HANDOFF_TAKEOVER);
+
+	while (signsky_atomic_read(&slot->state) !=
+	    SIGNSKY_HANDOFF_RELEASED && !signsky_atomic_read(&slot->gone)) {
+		if (proc_handoff_quit())
+			return (-1);
+		signsky_cpu_pause();
+	}
+
+	signsky_atomic_write(&slot->state, SIGNSKY_HANDOFF_EMPTY);
+
+	return (0);
+}
+
+/*
+ * Returns 1 if the retired predecessor of the given worker is still
+ * around, its handoff slot cannot be used for another warm restart
+ * until it was reaped.
+ */
+static int
+proc_retiring(struct signsky_proc *proc)
+{
+	struct signsky_proc	*other;
+
+	PRECOND(proc != NULL);
+
+	LIST_FOREACH(other, &proclist, list) {
+		if (other != proc && other->retired &&
+		    other->type == proc->type && other->id == proc->id)
+			return (1);
+	}
+
+	return (0);
+}
+
+/*
+ * Called once a retired worker was reaped, its successor is told it is
+ * gone so it does not wait for it to release the rings. If it was still
+ * waiting for the SAs it is told to start cold.
+ */
+static void
+proc_handoff_gone(struct signsky_proc *proc)
+{
+	struct signsky_handoff	*slot;
+
+	PRECOND(proc != NULL);
+	PRECOND(proc->type == SIGNSKY_PROC_ENCRYPT ||
+	    proc->type == SIGNSKY_PROC_DECRYPT);
+
+	slot = SIGNSKY_HANDOFF_SLOT(&io, proc->type, proc->id);
+
+	if (signsky_atomic_read(&slot->state) == SIGNSKY_HANDOFF_WAIT) {
+		signsky_mem_zero(slot->sa, sizeof(slot->sa));
+		signsky_atomic_write(&slot->state, SIGNSKY_HANDOFF_COLD);
+	}
+
+	signsky_atomic_write(&slot->gone, 1);
+}
+
+/*
+ * Check for signals while waiting on a handoff slot. Returns 1 if
+ * SIGQUIT is pending, which is left for the caller to handle, any
+ * other signal is not of interest and is taken off.
+ */
+static int
+proc_handoff_quit(void)
+{
+	switch (signsky_signal_pending()) {
+	case -1:
+		break;
+	case SIGQUIT:
+		return (1);
+	default:
+		(void)signsky_last_signal();
+		break;
+	}
+
+	return (0);
+}
+
+/*
+ * Sample how many packets are queued on each of the rings between
+ * the processes, called periodically by overwatch.
+ */
+void
+signsky_proc_sample(void)
+{
+	int		idx;
+
+	for (idx = 0; idx < SIGNSKY_RING_PROC_MAX; idx++) {
+		if (rings[idx] == NULL)
+			continue;
+
+		signsky_ring_sample(&signsky->rings[idx],
+		    signsky_ring_pending(rings[idx]), rings[idx]->elm);
+	}
 }
 
 /*
  * Create a new process that will start executing at the given entry
- * point. The process is not yet started.
+ * point. The id is the worker number for process types that can
+ * have more than one worker, otherwise it is 0.
  */
 void
-signsky_proc_create(u_int16_t type,
+signsky_proc_create(u_int16_t type, u_int16_t id,
     void (*entry)(struct signsky_proc *), void *arg)
 {
 	struct passwd		*pw;
@@ -130,6 +548,7 @@ signsky_proc_create(u_int16_t type,
 	    type == SIGNSKY_PROC_DECRYPT ||
 	    type == SIGNSKY_PROC_KEYING ||
 	    type == SIGNSKY_PROC_STATUS);
+	PRECOND(id < signsky->workers[type]);
 	PRECOND(entry != NULL);
 	/* arg is optional. */
 
@@ -139,6 +558,7 @@ signsky_proc_create(u_int16_t type,
 	if ((proc = calloc(1, sizeof(*proc))) == NULL)
 		fatal("calloc: failed to allocate new proc entry");
 
+	proc->id = id;
 	proc->arg = arg;
 	proc->type = type;
 	proc->entry = entry;
@@ -154,16 +574,25 @@ signsky_proc_create(u_int16_t type,
 		fatal("failed to fork child: %s", errno_s);
 
 	if (proc->pid == 0) {
+		/* Do not act on a signal that was meant for overwatch. */
+		(void)signsky_last_signal();
+
 		openlog(proc->name, LOG_NDELAY | LOG_PID, LOG_DAEMON);
 		signsky_proc_title(proc->name);
 
 		process = proc;
-		proc->pid = getpid(),
+		signsky_stats = &signsky->stats[proc->type][proc->id].proc;
+		signsky_peer_stats =
+		    signsky->stats[proc->type][proc->id].peers;
+
+		proc->pid = getpid();
+		proc_sched_apply(proc);
 		proc->entry(proc);
 		/* NOTREACHED */
 	}
 
-	syslog(LOG_INFO, "started %s (pid=%d)", proc->name, proc->pid);
+	syslog(LOG_INFO, "started %s (id=%u, pid=%d)",
+	    proc->name, proc->id, proc->pid);
 
 	LIST_INSERT_HEAD(&proclist, proc, list);
 }
@@ -195,14 +624,17 @@ signsky_proc_privsep(struct signsky_proc *proc)
 }
 
 /*
- * Reap a single process.
+ * Reap all processes that exited. Returns 1 if one of them was not
+ * retired by a warm restart (in which case overwatch shuts down).
  */
-void
+int
 signsky_proc_reap(void)
 {
 	pid_t			pid;
 	struct signsky_proc	*proc;
-	int			status;
+	int			status, lost;
+
+	lost = 0;
 
 	for (;;) {
 		if ((pid = waitpid(-1, &status, WNOHANG)) == -1) {
@@ -220,12 +652,18 @@ signsky_proc_reap(void)
 			if (proc->pid == pid) {
 				syslog(LOG_NOTICE, "%s exited (%d)",
 				    proc->name, status);
+				if (!proc->retired)
+					lost = 1;
+				else
+					proc_handoff_gone(proc);
 				LIST_REMOVE(proc, list);
 				free(proc);
 				break;
 			}
 		}
 	}
+
+	return (lost);
 }
 
 /*
@@ -257,6 +695,18 @@ signsky_proc_shutdown(void)
 		signsky_proc_reap();
 }
 
+/*
+ * Returns the human readable name for the given process type.
+ */
+const char *
+signsky_proc_name(u_int16_t type)
+{
+	if (type >= SIGNSKY_PROC_MAX)
+		return (proctab[0]);
+
+	return (proctab[type]);
+}
+
 /*
  * Returns the signsky_process for the active process.
  * Will return NULL on the parent process.
@@ -292,3 +742,74 @@ signsky_proc_title(const char *name)
 
 	memset(proc_argv[0] + len, 0, proc_title_max - len);
 }
+
+/*
+ * Select the ring type for a ring with the given number of producer
+ * and consumer processes, if there is only one of each we can use the
+ * cheaper single-producer, single-consumer ring.
+ */
+static u_int32_t
+proc_ring_type(u_int16_t producers, u_int16_t consumers)
+{
+	PRECOND(producers > 0);
+	PRECOND(consumers > 0);
+
+	if (producers == 1 && consumers == 1)
+		return (SIGNSKY_RING_SPSC);
+
+	return (SIGNSKY_RING_MPMC);
+}
+
+/*
+ * Release the anti-replay window locks held by the given decrypt worker,
+ * which we killed and reaped. Otherwise the other decrypt workers would
+ * spin on them forever.
+ */
+static void
+proc_arwin_release(struct signsky_proc *proc)
+{
+	u_int16_t	peer;
+
+	PRECOND(proc != NULL);
+	PRECOND(proc->type == SIGNSKY_PROC_DECRYPT);
+
+	for (peer = 0; peer < signsky->npeers; peer++) {
+		if (signsky_atomic_cas_simple(&io.arwin[peer].lock,
+		    proc->pid, 0)) {
+			syslog(LOG_NOTICE,
+			    "released anti-replay lock of peer %u held by %s",
+			    peer, proc->name);
+		}
+	}
+}
+
+/*
+ * Apply the configured CPU pinning and scheduling policy for the given
+ * process. This is called before the process its entry point, and thus
+ * before it drops its privileges.
+ */
+static void
+proc_sched_apply(struct signsky_proc *proc)
+{
+	struct signsky_proc_sched	*sched;
+#if defined(__linux__)
+	struct sched_param		param;
+#endif
+
+	PRECOND(proc != NULL);
+
+	sched = &signsky->sched[proc->type];
+
+#if defined(__linux__)
+	if (sched->ncpu > 0)
+		signsky_platform_cpu_pin(sched->cpu[proc->id % sched->ncpu]);
+
+	if (sched->priority != 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sched->priority;
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param) == -1)
+			fatal("sched_setscheduler: %s", errno_s);
+	}
+#endif
+}
@@ -16,24 +16,58 @@
 
 #include <sys/types.h>
 
+#include <poll.h>
+#include <time.h>
+
 #include "signsky.h"
 
+/* How long a parked consumer waits at most, in milliseconds. */
+#define RING_PARK_TIMEOUT	100
+
+static u_int64_t	ring_time_us(void);
+static void		ring_wakeup(struct signsky_ring *);
+static void		ring_park(struct signsky_ring *, int);
+
+static size_t	ring_spsc_queue(struct signsky_ring *, void **, size_t);
+static size_t	ring_spsc_dequeue(struct signsky_ring *, void **, size_t);
+
 /*
  * A multi-producer, multi-consumer ring queue.
+ *
+ * A ring can also be created as SIGNSKY_RING_SPSC if it is known to
+ * only ever have one producer and one consumer, in which case no CAS
+ * is required to reserve slots and nobody has to wait for their turn.
+ *
+ * Producers publish slots by a release store on producer.tail which
+ * consumers pair with an acquire load before reading the slots,
+ * consumers hand slots back by a release store on consumer.tail which
+ * producers pair with an acquire load before overwriting them.
+ *
+ * The heads are only used to reserve slots between producers or
+ * consumers themselves and do not order any data, they are relaxed.
+ * Waiting for our turn to move a tail is an acquire so that the
+ * release by the previous producer or consumer carries over.
+ *
+ * A consumer that has nothing to do spins for a while and then parks
+ * on the ring its doorbell (see signsky_ring_idle()). It announces this
+ * by incrementing waiting before it checks the ring one last time,
+ * while producers check waiting after publishing their slots. With a
+ * full fence on both sides at least one of them sees the other.
  */
 
 /*
- * Allocate a new ring of the given number of elements. This must
+ * Allocate a new ring of the given number of elements and type. This must
  * be a power of 2 and must be maximum 4096. This is checked in
  * the signsky_ring_init() function.
  */
 struct signsky_ring *
-signsky_ring_alloc(size_t elm)
+signsky_ring_alloc(size_t elm, u_int32_t type)
 {
 	struct signsky_ring	*ring;
 
 	ring = signsky_alloc_shared(sizeof(*ring), NULL);
-	signsky_ring_init(ring, elm);
+	signsky_ring_init(ring, elm, type);
+	signsky_platform_doorbell_create(ring->doorbell);
 
 	return (ring);
 }
@@ -44,15 +78,20 @@ signsky_ring_alloc(size_t elm)
  * be 4096.
  */
 void
-signsky_ring_init(struct signsky_ring *ring, size_t elm)
+signsky_ring_init(struct signsky_ring *ring, size_t elm, u_int32_t type)
 {
 	PRECOND(ring != NULL);
-	PRECOND(elm > 0 && (elm & (elm - 1)) == 0);
+	PRECOND(elm > 0 && elm <= 4096 && (elm & (elm - 1)) == 0);
+	PRECOND(type == SIGNSKY_RING_MPMC || type == SIGNSKY_RING_SPSC);
 
 	memset(ring, 0, sizeof(*ring));
 
 	ring->elm = elm;
+	ring->type = type;
 	ring->mask = elm - 1;
+
+	ring->doorbell[0] = -1;
+	ring->doorbell[1] = -1;
 }
 
 /*
@@ -66,8 +105,8 @@ signsky_ring_pending(struct signsky_ring *ring)
 
 	PRECOND(ring != NULL);
 
-	head = signsky_atomic_read(&ring->consumer.head);
-	tail = signsky_atomic_read(&ring->producer.tail);
+	head = signsky_atomic_read_relaxed(&ring->consumer.head);
+	tail = signsky_atomic_read_acquire(&ring->producer.tail);
 
 	return (tail - head);
 }
@@ -83,12 +122,36 @@ signsky_ring_available(struct signsky_ring *ring)
 
 	PRECOND(ring != NULL);
 
-	head = signsky_atomic_read(&ring->producer.head);
-	tail = signsky_atomic_read(&ring->consumer.tail);
+	head = signsky_atomic_read_relaxed(&ring->producer.head);
+	tail = signsky_atomic_read_acquire(&ring->consumer.tail);
 
 	return (ring->elm + (tail - head));
 }
 
+/*
+ * Add a sample of the given depth to the occupancy statistics of a ring
+ * that holds size entries. Only overwatch calls this, the status process
+ * reads the counters without holding anything.
+ */
+void
+signsky_ring_sample(struct signsky_ring_stats *st, size_t depth, size_t size)
+{
+	PRECOND(st != NULL);
+	PRECOND(size > 0 && size <= 4096);
+
+	if (depth > size)
+		depth = size;
+
+	signsky_atomic_write_relaxed(&st->size, size);
+	signsky_atomic_write_relaxed(&st->last, depth);
+
+	if (depth > st->high)
+		signsky_atomic_write_relaxed(&st->high, depth);
+
+	signsky_atomic_write_relaxed(&st->total, st->total + depth);
+	signsky_atomic_write_relaxed(&st->samples, st->samples + 1);
+}
+
 /*
  * Dequeue an item from the given ring queue. If no items were
  * available to be dequeued, NULL is returned to the caller.
@@ -96,28 +159,37 @@ signsky_ring_available(struct signsky_ring *ring)
 void *
 signsky_ring_dequeue(struct signsky_ring *ring)
 {
+	void		*ptr;
 	uintptr_t	uptr;
 	u_int32_t	slot, head, tail, next;
 
 	PRECOND(ring != NULL);
 
+	if (ring->type == SIGNSKY_RING_SPSC) {
+		if (ring_spsc_dequeue(ring, &ptr, 1) == 0)
+			return (NULL);
+		return (ptr);
+	}
+
 dequeue_again:
-	head = signsky_atomic_read(&ring->consumer.head);
-	tail = signsky_atomic_read(&ring->producer.tail);
+	head = signsky_atomic_read_relaxed(&ring->consumer.head);
+	tail = signsky_atomic_read_acquire(&ring->producer.tail);
 
 	if ((tail - head) == 0)
 		return (NULL);
 
 	next = head + 1;
-	if (!signsky_atomic_cas(&ring->consumer.head, &head, &next))
+	if (!signsky_atomic_cas_relaxed(&ring->consumer.head, &head, &next))
 		goto dequeue_again;
 
 	slot = head & ring->mask;
-	uptr = signsky_atomic_read(&ring->data[slot]);
+	uptr = signsky_atomic_read_relaxed(&ring->data[slot]);
 
-	while (!signsky_atomic_cas_simple(&ring->consumer.tail, head, next))
+	while (signsky_atomic_read_acquire(&ring->consumer.tail) != head)
 		signsky_cpu_pause();
 
+	signsky_atomic_write_release(&ring->consumer.tail, next);
+
 	return ((void *)uptr);
 }
 
@@ -130,22 +202,300 @@ signsky_ring_queue(struct signsky_ring *ring, void *ptr)
 {
 	u_int32_t	slot, head, tail, next;
 
+	PRECOND(ring != NULL);
+
+	if (ring->type == SIGNSKY_RING_SPSC)
+		return (ring_spsc_queue(ring, &ptr, 1) == 1 ? 0 : -1);
+
 queue_again:
-	head = signsky_atomic_read(&ring->producer.head);
-	tail = signsky_atomic_read(&ring->consumer.tail);
+	head = signsky_atomic_read_relaxed(&ring->producer.head);
+	tail = signsky_atomic_read_acquire(&ring->consumer.tail);
 
 	if ((ring->elm + (tail - head)) == 0)
 		return (-1);
 
 	next = head + 1;
-	if (!signsky_atomic_cas(&ring->producer.head, &head, &next))
+	if (!signsky_atomic_cas_relaxed(&ring->producer.head, &head, &next))
 		goto queue_again;
 
 	slot = head & ring->mask;
-	signsky_atomic_write(&ring->data[slot], (uintptr_t)ptr);
+	signsky_atomic_write_relaxed(&ring->data[slot], (uintptr_t)ptr);
 
-	while (!signsky_atomic_cas_simple(&ring->producer.tail, head, next))
+	while (signsky_atomic_read_acquire(&ring->producer.tail) != head)
 		signsky_cpu_pause();
 
+	signsky_atomic_write_release(&ring->producer.tail, next);
+	ring_wakeup(ring);
+
 	return (0);
 }
+
+/*
+ * Dequeue up to n items from the given ring queue into the out array
+ * using a single update of the consumer head and tail.
+ *
+ * Returns the number of items that were dequeued, which can be 0.
+ */
+size_t
+signsky_ring_dequeue_burst(struct signsky_ring *ring, void **out, size_t n)
+{
+	u_int32_t	idx, count, slot, head, tail, next;
+
+	PRECOND(ring != NULL);
+	PRECOND(out != NULL);
+	PRECOND(n > 0 && n <= ring->elm);
+
+	if (ring->type == SIGNSKY_RING_SPSC)
+		return (ring_spsc_dequeue(ring, out, n));
+
+dequeue_again:
+	head = signsky_atomic_read_relaxed(&ring->consumer.head);
+	tail = signsky_atomic_read_acquire(&ring->producer.tail);
+
+	if ((count = tail - head) == 0)
+		return (0);
+
+	if (count > n)
+		count = n;
+
+	next = head + count;
+	if (!signsky_atomic_cas_relaxed(&ring->consumer.head, &head, &next))
+		goto dequeue_again;
+
+	for (idx = 0; idx < count; idx++) {
+		slot = (head + idx) & ring->mask;
+		out[idx] = (void *)signsky_atomic_read_relaxed(
+		    &ring->data[slot]);
+	}
+
+	while (signsky_atomic_read_acquire(&ring->consumer.tail) != head)
+		signsky_cpu_pause();
+
+	signsky_atomic_write_release(&ring->consumer.tail, next);
+
+	return (count);
+}
+
+/*
+ * Queue up to n items from the given array into the ring queue using
+ * a single update of the producer head and tail.
+ *
+ * Returns the number of items that were queued, the caller is
+ * responsible for the items that did not fit.
+ */
+size_t
+signsky_ring_queue_burst(struct signsky_ring *ring, void **in, size_t n)
+{
+	u_int32_t	idx, count, slot, head, tail, next;
+
+	PRECOND(ring != NULL);
+	PRECOND(in != NULL);
+	PRECOND(n <= ring->elm);
+
+	if (n == 0)
+		return (0);
+
+	if (ring->type == SIGNSKY_RING_SPSC)
+		return (ring_spsc_queue(ring, in, n));
+
+queue_again:
+	head = signsky_atomic_read_relaxed(&ring->producer.head);
+	tail = signsky_atomic_read_acquire(&ring->consumer.tail);
+
+	if ((count = ring->elm + (tail - head)) == 0)
+		return (0);
+
+	if (count > n)
+		count = n;
+
+	next = head + count;
+	if (!signsky_atomic_cas_relaxed(&ring->producer.head, &head, &next))
+		goto queue_again;
+
+	for (idx = 0; idx < count; idx++) {
+		slot = (head + idx) & ring->mask;
+		signsky_atomic_write_relaxed(&ring->data[slot],
+		    (uintptr_t)in[idx]);
+	}
+
+	while (signsky_atomic_read_acquire(&ring->producer.tail) != head)
+		signsky_cpu_pause();
+
+	signsky_atomic_write_release(&ring->producer.tail, next);
+	ring_wakeup(ring);
+
+	return (count);
+}
+
+/*
+ * Called by a consumer of the ring each time it went through its loop.
+ * If it did any work since the last call it resets *idle to 0.
+ *
+ * While idle for less than the configured spin budget we simply spin,
+ * after that we park on the ring its doorbell and, if not -1, the
+ * given fd until either becomes ready or RING_PARK_TIMEOUT passed.
+ */
+void
+signsky_ring_idle(struct signsky_ring *ring, int fd, u_int64_t *idle)
+{
+	u_int64_t	now;
+
+	PRECOND(ring != NULL);
+	PRECOND(ring->doorbell[0] != -1);
+	PRECOND(idle != NULL);
+
+	now = ring_time_us();
+
+	if (*idle == 0) {
+		*idle = now;
+		return;
+	}
+
+	if (now - *idle < signsky->spin) {
+		signsky_cpu_pause();
+		return;
+	}
+
+	ring_park(ring, fd);
+}
+
+/*
+ * Dequeue up to n items from a single-consumer ring. As we are the only
+ * consumer we own the consumer span and can move it without a CAS.
+ */
+static size_t
+ring_spsc_dequeue(struct signsky_ring *ring, void **out, size_t n)
+{
+	u_int32_t	idx, count, slot, head, tail;
+
+	PRECOND(ring != NULL);
+	PRECOND(ring->type == SIGNSKY_RING_SPSC);
+	PRECOND(out != NULL);
+
+	head = signsky_atomic_read_relaxed(&ring->consumer.head);
+	tail = signsky_atomic_read_acquire(&ring->producer.tail);
+
+	if ((count = tail - head) == 0)
+		return (0);
+
+	if (count > n)
+		count = n;
+
+	for (idx = 0; idx < count; idx++) {
+		slot = (head + idx) & ring->mask;
+		out[idx] = (void *)signsky_atomic_read_relaxed(
+		    &ring->data[slot]);
+	}
+
+	signsky_atomic_write_relaxed(&ring->consumer.head, head + count);
+	signsky_atomic_write_release(&ring->consumer.tail, head + count);
+
+	return (count);
+}
+
+/*
+ * Queue up to n items into a single-producer ring. As we are the only
+ * producer we own the producer span and can move it without a CAS.
+ */
+static size_t
+ring_spsc_queue(struct signsky_ring *ring, void **in, size_t n)
+{
+	u_int32_t	idx, count, slot, head, tail;
+
+	PRECOND(ring != NULL);
+	PRECOND(ring->type == SIGNSKY_RING_SPSC);
+	PRECOND(in != NULL);
+
+	head = signsky_atomic_read_relaxed(&ring->producer.head);
+	tail = signsky_atomic_read_acquire(&ring->consumer.tail);
+
+	if ((count = ring->elm + (tail - head)) == 0)
+		return (0);
+
+	if (count > n)
+		count = n;
+
+	for (idx = 0; idx < count; idx++) {
+		slot = (head + idx) & ring->mask;
+		signsky_atomic_write_relaxed(&ring->data[slot],
+		    (uintptr_t)in[idx]);
+	}
+
+	signsky_atomic_write_relaxed(&ring->producer.head, head + count);
+	signsky_atomic_write_release(&ring->producer.tail, head + count);
+	ring_wakeup(ring);
+
+	return (count);
+}
+
+/*
+ * Park the calling consumer on the ring doorbell and the given fd,
+ * unless something was queued onto the ring in the meantime.
+ */
+static void
+ring_park(struct signsky_ring *ring, int fd)
+{
+	nfds_t		nfd;
+	struct pollfd	pfd[2];
+
+	PRECOND(ring != NULL);
+
+	signsky_atomic_add(&ring->waiting, 1);
+	signsky_atomic_write_relaxed(&signsky_stats->parked, 1);
+	signsky_atomic_fence();
+
+	if (signsky_ring_pending(ring) == 0) {
+		pfd[0].fd = ring->doorbell[0];
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+
+		nfd = 1;
+
+		if (fd != -1) {
+			pfd[1].fd = fd;
+			pfd[1].events = POLLIN;
+			pfd[1].revents = 0;
+			nfd++;
+		}
+
+		if (poll(pfd, nfd, RING_PARK_TIMEOUT) == -1 && errno != EINTR)
+			fatal("poll: %s", errno_s);
+
+		if (pfd[0].revents & POLLIN)
+			signsky_platform_doorbell_drain(ring->doorbell[0]);
+	}
+
+	signsky_atomic_write_relaxed(&signsky_stats->parked, 0);
+	signsky_atomic_sub(&ring->waiting, 1);
+}
+
+/*
+ * Wake up any consumers parked on the ring after we queued items onto it.
+ * Rings without a doorbell (like the packet pool) never have any.
+ */
+static void
+ring_wakeup(struct signsky_ring *ring)
+{
+	PRECOND(ring != NULL);
+
+	if (ring->doorbell[1] == -1)
+		return;
+
+	signsky_atomic_fence();
+
+	if (signsky_atomic_read_relaxed(&ring->waiting) == 0)
+		return;
+
+	signsky_platform_doorbell_ring(ring->doorbell[1]);
+}
+
+/* Returns the current monotonic time in microseconds. */
+static u_int64_t
+ring_time_us(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (((u_int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000));
+}
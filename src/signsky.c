@@ -31,6 +31,8 @@ static void	usage(void) __attribute__((noreturn));
 static int			early = 1;
 volatile sig_atomic_t		sig_recv = -1;
 struct signsky_state		*signsky = NULL;
+struct signsky_proc_stats	*signsky_stats = NULL;
+struct signsky_peer_stats	*signsky_peer_stats = NULL;
 
 static void
 usage(void)
@@ -78,6 +80,7 @@ main(int argc, char *argv[])
 	signsky_signal_trap(SIGHUP);
 	signsky_signal_trap(SIGCHLD);
 	signsky_signal_trap(SIGQUIT);
+	signsky_signal_trap(SIGUSR1);
 
 	signsky_proc_init(argv);
 	signsky_packet_init();
@@ -94,7 +97,8 @@ main(int argc, char *argv[])
 	signsky_proc_title("overwatch");
 
 	running = 1;
-	syslog(LOG_INFO, "signsky started");
+	syslog(LOG_INFO, "signsky started (cipher=%s)",
+	    signsky_cipher_suite_name(signsky->cipher));
 
 	while (running) {
 		if ((sig = signsky_last_signal()) != -1) {
@@ -106,8 +110,11 @@ main(int argc, char *argv[])
 				running = 0;
 				continue;
 			case SIGCHLD:
-				running = 0;
-				signsky_proc_reap();
+				if (signsky_proc_reap())
+					running = 0;
+				continue;
+			case SIGUSR1:
+				signsky_proc_restart();
 				continue;
 			default:
 				break;
@@ -117,6 +124,10 @@ main(int argc, char *argv[])
 		(void)clock_gettime(CLOCK_MONOTONIC, &ts);
 		signsky_atomic_write(&signsky->uptime, ts.tv_sec);
 
+		signsky_proc_retire_check();
+		signsky_proc_sample();
+		signsky_packet_sample();
+
 		sleep(1);
 	}
 
@@ -166,6 +177,16 @@ signsky_last_signal(void)
 	return (sig);
 }
 
+/*
+ * Returns the signal that was received but not yet picked up with
+ * signsky_last_signal(), or -1. Lets long running loops break out early.
+ */
+int
+signsky_signal_pending(void)
+{
+	return (sig_recv);
+}
+
 /*
  * Bad juju happened.
  */
@@ -18,6 +18,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
 #include <err.h>
 #include <errno.h>
 #include <inttypes.h>
@@ -31,30 +34,39 @@
 #include "signsky_ctl.h"
 
 #define SKYCTL_CLIENT_SOCKET		"/tmp/skyctl.sock"
+#define SKYCTL_STATUS_SOCKET		"/tmp/signsky-status"
 
 static void	usage(void) __attribute__((noreturn));
 
 static int	skyctl_socket_local(const char *);
 static void	skyctl_socket_fill(struct sockaddr_un *, const char *);
 
-static void	skyctl_request_status(void);
+static void	skyctl_request_rings(void);
+static void	skyctl_request_stats(int, char **);
+static void	skyctl_request_status(int, char **);
 static void	skyctl_response(int, void *, size_t);
 static void	skyctl_request(int, const void *, size_t);
 static void	skyctl_dump_ifstat(const char *, struct signsky_ifstat *);
+static void	skyctl_dump_latency(const char *, u_int64_t *);
+static void	skyctl_dump_ns(const char *, u_int64_t);
 
 static const struct {
 	const char	*name;
-	void		(*cb)(void);
+	void		(*cb)(int, char **);
 } cmds[] = {
+	{ "stats",	skyctl_request_stats },
 	{ "status",	skyctl_request_status },
 	{ NULL,		NULL },
 };
 
+/* The status socket of the signsky instance we talk to. */
+static const char	*status_path = SKYCTL_STATUS_SOCKET;
+
 static void
 usage(void)
 {
-	printf("usage: skyctl [cmd]\n");
-	printf("possible cmd: status\n");
+	printf("usage: skyctl [-s status-socket] [cmd]\n");
+	printf("possible cmd: stats [--rings], status\n");
 	exit(1);
 }
 
@@ -63,12 +75,22 @@ main(int argc, char *argv[])
 {
 	int		idx;
 
-	if (argc != 2)
+	/*
+	 * Not getopt(), the GNU one would take the options of the
+	 * command for our own.
+	 */
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		status_path = argv[2];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc < 2)
 		usage();
 
 	for (idx = 0; cmds[idx].name != NULL; idx++) {
 		if (!strcmp(cmds[idx].name, argv[1])) {
-			cmds[idx].cb();
+			cmds[idx].cb(argc - 2, argv + 2);
 			break;
 		}
 	}
@@ -113,12 +135,19 @@ skyctl_socket_local(const char *path)
 }
 
 static void
-skyctl_request_status(void)
+skyctl_request_status(int argc, char **argv)
 {
 	int					fd;
+	u_int16_t				idx;
+	struct in_addr				in;
 	struct signsky_ctl_status		req;
 	struct signsky_ctl_status_response	resp;
 
+	(void)argv;
+
+	if (argc != 0)
+		usage();
+
 	fd = skyctl_socket_local("/tmp/skyctl-status");
 
 	memset(&req, 0, sizeof(req));
@@ -128,12 +157,182 @@ skyctl_request_status(void)
 	skyctl_request(fd, &req, sizeof(req));
 	skyctl_response(fd, &resp, sizeof(resp));
 
-	skyctl_dump_ifstat("tx", &resp.tx);
-	skyctl_dump_ifstat("rx", &resp.rx);
+	resp.cipher[sizeof(resp.cipher) - 1] = '\0';
+	printf("cipher           %s\n", resp.cipher);
+	printf("pool empty       %" PRIu64 "\n\n", resp.pool_empty);
+
+	if (resp.npeers > SIGNSKY_PEERS_MAX)
+		errx(1, "invalid number of peers (%u)", resp.npeers);
+
+	for (idx = 0; idx < resp.npeers; idx++) {
+		in.s_addr = resp.peers[idx].ip;
+		printf("peer %u           %s:%u\n", idx, inet_ntoa(in),
+		    ntohs(resp.peers[idx].port));
+
+		skyctl_dump_ifstat("tx", &resp.peers[idx].tx);
+		skyctl_dump_ifstat("rx", &resp.peers[idx].rx);
+	}
+
+	close(fd);
+}
+
+static void
+skyctl_request_stats(int argc, char **argv)
+{
+	int					fd;
+	u_int16_t				idx, bucket;
+	struct signsky_proc_stats		*st;
+	struct signsky_ctl_status		req;
+	struct signsky_ctl_stats_response	resp;
+	u_int64_t				tx[SIGNSKY_LATENCY_BUCKETS];
+	u_int64_t				rx[SIGNSKY_LATENCY_BUCKETS];
+
+	if (argc == 1 && !strcmp(argv[0], "--rings")) {
+		skyctl_request_rings();
+		return;
+	}
+
+	if (argc != 0)
+		usage();
+
+	fd = skyctl_socket_local("/tmp/skyctl-stats");
+
+	memset(&req, 0, sizeof(req));
+
+	req.cmd = SIGNSKY_CTL_STATS;
+
+	skyctl_request(fd, &req, sizeof(req));
+	skyctl_response(fd, &resp, sizeof(resp));
+
+	if (resp.nprocs > SIGNSKY_CTL_STATS_PROCS)
+		errx(1, "invalid number of processes (%u)", resp.nprocs);
+
+	memset(tx, 0, sizeof(tx));
+	memset(rx, 0, sizeof(rx));
+
+	printf("%-10s %7s %9s %9s %9s %9s %9s %9s\n", "process", "workers",
+	    "ring-full", "pool-empt", "tag-fail", "replay", "invalid",
+	    "emsgsize");
+
+	for (idx = 0; idx < resp.nprocs; idx++) {
+		st = &resp.procs[idx].stats;
+		resp.procs[idx].name[sizeof(resp.procs[idx].name) - 1] = '\0';
+
+		printf("%-10s %7u %9" PRIu64 " %9" PRIu64 " %9" PRIu64
+		    " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+		    resp.procs[idx].name, resp.procs[idx].workers,
+		    st->ring_full, st->pool_empty, st->tag_fail,
+		    st->replay, st->invalid, st->emsgsize);
+
+		for (bucket = 0; bucket < SIGNSKY_LATENCY_BUCKETS; bucket++) {
+			tx[bucket] += st->tx_latency[bucket];
+			rx[bucket] += st->rx_latency[bucket];
+		}
+	}
+
+	printf("\n%-20s %12s %9s %9s %9s\n",
+	    "latency", "packets", "p50", "p99", "p99.9");
+
+	skyctl_dump_latency("tx (clear->crypto)", tx);
+	skyctl_dump_latency("rx (crypto->clear)", rx);
+
+	close(fd);
+}
+
+static void
+skyctl_request_rings(void)
+{
+	int					fd, idx;
+	struct signsky_ring_stats		*st;
+	struct signsky_ctl_status		req;
+	struct signsky_ctl_rings_response	resp;
+	const char				*names[SIGNSKY_RING_MAX] = {
+		"clear", "crypto", "encrypt", "decrypt",
+		"pool-small", "pool-large"
+	};
+
+	fd = skyctl_socket_local("/tmp/skyctl-rings");
+
+	memset(&req, 0, sizeof(req));
+
+	req.cmd = SIGNSKY_CTL_RINGS;
+
+	skyctl_request(fd, &req, sizeof(req));
+	skyctl_response(fd, &resp, sizeof(resp));
+
+	printf("%-12s %6s %6s %6s %9s %12s\n",
+	    "ring", "size", "last", "high", "average", "samples");
+
+	for (idx = 0; idx < SIGNSKY_RING_MAX; idx++) {
+		st = &resp.rings[idx];
+
+		/* A pool that was not created is never sampled. */
+		if (st->samples == 0)
+			continue;
+
+		printf("%-12s %6u %6u %6u %9.2f %12" PRIu64 "\n",
+		    names[idx], st->size, st->last, st->high,
+		    (double)st->total / st->samples, st->samples);
+	}
 
 	close(fd);
 }
 
+static void
+skyctl_dump_latency(const char *name, u_int64_t *hist)
+{
+	u_int64_t	total, sum, want;
+	int		idx, bucket, pct;
+	const int	pcts[] = { 500, 990, 999 };
+
+	total = 0;
+	for (bucket = 0; bucket < SIGNSKY_LATENCY_BUCKETS; bucket++)
+		total += hist[bucket];
+
+	printf("%-20s %12" PRIu64, name, total);
+
+	for (pct = 0; pct < 3; pct++) {
+		if (total == 0) {
+			printf(" %9s", "-");
+			continue;
+		}
+
+		want = (total * pcts[pct] + 999) / 1000;
+		sum = 0;
+
+		for (idx = 0; idx < SIGNSKY_LATENCY_BUCKETS - 1; idx++) {
+			sum += hist[idx];
+			if (sum >= want)
+				break;
+		}
+
+		/* The last bucket also holds everything slower. */
+		if (idx == SIGNSKY_LATENCY_BUCKETS - 1)
+			skyctl_dump_ns(">", (u_int64_t)1 << (idx - 1));
+		else
+			skyctl_dump_ns("<", (u_int64_t)1 << idx);
+	}
+
+	printf("\n");
+}
+
+static void
+skyctl_dump_ns(const char *op, u_int64_t ns)
+{
+	char		buf[16];
+
+	if (ns < 1000) {
+		(void)snprintf(buf, sizeof(buf), "%s%" PRIu64 "ns", op, ns);
+	} else if (ns < 1000000) {
+		(void)snprintf(buf, sizeof(buf), "%s%.1fus", op, ns / 1000.0);
+	} else {
+		(void)snprintf(buf, sizeof(buf), "%s%.1fms",
+		    op, ns / 1000000.0);
+	}
+
+	printf(" %9s", buf);
+}
+
 static void
 skyctl_dump_ifstat(const char *name, struct signsky_ifstat *st)
 {
@@ -168,7 +367,7 @@ skyctl_request(int fd, const void *req, size_t len)
 	ssize_t			ret;
 	struct sockaddr_un	sun;
 
-	skyctl_socket_fill(&sun, "/tmp/signsky-status");
+	skyctl_socket_fill(&sun, status_path);
 
 	for (;;) {
 		if ((ret = sendto(fd, req, len, 0,
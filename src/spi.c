@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include "signsky.h"
+
+/* An entry that was removed, an SPI of 0 is never valid. */
+#define SPI_TOMBSTONE		0x00000000ffffffffULL
+
+/* Rebuild once this many entries in the active table are tombstones. */
+#define SPI_DEAD_MAX		(SIGNSKY_SPI_TABLE_SIZE / 4)
+
+#define SPI_ENTRY(s, p)		(((u_int64_t)(s) << 32) | (p))
+#define SPI_ENTRY_SPI(e)	((u_int32_t)((e) >> 32))
+#define SPI_ENTRY_PEER(e)	((u_int32_t)((e) & 0xffffffff))
+
+static u_int32_t	spi_hash(u_int32_t);
+static void		spi_rebuild(struct signsky_spi_table *);
+static int		spi_find(volatile u_int64_t *, u_int32_t, u_int64_t *);
+
+/*
+ * Lookup the peer for the given SPI, returns -1 if the SPI is unknown.
+ * This may be called from any process that has the table mapped.
+ */
+int
+signsky_spi_lookup(struct signsky_spi_table *tbl, u_int32_t spi,
+    u_int32_t *peer)
+{
+	u_int32_t	active;
+	u_int64_t	entry;
+
+	PRECOND(tbl != NULL);
+	PRECOND(peer != NULL);
+
+	if (spi == 0)
+		return (-1);
+
+	active = signsky_atomic_read_acquire(&tbl->active);
+
+	if (spi_find(tbl->slots[active & 1], spi, &entry) == -1)
+		return (-1);
+
+	*peer = SPI_ENTRY_PEER(entry);
+
+	return (0);
+}
+
+/*
+ * Add the given SPI for the given peer, if the SPI is already in
+ * the table its peer is updated. Only called from keying.
+ */
+void
+signsky_spi_insert(struct signsky_spi_table *tbl, u_int32_t spi,
+    u_int32_t peer)
+{
+	u_int64_t		entry;
+	u_int32_t		idx, n, slot;
+	volatile u_int64_t	*slots;
+
+	PRECOND(tbl != NULL);
+	PRECOND(spi != 0);
+	PRECOND(peer < SIGNSKY_PEERS_MAX);
+
+	slots = tbl->slots[tbl->active & 1];
+	slot = SIGNSKY_SPI_TABLE_SIZE;
+	idx = spi_hash(spi);
+
+	for (n = 0; n < SIGNSKY_SPI_TABLE_SIZE; n++) {
+		entry = slots[idx];
+
+		if (entry == 0) {
+			if (slot == SIGNSKY_SPI_TABLE_SIZE)
+				slot = idx;
+			break;
+		}
+
+		if (entry == SPI_TOMBSTONE) {
+			if (slot == SIGNSKY_SPI_TABLE_SIZE)
+				slot = idx;
+		} else if (SPI_ENTRY_SPI(entry) == spi) {
+			slot = idx;
+			break;
+		}
+
+		idx = (idx + 1) & SIGNSKY_SPI_TABLE_MASK;
+	}
+
+	if (slot == SIGNSKY_SPI_TABLE_SIZE)
+		fatal("%s: no room for spi 0x%08x", __func__, spi);
+
+	if (slots[slot] == SPI_TOMBSTONE)
+		tbl->dead--;
+
+	signsky_atomic_write_release(&slots[slot], SPI_ENTRY(spi, peer));
+}
+
+/*
+ * Remove the given SPI from the table. Only called from keying.
+ */
+void
+signsky_spi_remove(struct signsky_spi_table *tbl, u_int32_t spi)
+{
+	u_int64_t		entry;
+	u_int32_t		idx, n;
+	volatile u_int64_t	*slots;
+
+	PRECOND(tbl != NULL);
+
+	if (spi == 0)
+		return;
+
+	slots = tbl->slots[tbl->active & 1];
+	idx = spi_hash(spi);
+
+	for (n = 0; n < SIGNSKY_SPI_TABLE_SIZE; n++) {
+		entry = slots[idx];
+
+		if (entry == 0)
+			return;
+
+		if (entry != SPI_TOMBSTONE && SPI_ENTRY_SPI(entry) == spi) {
+			signsky_atomic_write_release(&slots[idx],
+			    SPI_TOMBSTONE);
+			tbl->dead++;
+			break;
+		}
+
+		idx = (idx + 1) & SIGNSKY_SPI_TABLE_MASK;
+	}
+
+	if (tbl->dead >= SPI_DEAD_MAX &&
+	    signsky->uptime - tbl->flipped >= SIGNSKY_SPI_TABLE_GRACE)
+		spi_rebuild(tbl);
+}
+
+/*
+ * Find the entry for the given SPI in the given slots, the probe
+ * stops at the first empty slot.
+ */
+static int
+spi_find(volatile u_int64_t *slots, u_int32_t spi, u_int64_t *out)
+{
+	u_int64_t	entry;
+	u_int32_t	idx, n;
+
+	PRECOND(slots != NULL);
+	PRECOND(out != NULL);
+
+	idx = spi_hash(spi);
+
+	for (n = 0; n < SIGNSKY_SPI_TABLE_SIZE; n++) {
+		entry = signsky_atomic_read_acquire(&slots[idx]);
+
+		if (entry == 0)
+			return (-1);
+
+		if (entry != SPI_TOMBSTONE && SPI_ENTRY_SPI(entry) == spi) {
+			*out = entry;
+			return (0);
+		}
+
+		idx = (idx + 1) & SIGNSKY_SPI_TABLE_MASK;
+	}
+
+	return (-1);
+}
+
+/*
+ * Copy all live entries of the active table into the other copy,
+ * without the tombstones, and make that copy the active one.
+ *
+ * Nobody looks at the other copy anymore: it was last active at least
+ * SIGNSKY_SPI_TABLE_GRACE seconds ago and a lookup takes nanoseconds.
+ */
+static void
+spi_rebuild(struct signsky_spi_table *tbl)
+{
+	u_int64_t		entry;
+	u_int32_t		idx, n, next;
+	volatile u_int64_t	*slots, *fresh;
+
+	PRECOND(tbl != NULL);
+
+	next = (tbl->active + 1) & 1;
+	slots = tbl->slots[tbl->active & 1];
+	fresh = tbl->slots[next];
+
+	for (idx = 0; idx < SIGNSKY_SPI_TABLE_SIZE; idx++)
+		fresh[idx] = 0;
+
+	for (idx = 0; idx < SIGNSKY_SPI_TABLE_SIZE; idx++) {
+		entry = slots[idx];
+		if (entry == 0 || entry == SPI_TOMBSTONE)
+			continue;
+
+		n = spi_hash(SPI_ENTRY_SPI(entry));
+		while (fresh[n] != 0)
+			n = (n + 1) & SIGNSKY_SPI_TABLE_MASK;
+
+		fresh[n] = entry;
+	}
+
+	signsky_atomic_write_release(&tbl->active, next);
+
+	tbl->dead = 0;
+	tbl->flipped = signsky->uptime;
+}
+
+/*
+ * Fibonacci hashing of the SPI onto a slot, SPIs are often handed
+ * out sequentially so they must be spread out.
+ */
+static u_int32_t
+spi_hash(u_int32_t spi)
+{
+	return ((spi * 2654435769U) >> (32 - SIGNSKY_SPI_TABLE_BITS));
+}
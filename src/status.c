@@ -28,6 +28,10 @@
 
 static void	status_handle_request(int);
 static void	status_request(int, struct sockaddr_un *);
+static void	status_stats(int, struct sockaddr_un *);
+static void	status_rings(int, struct sockaddr_un *);
+static void	status_stats_sum(u_int16_t, struct signsky_proc_stats *);
+static void	status_peer_sum(u_int16_t, u_int16_t, struct signsky_ifstat *);
 
 /*
  * The status process, handles incoming status requests.
@@ -72,6 +76,7 @@ signsky_status_entry(struct signsky_proc *proc)
 
 	}
 
+	signsky_packet_cache_flush();
 	syslog(LOG_NOTICE, "exiting");
 
 	exit(0);
@@ -110,6 +115,12 @@ status_handle_request(int fd)
 		case SIGNSKY_CTL_STATUS:
 			status_request(fd, &peer);
 			break;
+		case SIGNSKY_CTL_STATS:
+			status_stats(fd, &peer);
+			break;
+		case SIGNSKY_CTL_RINGS:
+			status_rings(fd, &peer);
+			break;
 		}
 
 		break;
@@ -122,6 +133,10 @@ status_handle_request(int fd)
 static void
 status_request(int fd, struct sockaddr_un *peer)
 {
+	u_int16_t				idx;
+	struct signsky_peer			*sp;
+	struct signsky_ctl_status_peer		*st;
+	struct signsky_proc_stats		stats;
 	struct signsky_ctl_status_response	resp;
 
 	PRECOND(fd >= 0);
@@ -129,17 +144,155 @@ status_request(int fd, struct sockaddr_un *peer)
 
 	memset(&resp, 0, sizeof(resp));
 
-	resp.tx.spi = signsky_atomic_read(&signsky->tx.spi);
-	resp.tx.pkt = signsky_atomic_read(&signsky->tx.pkt);
-	resp.tx.last = signsky_atomic_read(&signsky->tx.last);
-	resp.tx.bytes = signsky_atomic_read(&signsky->tx.bytes);
+	resp.npeers = signsky->npeers;
+
+	for (idx = 0; idx < signsky->npeers; idx++) {
+		sp = &signsky->peers[idx];
+		st = &resp.peers[idx];
+
+		st->ip = signsky_atomic_read(&sp->ip);
+		st->port = signsky_atomic_read(&sp->port);
+
+		st->tx.spi = signsky_atomic_read(&sp->tx_spi);
+		st->rx.spi = signsky_atomic_read(&sp->rx_spi);
+
+		status_peer_sum(SIGNSKY_PROC_CRYPTO, idx, &st->tx);
+		status_peer_sum(SIGNSKY_PROC_CLEAR, idx, &st->rx);
+	}
+
+	for (idx = 0; idx < SIGNSKY_PROC_MAX; idx++) {
+		status_stats_sum(idx, &stats);
+		resp.pool_empty += stats.pool_empty;
+	}
 
-	resp.rx.spi = signsky_atomic_read(&signsky->rx.spi);
-	resp.rx.pkt = signsky_atomic_read(&signsky->rx.pkt);
-	resp.rx.last = signsky_atomic_read(&signsky->rx.last);
-	resp.rx.bytes = signsky_atomic_read(&signsky->rx.bytes);
+	(void)snprintf(resp.cipher, sizeof(resp.cipher), "%s",
+	    signsky_cipher_suite_name(signsky->cipher));
 
 	if (sendto(fd, &resp, sizeof(resp), 0,
 	    (const struct sockaddr *)peer, sizeof(*peer)) == -1)
 		fatal("failed to send status to peer: %s", errno_s);
 }
+
+/*
+ * Send the counters of all process types to the client.
+ */
+static void
+status_stats(int fd, struct sockaddr_un *peer)
+{
+	u_int16_t				type;
+	struct signsky_ctl_stats_proc		*proc;
+	struct signsky_ctl_stats_response	resp;
+
+	PRECOND(fd >= 0);
+	PRECOND(peer != NULL);
+
+	memset(&resp, 0, sizeof(resp));
+
+	for (type = SIGNSKY_PROC_CLEAR; type < SIGNSKY_PROC_MAX; type++) {
+		if (resp.nprocs == SIGNSKY_CTL_STATS_PROCS)
+			break;
+
+		proc = &resp.procs[resp.nprocs++];
+		proc->workers = signsky->workers[type];
+
+		(void)snprintf(proc->name, sizeof(proc->name), "%s",
+		    signsky_proc_name(type));
+
+		status_stats_sum(type, &proc->stats);
+	}
+
+	if (sendto(fd, &resp, sizeof(resp), 0,
+	    (const struct sockaddr *)peer, sizeof(*peer)) == -1)
+		fatal("failed to send stats to peer: %s", errno_s);
+}
+
+/*
+ * Send the ring and pool occupancy as sampled by overwatch to the client.
+ */
+static void
+status_rings(int fd, struct sockaddr_un *peer)
+{
+	int					idx;
+	struct signsky_ring_stats		*st, *out;
+	struct signsky_ctl_rings_response	resp;
+
+	PRECOND(fd >= 0);
+	PRECOND(peer != NULL);
+
+	memset(&resp, 0, sizeof(resp));
+
+	for (idx = 0; idx < SIGNSKY_RING_MAX; idx++) {
+		st = &signsky->rings[idx];
+		out = &resp.rings[idx];
+
+		out->size = signsky_atomic_read_relaxed(&st->size);
+		out->last = signsky_atomic_read_relaxed(&st->last);
+		out->high = signsky_atomic_read_relaxed(&st->high);
+		out->total = signsky_atomic_read_relaxed(&st->total);
+		out->samples = signsky_atomic_read_relaxed(&st->samples);
+	}
+
+	if (sendto(fd, &resp, sizeof(resp), 0,
+	    (const struct sockaddr *)peer, sizeof(*peer)) == -1)
+		fatal("failed to send rings to peer: %s", errno_s);
+}
+
+/*
+ * Add up the counters of all workers of the given process type.
+ */
+static void
+status_stats_sum(u_int16_t type, struct signsky_proc_stats *out)
+{
+	u_int16_t			id, idx;
+	struct signsky_proc_stats	*st;
+
+	PRECOND(type < SIGNSKY_PROC_MAX);
+	PRECOND(out != NULL);
+
+	memset(out, 0, sizeof(*out));
+
+	for (id = 0; id < SIGNSKY_WORKERS_MAX; id++) {
+		st = &signsky->stats[type][id].proc;
+
+		out->ring_full += signsky_atomic_read_relaxed(&st->ring_full);
+		out->pool_empty += signsky_atomic_read_relaxed(&st->pool_empty);
+		out->tag_fail += signsky_atomic_read_relaxed(&st->tag_fail);
+		out->replay += signsky_atomic_read_relaxed(&st->replay);
+		out->invalid += signsky_atomic_read_relaxed(&st->invalid);
+		out->emsgsize += signsky_atomic_read_relaxed(&st->emsgsize);
+
+		for (idx = 0; idx < SIGNSKY_LATENCY_BUCKETS; idx++) {
+			out->tx_latency[idx] +=
+			    signsky_atomic_read_relaxed(&st->tx_latency[idx]);
+			out->rx_latency[idx] +=
+			    signsky_atomic_read_relaxed(&st->rx_latency[idx]);
+		}
+	}
+}
+
+/*
+ * Add up the traffic counters all workers of the given process type
+ * keep for the given peer, last is the most recent of them.
+ */
+static void
+status_peer_sum(u_int16_t type, u_int16_t peer, struct signsky_ifstat *out)
+{
+	u_int16_t			id;
+	u_int64_t			last;
+	struct signsky_peer_stats	*st;
+
+	PRECOND(type < SIGNSKY_PROC_MAX);
+	PRECOND(peer < SIGNSKY_PEERS_MAX);
+	PRECOND(out != NULL);
+
+	for (id = 0; id < SIGNSKY_WORKERS_MAX; id++) {
+		st = &signsky->stats[type][id].peers[peer];
+
+		out->pkt += signsky_atomic_read_relaxed(&st->pkt);
+		out->bytes += signsky_atomic_read_relaxed(&st->bytes);
+
+		last = signsky_atomic_read_relaxed(&st->last);
+		if (last > out->last)
+			out->last = last;
+	}
+}
@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <linux/io_uring.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "signsky.h"
+
+/*
+ * The io_uring engine for the clear and crypto processes, enabled with
+ * io-uring.
+ *
+ * Packets are received with a multishot read (tunnel) or recvmsg (socket)
+ * into a provided buffer ring holding packets straight from the packet
+ * pool. The kernel fills them in and tells us which one it used in the
+ * completion, which costs us no system call. The buffer ring is refilled
+ * from the pool as packets are taken off it.
+ *
+ * Writes are placed on the submission queue and handed to the kernel
+ * with a single io_uring_enter() per batch, the packet goes back to the
+ * pool when its completion comes in.
+ *
+ * When idle the process parks on the ring its fd, which is readable
+ * once completions are waiting.
+ *
+ * Kernels before 6.7 cannot do multishot reads, for the tunnel we keep
+ * a number of single reads outstanding there instead.
+ */
+
+#define URING_SQ_ENTRIES	256
+#define URING_CQ_ENTRIES	2048
+
+/* The number of pool packets held by the provided buffer ring. */
+#define URING_BUFFERS		128
+#define URING_BUFFERS_MASK	(URING_BUFFERS - 1)
+#define URING_BGID		0
+
+/* The number of single reads kept outstanding without multishot. */
+#define URING_READS		32
+
+/* The user_data of receive completions, writes carry their packet. */
+#define URING_RECV		0
+
+/* Multishot read is Linux 6.7 and newer, older headers lack it. */
+#define URING_OP_READ_MULTISHOT	49
+
+/* The number of opcodes we ask the kernel about. */
+#define URING_PROBE_OPS		64
+
+/* The submission queue, tail is ours until we publish it. */
+struct uring_sq {
+	volatile u_int32_t	*head;
+	volatile u_int32_t	*ktail;
+	u_int32_t		tail;
+	u_int32_t		mask;
+	u_int32_t		entries;
+	struct io_uring_sqe	*sqes;
+};
+
+/* The completion queue. */
+struct uring_cq {
+	volatile u_int32_t	*head;
+	volatile u_int32_t	*tail;
+	u_int32_t		mask;
+	struct io_uring_cqe	*cqes;
+};
+
+static void	uring_setup(void);
+static void	uring_buffers(void);
+static void	uring_probe(void);
+static void	uring_refill(void);
+static void	uring_arm(void);
+static void	uring_sent(struct io_uring_cqe *);
+static long	uring_enter(u_int32_t);
+
+static struct io_uring_sqe	*uring_sqe(void);
+static struct signsky_packet	*uring_received(struct io_uring_cqe *);
+
+/* The ring, the fd we do I/O on and for which process. */
+static int			uring_fd = -1;
+static int			uring_io = -1;
+static u_int16_t		uring_type = 0;
+static struct uring_sq		sq;
+static struct uring_cq		cq;
+
+/* The provided buffer ring and the packets that are on it. */
+static struct io_uring_buf_ring	*bufring = NULL;
+static u_int16_t		bufring_tail = 0;
+static struct signsky_packet	*bufs[URING_BUFFERS];
+static u_int16_t		bufs_free[URING_BUFFERS];
+static size_t			bufs_nfree = 0;
+
+/* The armed receives, how many we want and the opcode for reads. */
+static u_int32_t		armed = 0;
+static u_int32_t		arm = 1;
+static u_int8_t			read_op = URING_OP_READ_MULTISHOT;
+
+/* The msghdr for recvmsg, only its namelen is looked at. */
+static struct msghdr		recvmsg_hdr;
+
+/*
+ * Setup the io_uring engine for the given fd, which is the tunnel
+ * device in the clear process or the socket in the crypto process.
+ * Returns the ring its fd for the caller to park on.
+ *
+ * This is done before privileges are dropped, everything after only
+ * operates on the ring itself.
+ */
+int
+signsky_uring_init(int fd, u_int16_t type)
+{
+	PRECOND(fd >= 0);
+	PRECOND(type == SIGNSKY_PROC_CLEAR || type == SIGNSKY_PROC_CRYPTO);
+	PRECOND(signsky->flags & SIGNSKY_FLAG_IO_URING);
+
+	/* The layout multishot recvmsg() relies on, see signsky_packet. */
+	if (sizeof(struct io_uring_recvmsg_out) !=
+	    sizeof(((struct signsky_packet *)0)->uring) ||
+	    offsetof(struct signsky_packet, addr) !=
+	    offsetof(struct signsky_packet, uring) +
+	    sizeof(struct io_uring_recvmsg_out) ||
+	    offsetof(struct signsky_packet, buf) !=
+	    offsetof(struct signsky_packet, addr) + sizeof(struct sockaddr_in))
+		fatal("%s: unexpected signsky_packet layout", __func__);
+
+	uring_io = fd;
+	uring_type = type;
+
+	uring_setup();
+	uring_buffers();
+
+	if (uring_type == SIGNSKY_PROC_CLEAR) {
+		uring_probe();
+	} else {
+		memset(&recvmsg_hdr, 0, sizeof(recvmsg_hdr));
+		recvmsg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	uring_arm();
+	signsky_uring_submit();
+
+	return (uring_fd);
+}
+
+/*
+ * Reap up to max received packets from the completion queue, handling
+ * any write completions that are mixed in. The packets have their length
+ * and for the crypto process their source address set.
+ */
+size_t
+signsky_uring_recv(void **pkts, size_t max)
+{
+	u_int32_t		head, tail;
+	struct io_uring_cqe	*cqe;
+	struct signsky_packet	*pkt;
+	size_t			count;
+
+	PRECOND(pkts != NULL);
+	PRECOND(uring_fd != -1);
+
+	count = 0;
+	head = *cq.head;
+	tail = signsky_atomic_read_acquire(cq.tail);
+
+	while (head != tail && count < max) {
+		cqe = &cq.cqes[head & cq.mask];
+		head++;
+
+		if (cqe->user_data != URING_RECV) {
+			uring_sent(cqe);
+			continue;
+		}
+
+		if ((pkt = uring_received(cqe)) != NULL)
+			pkts[count++] = pkt;
+	}
+
+	signsky_atomic_write_release(cq.head, head);
+	uring_refill();
+
+	return (count);
+}
+
+/*
+ * Queue the given packet to be written to the tunnel device or sent
+ * to pkt->addr on the socket, it is handed to the kernel on the next
+ * signsky_uring_submit(). The packet is ours until it completes.
+ */
+void
+signsky_uring_send(struct signsky_packet *pkt)
+{
+	struct io_uring_sqe	*sqe;
+
+	PRECOND(pkt != NULL);
+	PRECOND(uring_fd != -1);
+
+	sqe = uring_sqe();
+	sqe->fd = uring_io;
+	sqe->user_data = (u_int64_t)(uintptr_t)pkt;
+
+	if (uring_type == SIGNSKY_PROC_CLEAR) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr = (u_int64_t)(uintptr_t)signsky_packet_data(pkt);
+		sqe->len = pkt->length;
+		sqe->off = (u_int64_t)-1;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (u_int64_t)(uintptr_t)signsky_packet_head(pkt);
+		sqe->len = pkt->length;
+		sqe->addr2 = (u_int64_t)(uintptr_t)&pkt->addr;
+		sqe->addr_len = sizeof(pkt->addr);
+	}
+}
+
+/*
+ * Rearm receives that ended and hand everything queued to the kernel.
+ */
+void
+signsky_uring_submit(void)
+{
+	u_int32_t	pending;
+
+	PRECOND(uring_fd != -1);
+
+	uring_arm();
+
+	if ((pending = sq.tail - signsky_atomic_read_acquire(sq.head)) == 0)
+		return;
+
+	signsky_atomic_write_release(sq.ktail, sq.tail);
+
+	while (uring_enter(pending) == -1) {
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EBUSY)
+			break;
+		fatal("%s: io_uring_enter: %s", __func__, errno_s);
+	}
+}
+
+/*
+ * Handle a receive completion, returns the packet it filled in if any.
+ */
+static struct signsky_packet *
+uring_received(struct io_uring_cqe *cqe)
+{
+	u_int16_t			bid;
+	struct io_uring_recvmsg_out	out;
+	struct signsky_packet		*pkt;
+
+	PRECOND(cqe != NULL);
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		armed--;
+
+	if (cqe->res < 0) {
+		switch (-cqe->res) {
+		case EINTR:
+		case EAGAIN:
+		case ENOBUFS:
+			return (NULL);
+		}
+
+		errno = -cqe->res;
+		fatal("%s: %s: %s", __func__,
+		    uring_type == SIGNSKY_PROC_CLEAR ? "read" : "recvmsg",
+		    errno_s);
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		fatal("%s: completion without a buffer", __func__);
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	if (bid >= URING_BUFFERS || (pkt = bufs[bid]) == NULL)
+		fatal("%s: invalid buffer %u", __func__, bid);
+
+	bufs[bid] = NULL;
+	bufs_free[bufs_nfree++] = bid;
+
+	if (uring_type == SIGNSKY_PROC_CLEAR) {
+		if (cqe->res == 0)
+			fatal("eof on tunnel interface");
+		pkt->length = cqe->res;
+		return (pkt);
+	}
+
+	memcpy(&out, pkt->uring, sizeof(out));
+
+	if ((out.flags & MSG_TRUNC) || out.namelen != sizeof(pkt->addr) ||
+	    out.payloadlen > pkt->size) {
+		if ((out.flags & MSG_TRUNC) &&
+		    pkt->class != SIGNSKY_PACKET_CLASS_LARGE)
+			signsky_packet_truncated();
+
+		pkt->length = pkt->size;
+		signsky_stat_add(invalid, 1);
+		signsky_packet_release(pkt);
+		return (NULL);
+	}
+
+	pkt->length = out.payloadlen;
+
+	return (pkt);
+}
+
+/*
+ * Handle a write completion, updating the peer its statistics and
+ * returning the packet to the pool.
+ */
+static void
+uring_sent(struct io_uring_cqe *cqe)
+{
+	struct signsky_packet	*pkt;
+
+	PRECOND(cqe != NULL);
+
+	pkt = (struct signsky_packet *)(uintptr_t)cqe->user_data;
+
+	if (cqe->res >= 0) {
+		signsky_stat_peer(pkt->peer, 1, pkt->length);
+		signsky_packet_release(pkt);
+		return;
+	}
+
+	switch (-cqe->res) {
+	case EIO:
+	case EINTR:
+	case EAGAIN:
+	case ENOBUFS:
+		break;
+	case EMSGSIZE:
+		syslog(LOG_INFO, "packet (size=%zu) too large for crypto, "
+		    "lower tunnel MTU", pkt->length);
+		signsky_stat_add(emsgsize, 1);
+		break;
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+		errno = -cqe->res;
+		syslog(LOG_INFO, "host %s unreachable (%s)",
+		    inet_ntoa(pkt->addr.sin_addr), errno_s);
+		break;
+	default:
+		errno = -cqe->res;
+		fatal("%s: %s: %s", __func__,
+		    uring_type == SIGNSKY_PROC_CLEAR ? "write" : "send",
+		    errno_s);
+	}
+
+	signsky_packet_release(pkt);
+}
+
+/*
+ * Keep the wanted number of receives armed, as long as the buffer
+ * ring is not empty, otherwise they end right away.
+ */
+static void
+uring_arm(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	while (armed < arm && bufs_nfree < URING_BUFFERS) {
+		sqe = uring_sqe();
+		sqe->fd = uring_io;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = URING_RECV;
+
+		if (uring_type == SIGNSKY_PROC_CLEAR) {
+			sqe->opcode = read_op;
+			sqe->off = (u_int64_t)-1;
+			if (read_op == IORING_OP_READ)
+				sqe->len = SIGNSKY_PACKET_DATA_LEN;
+		} else {
+			sqe->opcode = IORING_OP_RECVMSG;
+			sqe->addr = (u_int64_t)(uintptr_t)&recvmsg_hdr;
+			sqe->len = 1;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+		}
+
+		armed++;
+	}
+}
+
+/*
+ * Put as many packets from the pool onto the buffer ring as it has
+ * room for. The tunnel reads into the packet data, recvmsg() writes
+ * its header and the source address in front of the packet head.
+ * Each buffer is as long as its packet, which may be of any class.
+ */
+static void
+uring_refill(void)
+{
+	u_int16_t		bid;
+	struct io_uring_buf	*buf;
+	struct signsky_packet	*pkt;
+	u_int16_t		count;
+
+	count = 0;
+
+	while (bufs_nfree > 0) {
+		if ((pkt = signsky_packet_get()) == NULL)
+			break;
+
+		bid = bufs_free[--bufs_nfree];
+		bufs[bid] = pkt;
+
+		buf = &bufring->bufs[(bufring_tail + count) &
+		    URING_BUFFERS_MASK];
+		buf->bid = bid;
+
+		if (uring_type == SIGNSKY_PROC_CLEAR) {
+			buf->addr =
+			    (u_int64_t)(uintptr_t)signsky_packet_data(pkt);
+			buf->len = signsky_packet_room(pkt);
+		} else {
+			buf->addr = (u_int64_t)(uintptr_t)pkt->uring;
+			buf->len = sizeof(pkt->uring) + sizeof(pkt->addr) +
+			    pkt->size;
+		}
+
+		count++;
+	}
+
+	if (count > 0) {
+		bufring_tail += count;
+		signsky_atomic_write_release(&bufring->tail, bufring_tail);
+	}
+}
+
+/*
+ * Returns the next free submission queue entry, submitting what is
+ * queued first if the queue is full.
+ */
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+	struct io_uring_sqe	*sqe;
+
+	if (sq.tail - signsky_atomic_read_acquire(sq.head) == sq.entries) {
+		signsky_atomic_write_release(sq.ktail, sq.tail);
+		if (uring_enter(sq.entries) == -1 && errno != EINTR &&
+		    errno != EAGAIN && errno != EBUSY)
+			fatal("%s: io_uring_enter: %s", __func__, errno_s);
+
+		if (sq.tail - signsky_atomic_read_acquire(sq.head) ==
+		    sq.entries)
+			fatal("%s: submission queue stuck", __func__);
+	}
+
+	sqe = &sq.sqes[sq.tail & sq.mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq.tail++;
+
+	return (sqe);
+}
+
+/*
+ * Create the ring and map its queues.
+ */
+static void
+uring_setup(void)
+{
+	struct io_uring_params	params;
+	u_int8_t		*sqmap, *cqmap;
+	u_int32_t		idx, *array;
+	size_t			sqlen, cqlen;
+
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_CQ_ENTRIES;
+
+	if ((uring_fd = syscall(__NR_io_uring_setup,
+	    URING_SQ_ENTRIES, &params)) == -1)
+		fatal("%s: io_uring_setup: %s", __func__, errno_s);
+
+	sqlen = params.sq_off.array + params.sq_entries * sizeof(u_int32_t);
+	cqlen = params.cq_off.cqes +
+	    params.cq_entries * sizeof(struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen)
+			sqlen = cqlen;
+		cqlen = sqlen;
+	}
+
+	if ((sqmap = mmap(NULL, sqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring_fd,
+	    IORING_OFF_SQ_RING)) == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		cqmap = sqmap;
+	} else if ((cqmap = mmap(NULL, cqlen, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, uring_fd,
+	    IORING_OFF_CQ_RING)) == MAP_FAILED) {
+		fatal("%s: mmap: %s", __func__, errno_s);
+	}
+
+	if ((sq.sqes = mmap(NULL,
+	    params.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd,
+	    IORING_OFF_SQES)) == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	sq.head = (volatile u_int32_t *)(sqmap + params.sq_off.head);
+	sq.ktail = (volatile u_int32_t *)(sqmap + params.sq_off.tail);
+	sq.mask = *(u_int32_t *)(sqmap + params.sq_off.ring_mask);
+	sq.entries = params.sq_entries;
+	sq.tail = *sq.ktail;
+
+	/* Entry n of the submission queue always lives in sqes[n]. */
+	array = (u_int32_t *)(sqmap + params.sq_off.array);
+	for (idx = 0; idx < sq.entries; idx++)
+		array[idx] = idx;
+
+	cq.head = (volatile u_int32_t *)(cqmap + params.cq_off.head);
+	cq.tail = (volatile u_int32_t *)(cqmap + params.cq_off.tail);
+	cq.mask = *(u_int32_t *)(cqmap + params.cq_off.ring_mask);
+	cq.cqes = (struct io_uring_cqe *)(cqmap + params.cq_off.cqes);
+}
+
+/*
+ * Register the provided buffer ring and fill it with pool packets.
+ */
+static void
+uring_buffers(void)
+{
+	struct io_uring_buf_reg		reg;
+	u_int16_t			idx;
+
+	if ((bufring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	    -1, 0)) == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (u_int64_t)(uintptr_t)bufring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+
+	if (syscall(__NR_io_uring_register, uring_fd,
+	    IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		fatal("%s: IORING_REGISTER_PBUF_RING: %s", __func__, errno_s);
+
+	for (idx = 0; idx < URING_BUFFERS; idx++)
+		bufs_free[bufs_nfree++] = URING_BUFFERS - 1 - idx;
+
+	uring_refill();
+}
+
+/*
+ * Find out if the kernel can do multishot reads, if not we keep
+ * URING_READS single reads outstanding on the tunnel device.
+ */
+static void
+uring_probe(void)
+{
+	struct io_uring_probe	*probe;
+	size_t			len;
+
+	len = sizeof(*probe) + URING_PROBE_OPS * sizeof(probe->ops[0]);
+
+	if ((probe = calloc(1, len)) == NULL)
+		fatal("%s: calloc failed", __func__);
+
+	if (syscall(__NR_io_uring_register, uring_fd,
+	    IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == -1)
+		fatal("%s: IORING_REGISTER_PROBE: %s", __func__, errno_s);
+
+	if (probe->ops_len <= URING_OP_READ_MULTISHOT ||
+	    !(probe->ops[URING_OP_READ_MULTISHOT].flags &
+	    IO_URING_OP_SUPPORTED)) {
+		arm = URING_READS;
+		read_op = IORING_OP_READ;
+	}
+
+	free(probe);
+}
+
+static long
+uring_enter(u_int32_t count)
+{
+	return (syscall(__NR_io_uring_enter, uring_fd, count, 0, 0, NULL, 0));
+}
@@ -19,19 +19,35 @@
 #include <sys/stat.h>
 #include <sys/un.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
+
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "signsky.h"
 
+static void	utils_prefault(void *, size_t);
+
 /*
  * Install the key pending under the given `key` data structure into
  * the SA context `sa`.
+ *
+ * The new cipher context is fully set up before it replaces the old
+ * one in the SA. This is expensive (key expansion, GCM tables) so the
+ * workers only call this in between bursts, never with packets in hand.
  */
 int
 signsky_key_install(struct signsky_key *key, struct signsky_sa *sa)
 {
+	void		*cipher;
+
 	PRECOND(key != NULL);
 	PRECOND(sa != NULL);
 
@@ -42,13 +58,17 @@ signsky_key_install(struct signsky_key *key, struct signsky_sa *sa)
 	    SIGNSKY_KEY_PENDING, SIGNSKY_KEY_INSTALLING))
 		fatal("failed to swap key state to installing");
 
+	cipher = signsky_cipher_setup(key);
+
+	/* The key of the cipher being replaced is overwritten here. */
 	if (sa->cipher != NULL)
 		signsky_cipher_cleanup(sa->cipher);
 
-	sa->cipher = signsky_cipher_setup(key);
+	memcpy(sa->key, key->key, sizeof(sa->key));
 	signsky_mem_zero(key->key, sizeof(key->key));
 
 	sa->seqnr = 1;
+	sa->cipher = cipher;
 	sa->spi = signsky_atomic_read(&key->spi);
 
 	if (!signsky_atomic_cas_simple(&key->state,
@@ -58,6 +78,71 @@ signsky_key_install(struct signsky_key *key, struct signsky_sa *sa)
 	return (0);
 }
 
+/*
+ * Cleanup the cipher of the given SA and wipe the SA, including its key.
+ */
+void
+signsky_sa_clear(struct signsky_sa *sa)
+{
+	PRECOND(sa != NULL);
+
+	if (sa->cipher != NULL)
+		signsky_cipher_cleanup(sa->cipher);
+
+	signsky_mem_zero(sa, sizeof(*sa));
+}
+
+/*
+ * Place the given SA into a handoff slot for the next generation of
+ * workers, if it has no cipher the slot entry is left empty.
+ */
+void
+signsky_sa_export(struct signsky_sa *sa, struct signsky_sa *out)
+{
+	PRECOND(sa != NULL);
+	PRECOND(out != NULL);
+
+	memset(out, 0, sizeof(*out));
+
+	if (sa->cipher == NULL)
+		return;
+
+	out->spi = sa->spi;
+	out->salt = sa->salt;
+	out->seqnr = sa->seqnr;
+	memcpy(out->key, sa->key, sizeof(out->key));
+}
+
+/*
+ * Take over an SA from a handoff slot entry placed there by our
+ * predecessor and set up its cipher. The entry is cleared afterwards.
+ */
+void
+signsky_sa_import(struct signsky_sa *in, struct signsky_sa *sa)
+{
+	struct signsky_key	key;
+
+	PRECOND(in != NULL);
+	PRECOND(sa != NULL);
+	PRECOND(sa->cipher == NULL);
+
+	if (in->spi == 0)
+		return;
+
+	memset(&key, 0, sizeof(key));
+	key.spi = in->spi;
+	memcpy(key.key, in->key, sizeof(key.key));
+
+	sa->spi = in->spi;
+	sa->salt = in->salt;
+	sa->seqnr = in->seqnr;
+	sa->cipher = signsky_cipher_setup(&key);
+	memcpy(sa->key, in->key, sizeof(sa->key));
+
+	signsky_mem_zero(&key, sizeof(key));
+	signsky_mem_zero(in, sizeof(*in));
+}
+
 /*
  * Create a new UNIX socket at the given path, owned by the supplied
  * uid and gid and with 0700 permissions.
@@ -110,25 +195,54 @@ signsky_unix_socket(struct signsky_sun *cfg)
  * The shared memory segment is attached automatically after allocation
  * and returned to the caller.
  *
+ * Depending on the configuration large segments are backed by huge
+ * pages (Linux), the segment is locked into memory (Linux) and/or
+ * all of its pages are faulted in up front. Allocations made before
+ * the configuration is loaded are never affected.
+ *
  * Before returning the segment to the caller, it is marked for deletion
  * so that once the process exits the shared memory goes away.
  */
 void *
 signsky_alloc_shared(size_t len, int *key)
 {
-	int		tmp;
+	int		tmp, flags;
 	void		*ptr;
 
-	tmp = shmget(IPC_PRIVATE, len, IPC_CREAT | IPC_EXCL | 0700);
-	if (tmp == -1)
+	flags = IPC_CREAT | IPC_EXCL | 0700;
+
+#if defined(__linux__)
+	if (signsky != NULL && (signsky->flags & SIGNSKY_FLAG_HUGEPAGES) &&
+	    len >= SIGNSKY_HUGEPAGE_MIN)
+		flags |= SHM_HUGETLB;
+#endif
+
+	if ((tmp = shmget(IPC_PRIVATE, len, flags)) == -1) {
+#if defined(__linux__)
+		if (flags & SHM_HUGETLB) {
+			fatal("%s: shmget: %s (are huge pages reserved?)",
+			    __func__, errno_s);
+		}
+#endif
 		fatal("%s: shmget: %s", __func__, errno_s);
+	}
 
 	if ((ptr = shmat(tmp, NULL, 0)) == (void *)-1)
 		fatal("%s: shmat: %s", __func__, errno_s);
 
+#if defined(__linux__)
+	if (signsky != NULL && (signsky->flags & SIGNSKY_FLAG_MEM_LOCK)) {
+		if (shmctl(tmp, SHM_LOCK, NULL) == -1)
+			fatal("%s: shmctl(SHM_LOCK): %s", __func__, errno_s);
+	}
+#endif
+
 	if (shmctl(tmp, IPC_RMID, NULL) == -1)
 		fatal("%s: shmctl: %s", __func__, errno_s);
 
+	if (signsky != NULL && (signsky->flags & SIGNSKY_FLAG_MEM_PREFAULT))
+		utils_prefault(ptr, len);
+
 	if (key != NULL)
 		*key = tmp;
 
@@ -148,7 +262,9 @@ signsky_shm_detach(void *ptr)
 }
 
 /*
- * Poor mans memset() that isn't optimized away on the platforms I use it on.
+ * A memset() that isn't optimized away, in the same way explicit_bzero()
+ * does it: the libc memset() does the work (which is vectorised) and the
+ * empty asm statement tells the compiler the memory is still read after.
  *
  * If you build this on something and don't test that it actually clears the
  * contents of the data, thats on you. You probably want to do some binary
@@ -157,14 +273,113 @@ signsky_shm_detach(void *ptr)
 void
 signsky_mem_zero(void *ptr, size_t len)
 {
-	volatile char	*p;
-
 	PRECOND(ptr != NULL);
 	PRECOND(len > 0);
 
-	p = (volatile char *)ptr;
+	memset(ptr, 0, len);
+	__asm__ __volatile__("" : : "r"(ptr) : "memory");
+}
+
+/*
+ * Returns the current monotonic time in nanoseconds.
+ */
+u_int64_t
+signsky_time_ns(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Account for a packet that was read at `ts` and is done at `now` in
+ * the given latency histogram, which must belong to our own counters.
+ * Packets that were never stamped are ignored.
+ */
+void
+signsky_stat_latency(u_int64_t *hist, u_int64_t ts, u_int64_t now)
+{
+	u_int64_t	ns;
+	u_int32_t	bucket;
+
+	PRECOND(hist != NULL);
+
+	if (ts == 0 || now < ts)
+		return;
+
+	ns = now - ts;
+	bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+	if (bucket >= SIGNSKY_LATENCY_BUCKETS)
+		bucket = SIGNSKY_LATENCY_BUCKETS - 1;
+
+	signsky_atomic_write_relaxed(&hist[bucket], hist[bucket] + 1);
+}
+
+/*
+ * Returns 1 if the CPU has instructions for both AES and carry-less
+ * multiplication, which is what makes AES-GCM fast. Otherwise 0.
+ */
+int
+signsky_cpu_has_aes(void)
+{
+#if defined(__x86_64__)
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		return (0);
+
+	return ((ecx & bit_AES) && (ecx & bit_PCLMUL));
+#elif defined(__APPLE__)
+	/* All Apple arm64 cores have the crypto extensions. */
+	return (1);
+#elif defined(__linux__) && defined(__aarch64__)
+	unsigned long	hwcap;
+
+	hwcap = getauxval(AT_HWCAP);
 
-	while (len-- > 0)
-		*(p)++ = 0x00;
+	return ((hwcap & HWCAP_AES) && (hwcap & HWCAP_PMULL));
+#else
+	return (0);
+#endif
 }
 
+/*
+ * Returns the human readable name for the given cipher suite.
+ */
+const char *
+signsky_cipher_suite_name(u_int32_t suite)
+{
+	switch (suite) {
+	case SIGNSKY_CIPHER_AES_256_GCM:
+		return ("aes-256-gcm");
+	case SIGNSKY_CIPHER_CHACHA20_POLY1305:
+		return ("chacha20-poly1305");
+	}
+
+	return ("unknown");
+}
+
+/*
+ * Fault in all pages of the given region by writing to each of them,
+ * so the first packets after startup do not take page faults.
+ */
+static void
+utils_prefault(void *ptr, size_t len)
+{
+	long			pgsz;
+	size_t			off;
+	volatile u_int8_t	*p;
+
+	PRECOND(ptr != NULL);
+
+	if ((pgsz = sysconf(_SC_PAGESIZE)) <= 0)
+		fatal("%s: sysconf: %s", __func__, errno_s);
+
+	p = ptr;
+
+	for (off = 0; off < len; off += pgsz)
+		p[off] = 0;
+}
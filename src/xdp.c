@@ -0,0 +1,867 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "signsky.h"
+
+/*
+ * The AF_XDP backend for the crypto process, enabled with crypto-xdp.
+ *
+ * An XDP program is attached to the configured interface that redirects
+ * the UDP packets for our local port arriving on the configured queue
+ * to an AF_XDP socket, everything else goes to the kernel as usual.
+ * Outgoing packets get their ethernet, IP and UDP headers from us and
+ * are placed directly onto the transmit ring of the same socket.
+ *
+ * The UMEM is private to the crypto process and packets are copied once
+ * between it and the shared packet pool. A UMEM chunk can be a page at
+ * most while our packets are not page aligned and can be larger, so the
+ * pool itself cannot be handed to the kernel. Whether frames move
+ * between the NIC and the UMEM without a copy depends on the driver,
+ * we ask for zero-copy and fall back to copy mode.
+ *
+ * The first half of the UMEM frames belongs to the fill ring, the
+ * second half is used for transmitting.
+ */
+
+#define XDP_FRAME_SIZE		4096
+#define XDP_FRAME_COUNT		4096
+#define XDP_RING_SIZE		(XDP_FRAME_COUNT / 2)
+#define XDP_RING_MASK		(XDP_RING_SIZE - 1)
+
+/* The headers in front of our ESP packets, IPv4 without options. */
+#define XDP_IP_HDR_LEN		(sizeof(struct ip) + sizeof(struct udphdr))
+#define XDP_HDR_LEN		(ETHER_HDR_LEN + XDP_IP_HDR_LEN)
+
+/* The largest IP packet the kernel can place into a frame. */
+#define XDP_IP_MAX		\
+    (XDP_FRAME_SIZE - XDP_PACKET_HEADROOM - ETHER_HDR_LEN)
+
+/* The largest program we generate, in instructions. */
+#define XDP_PROG_MAX		32
+
+/* The size of the verifier log we print if loading fails. */
+#define XDP_PROG_LOG		8192
+
+/*
+ * One of the four rings shared with the kernel, we are the producer
+ * on the fill and tx rings and the consumer on the rx and completion
+ * rings.
+ */
+struct xdp_ring {
+	volatile u_int32_t	*producer;
+	volatile u_int32_t	*consumer;
+	volatile u_int32_t	*flags;
+	void			*ring;
+};
+
+static void	xdp_iface(const struct sockaddr_in *);
+static void	xdp_umem(void);
+static void	xdp_rings(void);
+static void	xdp_ring_map(struct xdp_ring *, struct xdp_ring_offset *,
+		    size_t, off_t);
+static void	xdp_bind(u_int32_t);
+static void	xdp_prog(u_int32_t);
+static int	xdp_prog_load(int, struct bpf_insn *, size_t);
+static void	xdp_prog_emit(struct bpf_insn *, size_t *, u_int8_t,
+		    u_int8_t, u_int8_t, int32_t);
+static void	xdp_complete(void);
+static void	xdp_wakeup(void);
+static long	xdp_bpf(int, union bpf_attr *);
+static u_int16_t	xdp_ip_csum(const void *, size_t);
+
+static struct signsky_packet	*xdp_packet(u_int8_t *, size_t);
+
+/* The AF_XDP socket, its UMEM and rings. */
+static int			xdp_fd = -1;
+static int			xdp_zerocopy = 0;
+static u_int8_t			*xdp_umem_area = NULL;
+static struct xdp_ring		xdp_rx;
+static struct xdp_ring		xdp_tx;
+static struct xdp_ring		xdp_fill;
+static struct xdp_ring		xdp_comp;
+
+/* The transmit frames that are free, and those placed but not yet sent. */
+static u_int64_t		xdp_free[XDP_RING_SIZE];
+static size_t			xdp_nfree = 0;
+static u_int32_t		xdp_queued = 0;
+
+/* Our own addresses and the interface its MTU. */
+static u_int8_t			xdp_mac[ETHER_ADDR_LEN];
+static struct sockaddr_in	xdp_local;
+static u_int32_t		xdp_mtu = 0;
+
+/* The XSKMAP and the link that keeps our program attached. */
+static int			xdp_map = -1;
+static int			xdp_link = -1;
+
+/*
+ * Setup the AF_XDP socket for the interface and queue selected with the
+ * crypto-xdp option and attach our program to the interface, packets for
+ * the given local address are steered to us from then on.
+ *
+ * This must be called before the crypto process drops its privileges,
+ * the program stays attached until the process exits. Returns the
+ * socket so the caller can poll on it.
+ */
+int
+signsky_xdp_init(const struct sockaddr_in *local)
+{
+	u_int32_t	ifindex;
+
+	PRECOND(local != NULL);
+	PRECOND(signsky->flags & SIGNSKY_FLAG_XDP);
+
+	if ((ifindex = if_nametoindex(signsky->xdp_ifname)) == 0) {
+		fatal("crypto-xdp: interface %s: %s",
+		    signsky->xdp_ifname, errno_s);
+	}
+
+	if ((xdp_fd = socket(AF_XDP, SOCK_RAW, 0)) == -1)
+		fatal("%s: socket: %s", __func__, errno_s);
+
+	xdp_iface(local);
+	xdp_umem();
+	xdp_rings();
+	xdp_bind(ifindex);
+	xdp_prog(ifindex);
+
+	syslog(LOG_NOTICE, "xdp on %s queue %u (%s)", signsky->xdp_ifname,
+	    signsky->xdp_queue, xdp_zerocopy ? "zero-copy" : "copy");
+
+	return (xdp_fd);
+}
+
+/*
+ * Move up to max packets from the rx ring into packets from the pool,
+ * their frames are given back to the kernel via the fill ring straight
+ * away. Returns the number of packets placed in pkts.
+ */
+size_t
+signsky_xdp_recv(void **pkts, size_t max)
+{
+	struct xdp_desc		*desc;
+	struct signsky_packet	*pkt;
+	u_int64_t		*fill;
+	u_int32_t		cons, prod, fprod;
+	size_t			idx, avail, count;
+
+	PRECOND(pkts != NULL);
+	PRECOND(xdp_fd != -1);
+
+	cons = *xdp_rx.consumer;
+	prod = signsky_atomic_read_acquire(xdp_rx.producer);
+
+	if ((avail = prod - cons) > max)
+		avail = max;
+
+	if (avail == 0)
+		return (0);
+
+	count = 0;
+	fill = xdp_fill.ring;
+	fprod = *xdp_fill.producer;
+
+	for (idx = 0; idx < avail; idx++) {
+		desc = &((struct xdp_desc *)xdp_rx.ring)[(cons + idx) &
+		    XDP_RING_MASK];
+
+		if (desc->len > XDP_FRAME_SIZE ||
+		    desc->addr > XDP_FRAME_SIZE * XDP_FRAME_COUNT -
+		    desc->len) {
+			fatal("%s: invalid descriptor", __func__);
+		}
+
+		if ((pkt = xdp_packet(&xdp_umem_area[desc->addr],
+		    desc->len)) != NULL)
+			pkts[count++] = pkt;
+
+		/* The fill ring holds all frames that are not on rx. */
+		fill[(fprod + idx) & XDP_RING_MASK] =
+		    desc->addr & ~((u_int64_t)XDP_FRAME_SIZE - 1);
+	}
+
+	signsky_atomic_write_release(xdp_fill.producer, fprod + avail);
+	signsky_atomic_write_release(xdp_rx.consumer, cons + avail);
+
+	if (*xdp_fill.flags & XDP_RING_NEED_WAKEUP)
+		xdp_wakeup();
+
+	return (count);
+}
+
+/*
+ * Place the given packet onto the tx ring towards the given address and
+ * ethernet address, the packet is copied so the caller keeps it. Returns
+ * -1 if the packet cannot be sent via XDP, the caller should send it via
+ * its socket instead.
+ *
+ * Packets are only handed to the kernel when signsky_xdp_flush() is called.
+ */
+int
+signsky_xdp_send(struct signsky_packet *pkt, const struct sockaddr_in *sin,
+    u_int64_t ether)
+{
+	struct ip		ip;
+	struct udphdr		udp;
+	struct ether_header	*eth;
+	struct xdp_desc		*desc;
+	u_int8_t		*frame;
+	u_int64_t		addr;
+
+	PRECOND(pkt != NULL);
+	PRECOND(sin != NULL);
+	PRECOND(xdp_fd != -1);
+
+	if (ether == 0 || pkt->length + XDP_IP_HDR_LEN > xdp_mtu)
+		return (-1);
+
+	if (xdp_nfree == 0)
+		xdp_complete();
+
+	if (xdp_nfree == 0)
+		return (-1);
+
+	addr = xdp_free[--xdp_nfree];
+	frame = &xdp_umem_area[addr];
+
+	eth = (struct ether_header *)frame;
+	memcpy(eth->ether_dhost, &ether, sizeof(eth->ether_dhost));
+	memcpy(eth->ether_shost, xdp_mac, sizeof(eth->ether_shost));
+	eth->ether_type = htons(ETHERTYPE_IP);
+
+	/* The IP header is not aligned in the frame, build it here. */
+	ip.ip_v = IPVERSION;
+	ip.ip_hl = sizeof(ip) >> 2;
+	ip.ip_tos = 0;
+	ip.ip_len = htons(pkt->length + XDP_IP_HDR_LEN);
+	ip.ip_id = 0;
+	ip.ip_off = htons(IP_DF);
+	ip.ip_ttl = IPDEFTTL;
+	ip.ip_p = IPPROTO_UDP;
+	ip.ip_sum = 0;
+	ip.ip_src = xdp_local.sin_addr;
+	ip.ip_dst = sin->sin_addr;
+	ip.ip_sum = xdp_ip_csum(&ip, sizeof(ip));
+
+	/* The UDP checksum is optional for IPv4, ESP protects the payload. */
+	udp.uh_sport = xdp_local.sin_port;
+	udp.uh_dport = sin->sin_port;
+	udp.uh_ulen = htons(pkt->length + sizeof(udp));
+	udp.uh_sum = 0;
+
+	memcpy(frame + ETHER_HDR_LEN, &ip, sizeof(ip));
+	memcpy(frame + ETHER_HDR_LEN + sizeof(ip), &udp, sizeof(udp));
+	memcpy(frame + XDP_HDR_LEN, signsky_packet_head(pkt), pkt->length);
+
+	desc = &((struct xdp_desc *)xdp_tx.ring)[(*xdp_tx.producer +
+	    xdp_queued) & XDP_RING_MASK];
+
+	desc->addr = addr;
+	desc->len = pkt->length + XDP_HDR_LEN;
+	desc->options = 0;
+
+	xdp_queued++;
+
+	return (0);
+}
+
+/*
+ * Hand all packets placed with signsky_xdp_send() to the kernel and
+ * reclaim the frames of packets it has sent.
+ */
+void
+signsky_xdp_flush(void)
+{
+	PRECOND(xdp_fd != -1);
+
+	if (xdp_queued > 0) {
+		signsky_atomic_write_release(xdp_tx.producer,
+		    *xdp_tx.producer + xdp_queued);
+		xdp_queued = 0;
+
+		/* In copy mode only a sendto() makes the kernel transmit. */
+		if (!xdp_zerocopy || (*xdp_tx.flags & XDP_RING_NEED_WAKEUP)) {
+			if (sendto(xdp_fd, NULL, 0, MSG_DONTWAIT,
+			    NULL, 0) == -1) {
+				if (errno != EAGAIN && errno != EBUSY &&
+				    errno != ENOBUFS && errno != ENETDOWN &&
+				    errno != EINTR)
+					fatal("%s: sendto: %s",
+					    __func__, errno_s);
+			}
+		}
+	}
+
+	xdp_complete();
+}
+
+/*
+ * Turn a frame from the rx ring into a packet for the decryption queue.
+ * The XDP program only steers IPv4 UDP packets for our port to us, but
+ * we check the headers regardless.
+ */
+static struct signsky_packet *
+xdp_packet(u_int8_t *frame, size_t len)
+{
+	size_t			hlen;
+	struct ip		ip;
+	struct udphdr		udp;
+	struct ether_header	*eth;
+	struct signsky_packet	*pkt;
+	u_int64_t		ether;
+
+	PRECOND(frame != NULL);
+
+	if (len < XDP_HDR_LEN)
+		goto invalid;
+
+	eth = (struct ether_header *)frame;
+	if (eth->ether_type != htons(ETHERTYPE_IP))
+		goto invalid;
+
+	/* The IP header is not aligned in the frame. */
+	memcpy(&ip, frame + ETHER_HDR_LEN, sizeof(ip));
+	hlen = ip.ip_hl << 2;
+
+	if (ip.ip_v != IPVERSION || hlen < sizeof(ip) ||
+	    ETHER_HDR_LEN + hlen + sizeof(udp) > len)
+		goto invalid;
+
+	frame += ETHER_HDR_LEN + hlen;
+	len -= ETHER_HDR_LEN + hlen;
+
+	memcpy(&udp, frame, sizeof(udp));
+
+	if (ntohs(udp.uh_ulen) < sizeof(udp) || ntohs(udp.uh_ulen) > len)
+		goto invalid;
+
+	len = ntohs(udp.uh_ulen) - sizeof(udp);
+
+	if (len > SIGNSKY_PACKET_MAX_LEN)
+		goto invalid;
+
+	/* A full sized packet its ciphertext is larger. */
+	if ((pkt = signsky_packet_get_len(len < SIGNSKY_PACKET_DATA_LEN ?
+	    len : SIGNSKY_PACKET_DATA_LEN)) == NULL)
+		return (NULL);
+
+	memcpy(signsky_packet_head(pkt), frame + sizeof(udp), len);
+
+	pkt->length = len;
+	pkt->addr.sin_family = AF_INET;
+	pkt->addr.sin_port = udp.uh_sport;
+	pkt->addr.sin_addr = ip.ip_src;
+
+	ether = 0;
+	memcpy(&ether, eth->ether_shost, sizeof(eth->ether_shost));
+	pkt->ether = ether;
+
+	return (pkt);
+
+invalid:
+	signsky_stat_add(invalid, 1);
+
+	return (NULL);
+}
+
+/*
+ * Find out the ethernet address and MTU of the interface and what
+ * address we send from, which is the interface its address if the
+ * local address is not bound to one.
+ */
+static void
+xdp_iface(const struct sockaddr_in *local)
+{
+	int			fd;
+	struct ifreq		ifr;
+	struct sockaddr_in	*sin;
+
+	PRECOND(local != NULL);
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		fatal("%s: socket: %s", __func__, errno_s);
+
+	memset(&ifr, 0, sizeof(ifr));
+	(void)snprintf(ifr.ifr_name, sizeof(ifr.ifr_name),
+	    "%s", signsky->xdp_ifname);
+
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) == -1)
+		fatal("%s: SIOCGIFHWADDR: %s", __func__, errno_s);
+
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+		fatal("crypto-xdp: %s is not ethernet", signsky->xdp_ifname);
+
+	memcpy(xdp_mac, ifr.ifr_hwaddr.sa_data, sizeof(xdp_mac));
+
+	if (ioctl(fd, SIOCGIFMTU, &ifr) == -1)
+		fatal("%s: SIOCGIFMTU: %s", __func__, errno_s);
+
+	xdp_mtu = ifr.ifr_mtu;
+	if (xdp_mtu > XDP_IP_MAX)
+		xdp_mtu = XDP_IP_MAX;
+
+	xdp_local = *local;
+
+	if (xdp_local.sin_addr.s_addr == INADDR_ANY) {
+		if (ioctl(fd, SIOCGIFADDR, &ifr) == -1) {
+			fatal("crypto-xdp: %s has no address: %s",
+			    signsky->xdp_ifname, errno_s);
+		}
+
+		sin = (struct sockaddr_in *)&ifr.ifr_addr;
+		xdp_local.sin_addr = sin->sin_addr;
+	}
+
+	(void)close(fd);
+}
+
+/*
+ * Allocate and register the UMEM, the frames are all ours until
+ * they are placed on the fill or tx ring.
+ */
+static void
+xdp_umem(void)
+{
+	struct xdp_umem_reg	reg;
+	size_t			idx, len;
+
+	len = XDP_FRAME_SIZE * XDP_FRAME_COUNT;
+
+	if ((xdp_umem_area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0)) == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	memset(&reg, 0, sizeof(reg));
+	reg.addr = (u_int64_t)(uintptr_t)xdp_umem_area;
+	reg.len = len;
+	reg.chunk_size = XDP_FRAME_SIZE;
+	reg.headroom = 0;
+
+	if (setsockopt(xdp_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1)
+		fatal("%s: XDP_UMEM_REG: %s", __func__, errno_s);
+
+	for (idx = XDP_RING_SIZE; idx < XDP_FRAME_COUNT; idx++)
+		xdp_free[xdp_nfree++] = idx * XDP_FRAME_SIZE;
+}
+
+/*
+ * Create and map the four rings, the fill ring gets all frames
+ * that are not used for transmitting.
+ */
+static void
+xdp_rings(void)
+{
+	u_int64_t		*fill;
+	struct xdp_mmap_offsets	off;
+	socklen_t		len;
+	u_int32_t		idx, size;
+
+	size = XDP_RING_SIZE;
+
+	if (setsockopt(xdp_fd, SOL_XDP, XDP_RX_RING,
+	    &size, sizeof(size)) == -1 ||
+	    setsockopt(xdp_fd, SOL_XDP, XDP_TX_RING,
+	    &size, sizeof(size)) == -1 ||
+	    setsockopt(xdp_fd, SOL_XDP, XDP_UMEM_FILL_RING,
+	    &size, sizeof(size)) == -1 ||
+	    setsockopt(xdp_fd, SOL_XDP, XDP_UMEM_COMPLETION_RING,
+	    &size, sizeof(size)) == -1)
+		fatal("%s: setsockopt: %s", __func__, errno_s);
+
+	len = sizeof(off);
+	if (getsockopt(xdp_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &len) == -1)
+		fatal("%s: XDP_MMAP_OFFSETS: %s", __func__, errno_s);
+
+	xdp_ring_map(&xdp_rx, &off.rx,
+	    sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+	xdp_ring_map(&xdp_tx, &off.tx,
+	    sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+	xdp_ring_map(&xdp_fill, &off.fr,
+	    sizeof(u_int64_t), XDP_UMEM_PGOFF_FILL_RING);
+	xdp_ring_map(&xdp_comp, &off.cr,
+	    sizeof(u_int64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+
+	fill = xdp_fill.ring;
+
+	for (idx = 0; idx < XDP_RING_SIZE; idx++)
+		fill[idx] = (u_int64_t)idx * XDP_FRAME_SIZE;
+
+	signsky_atomic_write_release(xdp_fill.producer, XDP_RING_SIZE);
+}
+
+/*
+ * Map one of the rings into our address space.
+ */
+static void
+xdp_ring_map(struct xdp_ring *ring, struct xdp_ring_offset *off,
+    size_t entry, off_t pgoff)
+{
+	u_int8_t	*map;
+
+	PRECOND(ring != NULL);
+	PRECOND(off != NULL);
+
+	if ((map = mmap(NULL, off->desc + XDP_RING_SIZE * entry,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	    xdp_fd, pgoff)) == MAP_FAILED)
+		fatal("%s: mmap: %s", __func__, errno_s);
+
+	ring->producer = (volatile u_int32_t *)(map + off->producer);
+	ring->consumer = (volatile u_int32_t *)(map + off->consumer);
+	ring->flags = (volatile u_int32_t *)(map + off->flags);
+	ring->ring = map + off->desc;
+}
+
+/*
+ * Bind the socket to the interface its queue, in zero-copy mode
+ * if the driver can do it.
+ */
+static void
+xdp_bind(u_int32_t ifindex)
+{
+	struct sockaddr_xdp	sxdp;
+
+	memset(&sxdp, 0, sizeof(sxdp));
+	sxdp.sxdp_family = AF_XDP;
+	sxdp.sxdp_ifindex = ifindex;
+	sxdp.sxdp_queue_id = signsky->xdp_queue;
+	sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+
+	if (bind(xdp_fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+		xdp_zerocopy = 1;
+		return;
+	}
+
+	sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+
+	if (bind(xdp_fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == -1) {
+		fatal("crypto-xdp: bind to %s queue %u: %s",
+		    signsky->xdp_ifname, signsky->xdp_queue, errno_s);
+	}
+}
+
+/*
+ * Generate and attach the XDP program, which in C would be:
+ *
+ *	if (IPv4 without options && UDP && !fragment &&
+ *	    ip_len <= XDP_IP_MAX && dport == port && dst == local)
+ *		return (bpf_redirect_map(&xskmap, rx_queue_index, XDP_PASS));
+ *	return (XDP_PASS);
+ *
+ * Packets that do not fit in a frame are left to the kernel, so they end
+ * up on our socket. The destination address is only checked if we are
+ * bound to one. The XSKMAP only holds our socket, so packets for us on
+ * other queues are also passed to the kernel.
+ *
+ * The program is attached via a BPF link, which the kernel removes once
+ * the crypto process exits.
+ */
+static void
+xdp_prog(u_int32_t ifindex)
+{
+	union bpf_attr		attr;
+	int			prog, fd;
+	size_t			idx, pass, n;
+	struct bpf_insn		insns[XDP_PROG_MAX];
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(u_int32_t);
+	attr.value_size = sizeof(u_int32_t);
+	attr.max_entries = signsky->xdp_queue + 1;
+
+	if ((xdp_map = xdp_bpf(BPF_MAP_CREATE, &attr)) == -1)
+		fatal("%s: BPF_MAP_CREATE: %s", __func__, errno_s);
+
+	fd = xdp_fd;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = xdp_map;
+	attr.key = (u_int64_t)(uintptr_t)&signsky->xdp_queue;
+	attr.value = (u_int64_t)(uintptr_t)&fd;
+
+	if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1)
+		fatal("%s: BPF_MAP_UPDATE_ELEM: %s", __func__, errno_s);
+
+	n = 0;
+	memset(insns, 0, sizeof(insns));
+
+	/* r6 = ctx, r2 = data, r3 = data_end. */
+	xdp_prog_emit(insns, &n, BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0);
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+	    offsetof(struct xdp_md, data));
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_W, 3, 6,
+	    offsetof(struct xdp_md, data_end));
+
+	/* if (data + XDP_HDR_LEN > data_end) pass */
+	xdp_prog_emit(insns, &n, BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0);
+	xdp_prog_emit(insns, &n, BPF_ALU64 | BPF_ADD | BPF_K, 4, 0,
+	    XDP_HDR_LEN);
+	xdp_prog_emit(insns, &n, BPF_JMP | BPF_JGT | BPF_X, 4, 3, 0);
+
+	/*
+	 * The loads below are in host byte order, comparing them against
+	 * values in network byte order compares the raw bytes.
+	 */
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_H, 5, 2,
+	    offsetof(struct ether_header, ether_type));
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JNE | BPF_K, 5, 0,
+	    htons(ETHERTYPE_IP));
+
+	/* Version 4 and a 20 byte header. */
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_B, 5, 2,
+	    ETHER_HDR_LEN);
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JNE | BPF_K, 5, 0, 0x45);
+
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_H, 5, 2,
+	    ETHER_HDR_LEN + offsetof(struct ip, ip_len));
+	xdp_prog_emit(insns, &n, BPF_ALU | BPF_END | BPF_TO_BE, 5, 0, 16);
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JGT | BPF_K, 5, 0,
+	    XDP_IP_MAX);
+
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_H, 5, 2,
+	    ETHER_HDR_LEN + offsetof(struct ip, ip_off));
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JSET | BPF_K, 5, 0,
+	    htons(IP_MF | IP_OFFMASK));
+
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_B, 5, 2,
+	    ETHER_HDR_LEN + offsetof(struct ip, ip_p));
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JNE | BPF_K, 5, 0,
+	    IPPROTO_UDP);
+
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_H, 5, 2,
+	    ETHER_HDR_LEN + sizeof(struct ip) +
+	    offsetof(struct udphdr, uh_dport));
+	xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JNE | BPF_K, 5, 0,
+	    signsky->local.sin_port);
+
+	if (signsky->local.sin_addr.s_addr != INADDR_ANY) {
+		xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_W, 5, 2,
+		    ETHER_HDR_LEN + offsetof(struct ip, ip_dst));
+		xdp_prog_emit(insns, &n, BPF_JMP32 | BPF_JNE | BPF_K, 5, 0,
+		    (int32_t)signsky->local.sin_addr.s_addr);
+	}
+
+	/* return (bpf_redirect_map(map, rx_queue_index, XDP_PASS)) */
+	xdp_prog_emit(insns, &n, BPF_LDX | BPF_MEM | BPF_W, 2, 6,
+	    offsetof(struct xdp_md, rx_queue_index));
+	xdp_prog_emit(insns, &n, BPF_LD | BPF_DW | BPF_IMM, 1,
+	    BPF_PSEUDO_MAP_FD, xdp_map);
+	xdp_prog_emit(insns, &n, 0, 0, 0, 0);
+	xdp_prog_emit(insns, &n, BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, XDP_PASS);
+	xdp_prog_emit(insns, &n, BPF_JMP | BPF_CALL, 0, 0,
+	    BPF_FUNC_redirect_map);
+	xdp_prog_emit(insns, &n, BPF_JMP | BPF_EXIT, 0, 0, 0);
+
+	/* pass: return (XDP_PASS) */
+	pass = n;
+	xdp_prog_emit(insns, &n, BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, XDP_PASS);
+	xdp_prog_emit(insns, &n, BPF_JMP | BPF_EXIT, 0, 0, 0);
+
+	/* All conditional jumps go to pass. */
+	for (idx = 0; idx < pass; idx++) {
+		switch (BPF_CLASS(insns[idx].code)) {
+		case BPF_JMP:
+		case BPF_JMP32:
+			if (BPF_OP(insns[idx].code) == BPF_CALL ||
+			    BPF_OP(insns[idx].code) == BPF_EXIT)
+				break;
+			insns[idx].off = pass - (idx + 1);
+			break;
+		}
+	}
+
+	if ((prog = xdp_prog_load(0, insns, n)) == -1)
+		prog = xdp_prog_load(1, insns, n);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.link_create.prog_fd = prog;
+	attr.link_create.target_ifindex = ifindex;
+	attr.link_create.attach_type = BPF_XDP;
+
+	if ((xdp_link = xdp_bpf(BPF_LINK_CREATE, &attr)) == -1) {
+		fatal("crypto-xdp: failed to attach to %s: %s",
+		    signsky->xdp_ifname, errno_s);
+	}
+
+	(void)close(prog);
+}
+
+/*
+ * Load the program, if verbose is set the verifier its log is
+ * printed and we do not return if it fails.
+ */
+static int
+xdp_prog_load(int verbose, struct bpf_insn *insns, size_t n)
+{
+	int			fd;
+	union bpf_attr		attr;
+	char			*log;
+
+	PRECOND(insns != NULL);
+
+	log = NULL;
+	memset(&attr, 0, sizeof(attr));
+
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = (u_int64_t)(uintptr_t)insns;
+	attr.insn_cnt = n;
+	attr.license = (u_int64_t)(uintptr_t)"ISC";
+
+	if (verbose) {
+		if ((log = calloc(1, XDP_PROG_LOG)) == NULL)
+			fatal("%s: calloc failed", __func__);
+
+		attr.log_buf = (u_int64_t)(uintptr_t)log;
+		attr.log_size = XDP_PROG_LOG;
+		attr.log_level = 1;
+	}
+
+	if ((fd = xdp_bpf(BPF_PROG_LOAD, &attr)) == -1 && verbose) {
+		fatal("crypto-xdp: failed to load program: %s\n%s",
+		    errno_s, log);
+	}
+
+	free(log);
+
+	return (fd);
+}
+
+/*
+ * Append a single instruction to the program.
+ */
+static void
+xdp_prog_emit(struct bpf_insn *insns, size_t *n, u_int8_t code,
+    u_int8_t dst, u_int8_t src, int32_t arg)
+{
+	struct bpf_insn		*insn;
+
+	PRECOND(insns != NULL);
+	PRECOND(n != NULL);
+	PRECOND(*n < XDP_PROG_MAX);
+
+	insn = &insns[(*n)++];
+	insn->code = code;
+	insn->dst_reg = dst;
+	insn->src_reg = src;
+
+	/* Loads and stores take arg as their offset. */
+	switch (BPF_CLASS(code)) {
+	case BPF_LDX:
+	case BPF_STX:
+		insn->off = arg;
+		break;
+	default:
+		insn->imm = arg;
+		break;
+	}
+}
+
+/*
+ * Move the frames of packets the kernel has sent back to the free list.
+ */
+static void
+xdp_complete(void)
+{
+	u_int64_t	*comp;
+	u_int32_t	cons, prod, idx;
+
+	cons = *xdp_comp.consumer;
+	prod = signsky_atomic_read_acquire(xdp_comp.producer);
+
+	if (prod == cons)
+		return;
+
+	comp = xdp_comp.ring;
+
+	for (idx = cons; idx != prod; idx++) {
+		if (xdp_nfree == XDP_RING_SIZE)
+			fatal("%s: too many completions", __func__);
+		xdp_free[xdp_nfree++] = comp[idx & XDP_RING_MASK];
+	}
+
+	signsky_atomic_write_release(xdp_comp.consumer, prod);
+}
+
+/*
+ * Tell the kernel it has new frames on the fill ring.
+ */
+static void
+xdp_wakeup(void)
+{
+	if (recvfrom(xdp_fd, NULL, 0, MSG_DONTWAIT, NULL, NULL) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EBUSY && errno != ENETDOWN && errno != EINTR)
+			fatal("%s: recvfrom: %s", __func__, errno_s);
+	}
+}
+
+static long
+xdp_bpf(int cmd, union bpf_attr *attr)
+{
+	PRECOND(attr != NULL);
+
+	return (syscall(SYS_bpf, cmd, attr, sizeof(*attr)));
+}
+
+/*
+ * The IPv4 header checksum.
+ */
+static u_int16_t
+xdp_ip_csum(const void *hdr, size_t len)
+{
+	u_int16_t		word;
+	u_int32_t		sum;
+	const u_int8_t		*ptr;
+
+	PRECOND(hdr != NULL);
+	PRECOND((len & 1) == 0);
+
+	sum = 0;
+	ptr = hdr;
+
+	while (len > 0) {
+		memcpy(&word, ptr, sizeof(word));
+		sum += word;
+		ptr += sizeof(word);
+		len -= sizeof(word);
+	}
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (~sum);
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Traffic generator and sink for test/bench.sh, you can ignore this.
+ *
+ * The sender blasts UDP packets of the given size (including the IP
+ * and UDP headers, so the size of the packet signsky reads from its
+ * tunnel interface) at the peer for the given amount of seconds, the
+ * receiver counts what makes it through the tunnel.
+ *
+ * It also installs keys, so the benchmark has no other dependencies.
+ *
+ *	bench send <ip> <port> <size> <seconds>
+ *	bench recv <ip> <port>
+ *	bench key <keying-socket> <tx-spi> <rx-spi>
+ */
+
+/* The IPv4 and UDP headers the kernel puts in front of our payload. */
+#define BENCH_HDR_LEN		28
+
+/* The maximum packet size, the jumbo size signsky supports. */
+#define BENCH_PACKET_MAX	9000
+
+/* The number of packets handed to the kernel per system call. */
+#define BENCH_BATCH		32
+
+/* The receiver stops once nothing arrives for this many seconds. */
+#define BENCH_IDLE		2
+
+static void	usage(void) __attribute__((noreturn));
+
+static u_int64_t	bench_time_us(void);
+static void		bench_send(int, char **);
+static void		bench_recv(int, char **);
+static void		bench_key(int, char **);
+static void		bench_addr(struct sockaddr_in *, const char *,
+			    const char *);
+
+static u_int8_t		buf[BENCH_BATCH][BENCH_PACKET_MAX];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: bench send <ip> <port> <size> <seconds>\n");
+	fprintf(stderr, "       bench recv <ip> <port>\n");
+	fprintf(stderr, "       bench key <socket> <tx-spi> <rx-spi>\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "send"))
+		bench_send(argc - 2, argv + 2);
+	else if (!strcmp(argv[1], "recv"))
+		bench_recv(argc - 2, argv + 2);
+	else if (!strcmp(argv[1], "key"))
+		bench_key(argc - 2, argv + 2);
+	else
+		usage();
+
+	return (0);
+}
+
+/*
+ * Send packets of the given size as fast as we can, prints the number
+ * of packets that the kernel accepted.
+ */
+static void
+bench_send(int argc, char **argv)
+{
+	struct sockaddr_in	sin;
+	int			fd, idx;
+	size_t			size, len;
+	u_int64_t		end, sent;
+#if defined(__linux__)
+	int			ret;
+	struct iovec		iov[BENCH_BATCH];
+	struct mmsghdr		msg[BENCH_BATCH];
+#endif
+
+	if (argc != 4)
+		usage();
+
+	bench_addr(&sin, argv[0], argv[1]);
+
+	size = strtoul(argv[2], NULL, 10);
+	if (size <= BENCH_HDR_LEN || size > BENCH_PACKET_MAX)
+		errx(1, "invalid packet size %s", argv[2]);
+
+	len = size - BENCH_HDR_LEN;
+	end = bench_time_us() + strtoul(argv[3], NULL, 10) * 1000000;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+
+	if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "connect");
+
+	for (idx = 0; idx < BENCH_BATCH; idx++)
+		memset(buf[idx], idx, len);
+
+#if defined(__linux__)
+	memset(msg, 0, sizeof(msg));
+
+	for (idx = 0; idx < BENCH_BATCH; idx++) {
+		iov[idx].iov_base = buf[idx];
+		iov[idx].iov_len = len;
+		msg[idx].msg_hdr.msg_iov = &iov[idx];
+		msg[idx].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+
+	sent = 0;
+
+	while (bench_time_us() < end) {
+#if defined(__linux__)
+		if ((ret = sendmmsg(fd, msg, BENCH_BATCH, 0)) == -1) {
+			if (errno == EINTR || errno == ENOBUFS ||
+			    errno == ECONNREFUSED)
+				continue;
+			err(1, "sendmmsg");
+		}
+		sent += ret;
+#else
+		for (idx = 0; idx < BENCH_BATCH; idx++) {
+			if (send(fd, buf[idx], len, 0) == -1) {
+				if (errno == EINTR || errno == ENOBUFS ||
+				    errno == ECONNREFUSED)
+					continue;
+				err(1, "send");
+			}
+			sent++;
+		}
+#endif
+	}
+
+	printf("%" PRIu64 "\n", sent);
+	close(fd);
+}
+
+/*
+ * Count the packets that arrive until the sender is done (or nothing
+ * arrives at all), prints the number of packets, bytes (including the
+ * headers) and microseconds between the first and the last packet.
+ */
+static void
+bench_recv(int argc, char **argv)
+{
+	ssize_t			ret;
+	struct timeval		tv;
+	struct sockaddr_in	sin;
+	int			fd, val;
+	u_int64_t		pkts, bytes, first, last;
+
+	if (argc != 2)
+		usage();
+
+	bench_addr(&sin, argv[0], argv[1]);
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+
+	val = 8 * 1024 * 1024;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	tv.tv_sec = BENCH_IDLE;
+	tv.tv_usec = 0;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1)
+		err(1, "setsockopt");
+
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "bind");
+
+	pkts = 0;
+	bytes = 0;
+	first = 0;
+	last = 0;
+
+	for (;;) {
+		if ((ret = recv(fd, buf[0], sizeof(buf[0]), 0)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				err(1, "recv");
+			break;
+		}
+
+		last = bench_time_us();
+
+		if (first == 0)
+			first = last;
+
+		pkts++;
+		bytes += ret + BENCH_HDR_LEN;
+	}
+
+	printf("%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+	    pkts, bytes, last - first);
+	close(fd);
+}
+
+/*
+ * Install a key on the given keying socket, both sides use the same
+ * key and swap the SPIs.
+ */
+static void
+bench_key(int argc, char **argv)
+{
+	int			fd;
+	u_int8_t		req[40];
+	u_int32_t		spi;
+	struct sockaddr_un	sun;
+
+	if (argc != 3)
+		usage();
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+
+	if (strlen(argv[0]) >= sizeof(sun.sun_path))
+		errx(1, "socket path '%s' too long", argv[0]);
+	(void)strcpy(sun.sun_path, argv[0]);
+
+	memset(req, 0x42, sizeof(req));
+
+	spi = strtoul(argv[1], NULL, 16);
+	memcpy(&req[0], &spi, sizeof(spi));
+
+	spi = strtoul(argv[2], NULL, 16);
+	memcpy(&req[4], &spi, sizeof(spi));
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1)
+		err(1, "socket");
+
+	if (sendto(fd, req, sizeof(req), 0,
+	    (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "sendto");
+
+	close(fd);
+}
+
+static void
+bench_addr(struct sockaddr_in *sin, const char *ip, const char *port)
+{
+	memset(sin, 0, sizeof(*sin));
+
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(strtoul(port, NULL, 10));
+
+	if (inet_pton(AF_INET, ip, &sin->sin_addr) != 1)
+		errx(1, "invalid address '%s'", ip);
+}
+
+static u_int64_t
+bench_time_us(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
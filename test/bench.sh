@@ -0,0 +1,222 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the signsky pipeline, run it via "make bench".
+#
+# Two signsky instances are started in their own network namespace,
+# connected by a veth pair. test/bench.c sends UDP packets of each size
+# through the tunnel of the first instance and counts what comes out of
+# the tunnel of the second one.
+#
+# For each cipher and packet size it reports the packets and Gbps that
+# made it through, the CPU used per process over the run and the
+# tx (clear->crypto, on the sender) and rx (crypto->clear, on the
+# receiver) latency percentiles from skyctl stats.
+#
+# Both instances are restarted for every run so the counters start at 0.
+# This needs root and Linux. The following can be set in the environment:
+#
+#	BENCH_TIME	seconds to send per run (5)
+#	BENCH_SIZES	packet sizes, including IP header (64 512 1400 9000)
+#	BENCH_CIPHERS	backends to build (openssl-aes-gcm intel-aes-gcm)
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+TIME=${BENCH_TIME:-5}
+SIZES=${BENCH_SIZES:-"64 512 1400 9000"}
+CIPHERS=${BENCH_CIPHERS:-"openssl-aes-gcm intel-aes-gcm"}
+
+CC=${CC:-cc}
+MAKE=${MAKE:-make}
+OUT=test/obj
+TMP=/tmp/signsky-bench
+HZ=$(getconf CLK_TCK)
+
+if [ "$(uname -s)" != "Linux" ]; then
+	echo "bench: only supported on Linux" >&2
+	exit 1
+fi
+
+if [ "$(id -u)" != "0" ]; then
+	echo "bench: must be run as root" >&2
+	exit 1
+fi
+
+bench_stop() {
+	for n in a b; do
+		ip netns pids signsky-bench-$n 2>/dev/null | \
+		    xargs -r kill -QUIT 2>/dev/null || true
+	done
+
+	sleep 1
+
+	for n in a b; do
+		ip netns pids signsky-bench-$n 2>/dev/null | \
+		    xargs -r kill -9 2>/dev/null || true
+	done
+}
+
+bench_cleanup() {
+	bench_stop
+	ip netns del signsky-bench-a 2>/dev/null || true
+	ip netns del signsky-bench-b 2>/dev/null || true
+}
+
+bench_netns() {
+	ip netns add signsky-bench-a
+	ip netns add signsky-bench-b
+
+	ip link add bench-a netns signsky-bench-a type veth \
+	    peer name bench-b netns signsky-bench-b
+
+	ip -n signsky-bench-a addr add 10.198.0.1/24 dev bench-a
+	ip -n signsky-bench-b addr add 10.198.0.2/24 dev bench-b
+
+	for n in a b; do
+		ip -n signsky-bench-$n link set bench-$n mtu 9216 up
+		ip -n signsky-bench-$n link set lo up
+	done
+}
+
+# bench_start <binary>
+bench_start() {
+	for n in a b; do
+		if [ $n = a ]; then
+			me=10.198.0.1 peer=10.198.0.2
+		else
+			me=10.198.0.2 peer=10.198.0.1
+		fi
+
+		cat > $TMP-$n.conf <<EOF
+peer $peer:2323
+local $me:2323
+instance bench-$n
+run clear as nobody
+run crypto as nobody
+run encrypt as nobody
+run decrypt as nobody
+run keying as nobody
+run status as root
+keying $TMP-$n-keying nobody
+status $TMP-$n-status root
+EOF
+
+		ip netns exec signsky-bench-$n $1 -c $TMP-$n.conf \
+		    > $TMP-$n.log 2>&1 &
+	done
+
+	sleep 1
+
+	for n in a b; do
+		if [ $n = a ]; then
+			$OUT/bench key $TMP-$n-keying 0x100 0x200
+		else
+			$OUT/bench key $TMP-$n-keying 0x200 0x100
+		fi
+	done
+
+	ip -n signsky-bench-a addr add 10.199.0.1/24 dev signsky.clr
+	ip -n signsky-bench-b addr add 10.199.0.2/24 dev signsky.clr
+
+	for n in a b; do
+		ip -n signsky-bench-$n link set signsky.clr mtu 9000 up
+	done
+
+	sleep 1
+}
+
+# bench_cpu <output>, the cpu ticks used so far per process.
+bench_cpu() {
+	for n in a b; do
+		for pid in $(ip netns pids signsky-bench-$n); do
+			name=$(tr '\0' ' ' < /proc/$pid/cmdline | \
+			    sed -n 's/.*\[\(.*\)\].*/\1/p')
+			[ -n "$name" ] || continue
+			ticks=$(awk '{ print $14 + $15 }' /proc/$pid/stat)
+			echo "$n $name $ticks"
+		done
+	done > $1
+}
+
+# bench_latency <instance> <tx|rx>, prints p50 p99 p99.9.
+bench_latency() {
+	./skyctl/skyctl -s $TMP-$1-status stats | \
+	    awk -v dir=$2 '$1 == dir && $2 ~ /^\(/ { print $4, $5, $6 }'
+}
+
+# bench_run <size>
+bench_run() {
+	bench_cpu $TMP-cpu-before
+
+	ip netns exec signsky-bench-b $OUT/bench recv 10.199.0.2 5555 \
+	    > $TMP-recv &
+	recv=$!
+
+	sleep 0.2
+
+	ip netns exec signsky-bench-a $OUT/bench send 10.199.0.2 5555 \
+	    $1 $TIME > $TMP-send
+
+	wait $recv
+
+	bench_cpu $TMP-cpu-after
+
+	read pkts bytes usecs < $TMP-recv
+	[ "$usecs" -gt 0 ] || usecs=1
+
+	printf "%-6s %10s %8s %9s %9s %9s %9s %9s %9s\n" $1 \
+	    $(awk "BEGIN { printf \"%d\", $pkts * 1000000 / $usecs }") \
+	    $(awk "BEGIN { printf \"%.3f\", $bytes * 8 / $usecs / 1000 }") \
+	    $(bench_latency a tx) $(bench_latency b rx)
+
+	awk -v hz=$HZ -v secs=$TIME '
+	    FNR == NR { before[$1 " " $2] += $3; next }
+	    { after[$1 " " $2] += $3 }
+	    END {
+		n = split("clear crypto encrypt decrypt keying status", procs)
+		for (i = 1; i <= 2; i++) {
+			side = i == 1 ? "a" : "b"
+			printf "       cpu %s", side
+			for (j = 1; j <= n; j++) {
+				p = side " " procs[j]
+				printf " %s=%d%%", procs[j],
+				    (after[p] - before[p]) * 100 / (hz * secs)
+			}
+			printf "\n"
+		}
+	    }' $TMP-cpu-before $TMP-cpu-after
+}
+
+trap bench_cleanup EXIT INT TERM
+
+mkdir -p $OUT
+$CC -O2 -Wall -D_GNU_SOURCE -o $OUT/bench test/bench.c
+$MAKE -s -C skyctl
+
+bench_cleanup
+bench_netns
+
+for cipher in $CIPHERS; do
+	if [ $cipher = intel-aes-gcm ] && \
+	    ! pkg-config --exists libisal_crypto; then
+		echo "$cipher: skipped, libisal_crypto not found"
+		echo
+		continue
+	fi
+
+	bin=$OUT/signsky-$cipher
+	$MAKE -s CIPHER=$cipher HPERF=1 OBJDIR=$OUT/obj-$cipher BIN=$bin $bin
+
+	echo "$cipher"
+	printf "%-6s %10s %8s %9s %9s %9s %9s %9s %9s\n" "size" "pps" "Gbps" \
+	    "tx-p50" "tx-p99" "tx-p99.9" "rx-p50" "rx-p99" "rx-p99.9"
+
+	for size in $SIZES; do
+		bench_start $bin
+		bench_run $size
+		bench_stop
+	done
+
+	echo
+done
@@ -0,0 +1,338 @@
+/*
+ * Copyright (c) 2023 Joris Vink <joris@coders.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "signsky.h"
+
+/*
+ * Micro benchmark for the cipher backend it is linked against, you
+ * can ignore this.
+ *
+ * For every suite the backend supports it measures what a setup and
+ * cleanup of a cipher context costs (which is what a rekey costs) and
+ * how long signsky_cipher_encrypt_batch() and decrypt_batch() take for
+ * different packet and batch sizes.
+ *
+ * Decryption runs over the same packets over and over, after the first
+ * round their tags no longer verify but the backends do all the work
+ * before comparing the tag, so the cost is the same.
+ *
+ * Cycles come from the TSC and are only reported on x86.
+ *
+ * Build and run it for every backend with "make bench-cipher".
+ */
+
+/* The packet sizes and batch sizes that are measured by default. */
+static const size_t	sizes[] = { 64, 512, 1400, 9000 };
+static const size_t	batches[] = { 1, 8, 32, SIGNSKY_PACKETS_PER_EVENT };
+
+#define NELEM(x)	(sizeof(x) / sizeof((x)[0]))
+
+/* The number of context setups timed for the setup cost. */
+#define CIPHER_SETUP_ROUNDS	10000
+
+static void	usage(void) __attribute__((noreturn));
+
+static u_int64_t	cipher_cycles(void);
+static u_int64_t	cipher_time_ns(void);
+static void		cipher_bench(u_int32_t);
+static void		cipher_bench_setup(struct signsky_key *);
+static void		cipher_bench_size(void *, size_t);
+static void		cipher_bench_run(void *, size_t, size_t, int);
+static void		cipher_selftest(void *);
+
+struct signsky_state		*signsky = NULL;
+static struct signsky_proc_stats	stats;
+struct signsky_proc_stats	*signsky_stats = &stats;
+
+static u_int64_t		runtime = 200;
+static size_t			only_size = 0;
+static size_t			only_batch = 0;
+static struct signsky_packet	*pkts[SIGNSKY_PACKETS_PER_EVENT];
+static struct signsky_cipher_op	ops[SIGNSKY_PACKETS_PER_EVENT];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: cipher [-b batch] [-s size] [-t msec]\n");
+	exit(1);
+}
+
+void
+fatal(const char *fmt, ...)
+{
+	va_list		args;
+
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	printf("\n");
+	va_end(args);
+
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int		ch;
+	size_t		idx;
+	u_int32_t	suite;
+
+	while ((ch = getopt(argc, argv, "b:s:t:")) != -1) {
+		switch (ch) {
+		case 'b':
+			only_batch = strtoul(optarg, NULL, 10);
+			if (only_batch == 0 ||
+			    only_batch > SIGNSKY_PACKETS_PER_EVENT)
+				errx(1, "batch must be 1-%d",
+				    SIGNSKY_PACKETS_PER_EVENT);
+			break;
+		case 's':
+			only_size = strtoul(optarg, NULL, 10);
+			if (only_size == 0 ||
+			    only_size > SIGNSKY_PACKET_DATA_LEN)
+				errx(1, "size must be 1-%d",
+				    SIGNSKY_PACKET_DATA_LEN);
+			break;
+		case 't':
+			runtime = strtoull(optarg, NULL, 10);
+			if (runtime == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if ((signsky = calloc(1, sizeof(*signsky))) == NULL)
+		err(1, "calloc");
+
+	for (idx = 0; idx < SIGNSKY_PACKETS_PER_EVENT; idx++) {
+		pkts[idx] = calloc(1, sizeof(struct signsky_packet) +
+		    SIGNSKY_PACKET_MAX_LEN);
+		if (pkts[idx] == NULL)
+			err(1, "calloc");
+
+		pkts[idx]->size = SIGNSKY_PACKET_MAX_LEN;
+		ops[idx].pkt = pkts[idx];
+
+		memset(ops[idx].nonce, (int)idx, sizeof(ops[idx].nonce));
+		memset(ops[idx].aad, (int)idx, sizeof(ops[idx].aad));
+	}
+
+	for (suite = SIGNSKY_CIPHER_AES_256_GCM;
+	    suite <= SIGNSKY_CIPHER_CHACHA20_POLY1305; suite++) {
+		if (signsky_cipher_supports(suite))
+			cipher_bench(suite);
+	}
+
+	return (0);
+}
+
+/*
+ * Run all measurements for the given suite.
+ */
+static void
+cipher_bench(u_int32_t suite)
+{
+	void			*ctx;
+	struct signsky_key	key;
+	size_t			idx;
+
+	signsky->cipher = suite;
+
+	memset(&key, 0, sizeof(key));
+	memset(key.key, 0x42, sizeof(key.key));
+
+	printf("%s\n", signsky_cipher_suite_name(suite));
+	cipher_bench_setup(&key);
+
+	ctx = signsky_cipher_setup(&key);
+	cipher_selftest(ctx);
+
+	printf("%-8s %6s %6s %12s %12s %10s\n", "op", "size", "batch",
+	    "ns/packet", "cycles/byte", "Gbps");
+
+	if (only_size != 0) {
+		cipher_bench_size(ctx, only_size);
+	} else {
+		for (idx = 0; idx < NELEM(sizes); idx++) {
+			/* 9000 needs HPERF=1. */
+			if (sizes[idx] <= SIGNSKY_PACKET_DATA_LEN)
+				cipher_bench_size(ctx, sizes[idx]);
+		}
+	}
+
+	signsky_cipher_cleanup(ctx);
+	printf("\n");
+}
+
+/*
+ * Time setting up and cleaning up a cipher context.
+ */
+static void
+cipher_bench_setup(struct signsky_key *key)
+{
+	void		*ctx;
+	int		idx;
+	u_int64_t	start, cycles, ns;
+
+	ns = cipher_time_ns();
+	start = cipher_cycles();
+
+	for (idx = 0; idx < CIPHER_SETUP_ROUNDS; idx++) {
+		ctx = signsky_cipher_setup(key);
+		signsky_cipher_cleanup(ctx);
+	}
+
+	cycles = cipher_cycles() - start;
+	ns = cipher_time_ns() - ns;
+
+	printf("setup+cleanup %" PRIu64 " ns", ns / CIPHER_SETUP_ROUNDS);
+
+	if (cycles != 0)
+		printf(", %" PRIu64 " cycles", cycles / CIPHER_SETUP_ROUNDS);
+
+	printf("\n");
+}
+
+/*
+ * Measure both directions for the given packet size and each batch size.
+ */
+static void
+cipher_bench_size(void *ctx, size_t size)
+{
+	size_t		idx;
+
+	if (only_batch != 0) {
+		cipher_bench_run(ctx, size, only_batch, 1);
+		cipher_bench_run(ctx, size, only_batch, 0);
+		return;
+	}
+
+	for (idx = 0; idx < NELEM(batches); idx++) {
+		cipher_bench_run(ctx, size, batches[idx], 1);
+		cipher_bench_run(ctx, size, batches[idx], 0);
+	}
+}
+
+/*
+ * Encrypt or decrypt batches of the given size for the configured amount
+ * of time and report the cost per packet and byte.
+ */
+static void
+cipher_bench_run(void *ctx, size_t size, size_t batch, int encrypt)
+{
+	size_t		idx;
+	u_int64_t	start, end, now, cycles, count;
+
+	count = 0;
+	now = cipher_time_ns();
+	end = now + runtime * 1000000;
+
+	start = now;
+	cycles = cipher_cycles();
+
+	while (now < end) {
+		if (encrypt) {
+			for (idx = 0; idx < batch; idx++)
+				pkts[idx]->length = size;
+			signsky_cipher_encrypt_batch(ctx, ops, batch);
+		} else {
+			for (idx = 0; idx < batch; idx++) {
+				pkts[idx]->length = SIGNSKY_PACKET_HEAD_LEN +
+				    size + signsky_cipher_overhead();
+			}
+			signsky_cipher_decrypt_batch(ctx, ops, batch);
+		}
+
+		count += batch;
+		now = cipher_time_ns();
+	}
+
+	cycles = cipher_cycles() - cycles;
+	now = now - start;
+
+	printf("%-8s %6zu %6zu %12.1f", encrypt ? "encrypt" : "decrypt",
+	    size, batch, (double)now / count);
+
+	if (cycles != 0) {
+		printf(" %12.2f", (double)cycles / (count * size));
+	} else {
+		printf(" %12s", "-");
+	}
+
+	printf(" %10.2f\n", (double)(count * size * 8) / now);
+}
+
+/*
+ * Make sure what we encrypt decrypts again, before measuring anything.
+ */
+static void
+cipher_selftest(void *ctx)
+{
+	u_int8_t	*data;
+	size_t		idx;
+
+	data = signsky_packet_data(pkts[0]);
+
+	for (idx = 0; idx < 1400; idx++)
+		data[idx] = (u_int8_t)idx;
+
+	pkts[0]->length = 1400;
+	signsky_cipher_encrypt_batch(ctx, ops, 1);
+
+	pkts[0]->length += SIGNSKY_PACKET_HEAD_LEN;
+	signsky_cipher_decrypt_batch(ctx, ops, 1);
+
+	if (ops[0].ret != 0)
+		fatal("selftest: packet did not verify");
+
+	for (idx = 0; idx < 1400; idx++) {
+		if (data[idx] != (u_int8_t)idx)
+			fatal("selftest: plaintext mismatch at %zu", idx);
+	}
+}
+
+static u_int64_t
+cipher_time_ns(void)
+{
+	struct timespec		ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static u_int64_t
+cipher_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return (__builtin_ia32_rdtsc());
+#else
+	return (0);
+#endif
+}
@@ -18,6 +18,7 @@
 #include <sys/shm.h>
 
 #include <err.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -29,27 +30,31 @@
 
 /*
  * Test code for the ring buffer, you can ignore this.
+ *
+ * It forks a number of producers and consumers that move packets from
+ * the packet pool through a shared ring and back into the pool, and
+ * reports how many operations per second the ring sustains.
+ *
+ * With -s a single process does both, which measures the raw cost
+ * of the ring operations without any contention (or lack of cores).
+ * With -S the ring under test is a single-producer, single-consumer ring.
+ *
+ * Build it from the top level directory with something like:
+ *
+ *	cc -O2 -Iinclude -DSIGNSKY_HIGH_PERFORMANCE -DPLATFORM_LINUX \
+ *	    -D_GNU_SOURCE=1 -o ring test/ring.c \
+ *	    src/ring.c src/pool.c src/packet.c src/utils.c \
+ *	    src/platform_linux.c src/openssl_aes_gcm.c -lcrypto
  */
 
-#define signsky_atomic_read(x)		\
-    __atomic_load_n(x, __ATOMIC_SEQ_CST)
-
-#define signsky_atomic_write(x, v)	\
-    __atomic_store_n(x, v, __ATOMIC_SEQ_CST)
-
 #define signsky_atomic_exchange(x, e)	\
     __atomic_exchange_n(x, e, __ATOMIC_SEQ_CST)
 
-#define signsky_atomic_add(x, e)	\
-    __atomic_fetch_add(x, e, __ATOMIC_SEQ_CST)
-
-#define ring_cpu_pause()					\
-	do {							\
-		__asm__ volatile("yield" ::: "memory");		\
-	} while (0)
+static void	usage(void) __attribute__((noreturn));
 
 static void	producer(void);
 static void	consumer(void);
+static void	single(long);
 
 struct state {
 	volatile u_int64_t	produced;
@@ -57,22 +62,32 @@ struct state {
 	volatile int		stoptheworld;
 };
 
-extern struct signsky_pool	*pktpool;
-
 struct signsky_ring		*tx = NULL;
 static struct signsky_packet	*pkt = NULL;
 static u_int64_t		iters = 0;
+static size_t			burst = 1;
 struct state			*state = NULL;
+struct signsky_state		*signsky = NULL;
+static struct signsky_proc_stats	stats;
+struct signsky_proc_stats	*signsky_stats = &stats;
 const char			*procname = "parent";
 
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: ring [-sS] [-b burst] [-c consumers] "
+	    "[-p producers] [-t seconds]\n");
+	exit(1);
+}
+
 void
 fatal(const char *fmt, ...)
 {
 	va_list		args;
 
 	va_start(args, fmt);
-	printf("%s(pid=%d,iters=%llu,pkt=%p): ", procname, getpid(), iters,
-	    (void *)pkt);
+	printf("%s(pid=%d,iters=%" PRIu64 ",pkt=%p): ", procname,
+	    getpid(), iters, (void *)pkt);
 	vprintf(fmt, args);
 	printf("\n");
 	va_end(args);
@@ -83,9 +98,51 @@ fatal(const char *fmt, ...)
 int
 main(int argc, char *argv[])
 {
-	u_int64_t	nr;
-	int		idx, key;
 	time_t		last, now;
+	u_int32_t	type;
+	int		ch, idx, key, inline_run;
+	u_int64_t	nr, total, seconds;
+	long		producers, consumers, runtime;
+
+	runtime = 0;
+	inline_run = 0;
+	type = SIGNSKY_RING_MPMC;
+	producers = 2;
+	consumers = 2;
+
+	while ((ch = getopt(argc, argv, "b:c:p:sSt:")) != -1) {
+		switch (ch) {
+		case 'b':
+			burst = strtoul(optarg, NULL, 10);
+			if (burst == 0 || burst > SIGNSKY_PACKETS_PER_EVENT)
+				errx(1, "burst must be 1-%d",
+				    SIGNSKY_PACKETS_PER_EVENT);
+			break;
+		case 'c':
+			consumers = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			producers = strtol(optarg, NULL, 10);
+			break;
+		case 's':
+			inline_run = 1;
+			break;
+		case 'S':
+			type = SIGNSKY_RING_SPSC;
+			break;
+		case 't':
+			runtime = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (producers <= 0 || consumers <= 0 || runtime < 0)
+		usage();
+
+	if (type == SIGNSKY_RING_SPSC && (producers != 1 || consumers != 1))
+		errx(1, "a spsc ring needs exactly 1 producer and 1 consumer");
 
 	key = shmget(IPC_PRIVATE, sizeof(*state), IPC_CREAT | IPC_EXCL | 0700);
 	if (key == -1)
@@ -96,8 +153,14 @@ main(int argc, char *argv[])
 	if ((state = shmat(key, NULL, 0)) == (void *)-1)
 		err(1, "shmat");
 
+	signsky = signsky_alloc_shared(sizeof(*signsky), NULL);
+	signsky->pool_numa = -1;
+
+	for (idx = 0; idx < SIGNSKY_PACKET_CLASS_MAX; idx++)
+		signsky->pool[idx] = SIGNSKY_PACKET_POOL_DEFAULT;
+
 	signsky_packet_init();
-	tx = signsky_ring_alloc(1024);
+	tx = signsky_ring_alloc(1024, type);
 
 	state->consumed = 0;
 	state->produced = 0;
@@ -105,16 +168,26 @@ main(int argc, char *argv[])
 
 	(void)shmctl(key, IPC_RMID, NULL);
 
+	if (inline_run) {
+		single(runtime > 0 ? runtime : 5);
+		return (0);
+	}
+
 	printf("parent is %d\n", getpid());
+	printf("producers=%ld, consumers=%ld, burst=%zu, spsc=%d\n",
+	    producers, consumers, burst, type == SIGNSKY_RING_SPSC);
 	printf("=====================================\n");
 	fflush(stdout);
 
-	for (idx = 0; idx < 2; idx++)
+	for (idx = 0; idx < producers; idx++)
 		producer();
 
-	for (idx = 0; idx < 2; idx++)
+	for (idx = 0; idx < consumers; idx++)
 		consumer();
 
+	total = 0;
+	seconds = 0;
+
 	time(&now);
 	last = now;
 
@@ -125,23 +198,35 @@ main(int argc, char *argv[])
 			signsky_atomic_write(&state->stoptheworld, 1);
 
 			nr = signsky_atomic_exchange(&state->produced, 0);
-			printf("produced: %llu\n", nr);
+			printf("produced: %" PRIu64 "\n", nr);
 
 			nr = signsky_atomic_exchange(&state->consumed, 0);
-			printf("consumed: %llu\n", nr);
+			printf("consumed: %" PRIu64 " ops/sec\n", nr);
 
 			printf("tx pending: %zu\n", signsky_ring_pending(tx));
 
-			printf("pkt available in pool: %zu\n",
-			    signsky_ring_pending(&pktpool->queue));
+			signsky_packet_sample();
+			printf("pkt in use from pool: %u\n", signsky->rings[
+			    SIGNSKY_RING_POOL_LARGE].last);
+
+			total += nr;
+			seconds++;
 
 			signsky_atomic_write(&state->stoptheworld, 0);
 			fflush(stdout);
+
+			if (runtime > 0 && seconds >= (u_int64_t)runtime)
+				break;
 		}
 
 		sleep(1);
 	}
 
+	printf("=====================================\n");
+	printf("average: %" PRIu64 " ops/sec\n", total / seconds);
+
+	signsky_atomic_write(&state->stoptheworld, 2);
+
 	if (shmdt(state) == -1)
 		warn("shmdt");
 
@@ -152,6 +237,8 @@ static void
 producer(void)
 {
 	pid_t			pid;
+	size_t			idx, count, queued;
+	void			*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	if ((pid = fork()) == -1)
 		err(1, "fork");
@@ -166,17 +253,30 @@ producer(void)
 
 	for (;;) {
 		while (signsky_atomic_read(&state->stoptheworld) == 1)
-			ring_cpu_pause();
+			signsky_cpu_pause();
 
-		if ((pkt = signsky_packet_get()) == NULL)
-			continue;
+		if (signsky_atomic_read(&state->stoptheworld) == 2)
+			exit(0);
 
-		if (signsky_ring_queue(tx, pkt) == -1) {
-			signsky_packet_release(pkt);
+		for (count = 0; count < burst; count++) {
+			if ((pkt = signsky_packet_get()) == NULL)
+				break;
+			pkts[count] = pkt;
+		}
+
+		if (count == 0)
 			continue;
+
+		if (burst == 1) {
+			queued = signsky_ring_queue(tx, pkts[0]) == -1 ? 0 : 1;
+		} else {
+			queued = signsky_ring_queue_burst(tx, pkts, count);
 		}
 
-		signsky_atomic_add(&state->produced, 1);
+		for (idx = queued; idx < count; idx++)
+			signsky_packet_release(pkts[idx]);
+
+		signsky_atomic_add(&state->produced, queued);
 	}
 }
 
@@ -184,6 +284,8 @@ static void
 consumer(void)
 {
 	pid_t		pid;
+	size_t		idx, count;
+	void		*pkts[SIGNSKY_PACKETS_PER_EVENT];
 
 	if ((pid = fork()) == -1)
 		err(1, "fork");
@@ -198,12 +300,78 @@ consumer(void)
 
 	for (;;) {
 		while (signsky_atomic_read(&state->stoptheworld) == 1)
-			ring_cpu_pause();
+			signsky_cpu_pause();
+
+		if (signsky_atomic_read(&state->stoptheworld) == 2)
+			exit(0);
+
+		if (burst == 1) {
+			if ((pkts[0] = signsky_ring_dequeue(tx)) == NULL)
+				continue;
+			count = 1;
+		} else {
+			count = signsky_ring_dequeue_burst(tx, pkts, burst);
+		}
 
-		while ((pkt = signsky_ring_dequeue(tx)) != NULL) {
+		for (idx = 0; idx < count; idx++) {
+			pkt = pkts[idx];
 			signsky_packet_release(pkt);
-			signsky_atomic_add(&state->consumed, 1);
 			iters++;
 		}
+
+		signsky_atomic_add(&state->consumed, count);
+	}
+}
+
+static void
+single(long runtime)
+{
+	time_t		start, now;
+	u_int64_t	ops, loops;
+	size_t		idx, count, queued;
+	void		*pkts[SIGNSKY_PACKETS_PER_EVENT];
+
+	ops = 0;
+	loops = 0;
+	procname = "single";
+
+	printf("single process, burst=%zu\n", burst);
+
+	time(&start);
+
+	for (;;) {
+		for (count = 0; count < burst; count++) {
+			if ((pkt = signsky_packet_get()) == NULL)
+				fatal("pool empty");
+			pkts[count] = pkt;
+		}
+
+		if (burst == 1) {
+			if (signsky_ring_queue(tx, pkts[0]) == -1)
+				fatal("queue failed");
+			if ((pkts[0] = signsky_ring_dequeue(tx)) == NULL)
+				fatal("dequeue failed");
+		} else {
+			queued = signsky_ring_queue_burst(tx, pkts, count);
+			if (queued != count)
+				fatal("queue burst failed");
+			queued = signsky_ring_dequeue_burst(tx, pkts, count);
+			if (queued != count)
+				fatal("dequeue burst failed");
+		}
+
+		for (idx = 0; idx < count; idx++)
+			signsky_packet_release(pkts[idx]);
+
+		ops += count;
+
+		if ((++loops & 0xffff) == 0) {
+			time(&now);
+			if (now - start >= runtime)
+				break;
+		}
 	}
+
+	time(&now);
+	printf("average: %" PRIu64 " ops/sec\n", ops / (now - start));
 }